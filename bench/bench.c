@@ -0,0 +1,280 @@
+// Measures the overhead of tracking allocations
+// Build once per configuration, BENCH_CONFIG names the configuration in the output
+// Prints one CSV line per operation, allocation size, live set size and thread count
+// Usage: bench [-s sizes] [-l live blocks] [-t threads] [-n ops per thread] [-m max live bytes]
+// Lists are comma separated, e.g. bench -s 16,256 -l 1000,1000000 -t 1,4
+// Configurations which are not thread safe only run on one thread, bench_threadsafe measures the default with locking
+
+#ifdef BENCH_RAW
+#define bench_malloc(size)		 malloc(size)
+#define bench_calloc(num, size)	 calloc(num, size)
+#define bench_realloc(ptr, size) realloc(ptr, size)
+#define bench_free(ptr)			 free(ptr)
+#else
+#define MP_IMPLEMENTATION
+// Keep stdout for the results
+#include <stdio.h>
+#define MP_MESSAGE(m) fprintf(stderr, "%s\n", m)
+#include "magpie.h"
+#define bench_malloc(size)		 mp_malloc(size)
+#define bench_calloc(num, size)	 mp_calloc(num, size)
+#define bench_realloc(ptr, size) mp_realloc(ptr, size)
+#define bench_free(ptr)			 mp_free(ptr)
+#endif
+// Some configurations imply MP_THREAD_SAFE, the counters of MP_DISABLE are atomic
+#if defined(BENCH_RAW) || defined(MP_THREAD_SAFE) || defined(MP_DISABLE)
+#define BENCH_THREAD_SAFE 1
+#else
+#define BENCH_THREAD_SAFE 0
+#endif
+// magpie.h needs to be included before stdlib.h
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#define BENCH_STR_(x) #x
+#define BENCH_STR(x)  BENCH_STR_(x)
+#ifndef BENCH_CONFIG
+#define BENCH_CONFIG unknown
+#endif
+
+#define BENCH_MAX_LIST 16
+
+enum BenchOp
+{
+	BENCH_MALLOC,
+	BENCH_FREE,
+	BENCH_MALLOC_FREE,
+	BENCH_CALLOC_FREE,
+	BENCH_REALLOC,
+	BENCH_OP_COUNT
+};
+
+static const char* bench_op_names[BENCH_OP_COUNT] = {"malloc", "free", "malloc_free", "calloc_free", "realloc"};
+
+struct BenchCase
+{
+	size_t size;
+	size_t live;
+	size_t threads;
+	size_t ops;
+	void** slots;
+	pthread_barrier_t barrier;
+};
+
+struct BenchWorker
+{
+	struct BenchCase* c;
+	size_t index;
+	pthread_t thread;
+	// Nanoseconds and operations measured per operation kind
+	double ns[BENCH_OP_COUNT];
+	size_t count[BENCH_OP_COUNT];
+};
+
+static double bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static inline uint64_t bench_rand(uint64_t* state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
+}
+
+// Touches the block so the allocator can not skip committing it
+static inline void* bench_touch(void* ptr)
+{
+	*(volatile char*)ptr = 1;
+	return ptr;
+}
+
+void* bench_worker(void* arg)
+{
+	struct BenchWorker* w = arg;
+	struct BenchCase* c = w->c;
+	// Every thread owns a contiguous range of the live set
+	size_t begin = c->live * w->index / c->threads;
+	size_t n = c->live * (w->index + 1) / c->threads - begin;
+	void** slots = c->slots + begin;
+	size_t size = c->size;
+	uint64_t rng = 0x9e3779b97f4a7c15ull * (w->index + 1);
+
+	for (size_t i = 0; i < n; i++)
+		slots[i] = bench_touch(bench_malloc(size));
+
+	// Free and allocate every other block in rounds until enough operations are measured
+	pthread_barrier_wait(&c->barrier);
+	while (w->count[BENCH_MALLOC] < c->ops)
+	{
+		double start = bench_now();
+		for (size_t i = 1; i < n; i += 2)
+			bench_free(slots[i]);
+		double mid = bench_now();
+		for (size_t i = 1; i < n; i += 2)
+			slots[i] = bench_touch(bench_malloc(size));
+		double end = bench_now();
+		w->ns[BENCH_FREE] += mid - start;
+		w->ns[BENCH_MALLOC] += end - mid;
+		w->count[BENCH_FREE] += n / 2;
+		w->count[BENCH_MALLOC] += n / 2;
+	}
+
+	// Replace random blocks of the live set
+	pthread_barrier_wait(&c->barrier);
+	double start = bench_now();
+	for (size_t i = 0; i < c->ops; i++)
+	{
+		size_t j = bench_rand(&rng) % n;
+		bench_free(slots[j]);
+		slots[j] = bench_touch(bench_malloc(size));
+	}
+	w->ns[BENCH_MALLOC_FREE] = bench_now() - start;
+	w->count[BENCH_MALLOC_FREE] = c->ops;
+
+	pthread_barrier_wait(&c->barrier);
+	start = bench_now();
+	for (size_t i = 0; i < c->ops; i++)
+	{
+		size_t j = bench_rand(&rng) % n;
+		bench_free(slots[j]);
+		slots[j] = bench_touch(bench_calloc(1, size));
+	}
+	w->ns[BENCH_CALLOC_FREE] = bench_now() - start;
+	w->count[BENCH_CALLOC_FREE] = c->ops;
+
+	// Grow or shrink random blocks between size and twice the size
+	pthread_barrier_wait(&c->barrier);
+	start = bench_now();
+	for (size_t i = 0; i < c->ops; i++)
+	{
+		uint64_t x = bench_rand(&rng);
+		size_t j = x % n;
+		slots[j] = bench_touch(bench_realloc(slots[j], (x >> 32) & 1 ? size * 2 : size));
+	}
+	w->ns[BENCH_REALLOC] = bench_now() - start;
+	w->count[BENCH_REALLOC] = c->ops;
+
+	for (size_t i = 0; i < n; i++)
+		bench_free(slots[i]);
+	return NULL;
+}
+
+void bench_run(size_t size, size_t live, size_t threads, size_t ops)
+{
+	struct BenchCase c = {size, live, threads, ops, NULL};
+	c.slots = malloc(live * sizeof(*c.slots));
+	struct BenchWorker* workers = calloc(threads, sizeof(*workers));
+	pthread_barrier_init(&c.barrier, NULL, threads);
+	for (size_t i = 0; i < threads; i++)
+	{
+		workers[i].c = &c;
+		workers[i].index = i;
+		pthread_create(&workers[i].thread, NULL, bench_worker, &workers[i]);
+	}
+	for (size_t i = 0; i < threads; i++)
+		pthread_join(workers[i].thread, NULL);
+
+	for (size_t op = 0; op < BENCH_OP_COUNT; op++)
+	{
+		// The slowest thread decides the throughput
+		double ns = 0;
+		size_t count = 0;
+		for (size_t i = 0; i < threads; i++)
+		{
+			double per_op = workers[i].ns[op] / workers[i].count[op];
+			if (per_op > ns)
+				ns = per_op;
+			count += workers[i].count[op];
+		}
+		printf("%s,%s,%zu,%zu,%zu,%zu,%.2f,%.3f\n", BENCH_STR(BENCH_CONFIG), bench_op_names[op], size, live,
+			   threads, count, ns, threads * 1e3 / ns);
+		fflush(stdout);
+	}
+
+	pthread_barrier_destroy(&c.barrier);
+	free(workers);
+	free(c.slots);
+}
+
+// Parses a comma separated list into values
+// Returns the number of values
+size_t bench_parse_list(const char* str, size_t* values)
+{
+	size_t count = 0;
+	while (*str && count < BENCH_MAX_LIST)
+	{
+		char* end;
+		values[count++] = strtoull(str, &end, 10);
+		str = *end == ',' ? end + 1 : end + strlen(end);
+	}
+	return count;
+}
+
+int main(int argc, char** argv)
+{
+	size_t sizes[BENCH_MAX_LIST] = {16, 256, 4096};
+	size_t size_count = 3;
+	size_t lives[BENCH_MAX_LIST] = {1000, 100000, 10000000};
+	size_t live_count = 3;
+	size_t threads[BENCH_MAX_LIST] = {1, 4};
+	size_t thread_count = 2;
+	size_t ops = 1000000;
+	// Cases with a bigger live set are skipped
+	size_t max_bytes = (size_t)1 << 30;
+
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-s") == 0)
+			size_count = bench_parse_list(argv[i + 1], sizes);
+		else if (strcmp(argv[i], "-l") == 0)
+			live_count = bench_parse_list(argv[i + 1], lives);
+		else if (strcmp(argv[i], "-t") == 0)
+			thread_count = bench_parse_list(argv[i + 1], threads);
+		else if (strcmp(argv[i], "-n") == 0)
+			ops = strtoull(argv[i + 1], NULL, 10);
+		else if (strcmp(argv[i], "-m") == 0)
+			max_bytes = strtoull(argv[i + 1], NULL, 10);
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	puts("config,op,size,live,threads,ops,ns_per_op,mops_per_s");
+	for (size_t s = 0; s < size_count; s++)
+	{
+		for (size_t l = 0; l < live_count; l++)
+		{
+			for (size_t t = 0; t < thread_count; t++)
+			{
+				// Every thread needs at least two blocks to free and allocate every other one
+				if (sizes[s] == 0 || threads[t] == 0 || lives[l] < threads[t] * 2 ||
+					sizes[s] * lives[l] > max_bytes)
+					continue;
+				if (threads[t] > 1 && !BENCH_THREAD_SAFE)
+				{
+					if (s == 0 && l == 0)
+						fprintf(stderr, "Skipping %zu threads, %s is not thread safe\n", threads[t],
+								BENCH_STR(BENCH_CONFIG));
+					continue;
+				}
+				bench_run(sizes[s], lives[l], threads[t], ops);
+			}
+		}
+	}
+#ifndef BENCH_RAW
+	mp_terminate();
+#endif
+	return 0;
+}
@@ -0,0 +1,87 @@
+// Measures the kernels checking padding and freed blocks for the fill value
+// Prints one CSV line per kernel and length, the dispatched kernel is the one magpie picks for this cpu
+// Usage: verify [-l lengths]
+// Lengths are comma separated, e.g. verify -l 5,64,4096
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#include <stdio.h>
+#include "magpie.h"
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MAX_LIST 16
+
+struct Kernel
+{
+	const char* name;
+	size_t (*find)(const char* p, size_t len);
+};
+
+static size_t dispatched(const char* p, size_t len)
+{
+	return mp_find_unfilled(p, len);
+}
+
+static double bench_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+int main(int argc, char** argv)
+{
+	size_t lengths[BENCH_MAX_LIST] = {5, 16, 64, 256, 4096, 65536, 1 << 20};
+	size_t length_count = 7;
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-l") == 0)
+		{
+			length_count = 0;
+			for (char* it = strtok(argv[i + 1], ","); it && length_count < BENCH_MAX_LIST; it = strtok(NULL, ","))
+				lengths[length_count++] = strtoull(it, NULL, 10);
+		}
+	}
+
+	struct Kernel kernels[5] = {{"byte", mp_find_unfilled_byte}, {"word", mp_find_unfilled_word}};
+	size_t kernel_count = 2;
+#ifdef MP_SIMD_X86
+	kernels[kernel_count++] = (struct Kernel){"sse2", mp_find_unfilled_sse2};
+	if (__builtin_cpu_supports("avx2"))
+		kernels[kernel_count++] = (struct Kernel){"avx2", mp_find_unfilled_avx2};
+#endif
+	kernels[kernel_count++] = (struct Kernel){"dispatched", dispatched};
+
+	printf("kernel,len,checks,ns_per_check,gib_per_s\n");
+	for (size_t l = 0; l < length_count; l++)
+	{
+		size_t len = lengths[l];
+		// Allocated with the padding unchecked by magpie so only the kernels touch it
+		char* buf = mp_malloc(len + 1);
+		memset(buf, MP_BUFFER_PAD_VAL, len);
+		// Around 1 GiB checked per case
+		size_t checks = (1ull << 30) / (len ? len : 1);
+		checks = checks < 1000 ? 1000 : checks > 50000000 ? 50000000 : checks;
+		for (size_t k = 0; k < kernel_count; k++)
+		{
+			volatile size_t sink = 0;
+			double start = bench_now();
+			for (size_t i = 0; i < checks; i++)
+			{
+				// Keep the compiler from hoisting the check out of the loop
+				__asm__ volatile("" ::: "memory");
+				sink += kernels[k].find(buf, len);
+			}
+			double ns = (bench_now() - start) / checks;
+			if (sink != checks * len)
+			{
+				fprintf(stderr, "Kernel %s failed on %zu bytes\n", kernels[k].name, len);
+				return 1;
+			}
+			printf("%s,%zu,%zu,%.2f,%.2f\n", kernels[k].name, len, checks, ns, len / ns / 1.073741824);
+		}
+		mp_free(buf);
+	}
+	mp_terminate();
+	return 0;
+}
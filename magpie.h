@@ -15,6 +15,7 @@
 // #define MP_IMPLEMENTATION in ONE C file to create the function implementations before including the header
 // To configure the library, add the defines under =CONFIGURATION= above including the header in the same C file you
 // defined MP_IMPLEMENTATION
+// C++ files include magpie.hpp instead, which also routes new and delete through magpie
 
 // ==============================================================================
 
@@ -22,9 +23,11 @@
 // MP_DISABLE to turn off storing and tracking of memory blocks and only keeps track of number of allocations by incremention and decremention
 // -> This disabled almost the whole library including checks for leaks, pointer validity, overflow and almost all else
 // -> Use in RELEASE builds
-// -> Only available features will be message on failed allocation (malloc returns NULL), and allocation count
-// -> Allocation size is not tracked since size of pointer cannot be known without tracking
-// MP_REPLACE_STD to replace the standard malloc, calloc, realloc, and free
+// -> Only available features will be message on failed allocation (malloc returns NULL), and allocation count and size
+// -> Allocation size is counted by the usable size of blocks where the platform provides it, otherwise only grows
+// -> Counters are striped over cache lines picked per thread and are safe to use from several threads
+// MP_COUNTER_STRIPES (default 16) sets how many cache lines the counters of MP_DISABLE are spread over, must be a power of two
+// MP_REPLACE_STD to replace the standard malloc, calloc, realloc, free, aligned_alloc and posix_memalign
 // MP_CHECK_OVERFLOW to be able to validate and detect overflows automatically on free or explicitely
 // MP_BUFFER_PAD_LEN (default 5) sets the size of the padding in bytes for detecting overflows
 // -> Higher values require a bit more memory and checking but catches sparse overflows better
@@ -32,8 +35,78 @@
 // -> This value should be a character not often used to avoid false negatives since overflow can't be detected if the same character is written
 // -> DO NOT use '\0' or 0 as it is the most common character to overflow
 // MP_FILL_ON_FREE to fill buffer on free with MP_BUFFER_PAD_VAL, this is to avoid reading a pointers data after it has been freed and not overwritten by others
+// MP_NO_SIMD to only use the portable kernels for checking padding and freed blocks
+// -> Otherwise SSE2 and AVX2 kernels are picked at runtime on x86 with GCC or Clang, which pays off for long padding and MP_QUARANTINE
 // MP_MESSAGE (default puts) define your own message callback
 // MP_WARN_NULL to warn when freeing NULL pointer. This is allowed in the specifications of free, but may be a bug of a value that never got initialized
+// MP_ALLOW_FOREIGN to pass pointers magpie does not track to the underlying realloc and free instead of reporting them
+// -> For when magpie replaces malloc of a whole process and also sees blocks it did not allocate, see preload/magpie_preload.c
+// -> Invalid and double frees are then left to the underlying allocator to detect
+// MP_THREAD_SAFE to make tracking safe to use from several threads at once
+// -> The hashtable is split into independently locked shards selected by the pointer hash
+// -> Requires pthreads
+// MP_SHARD_COUNT (default 16 with MP_THREAD_SAFE, otherwise 1) sets the number of hashtable shards, must be a power of two
+// -> More shards means less contention between threads freeing and allocating at the same time
+// MP_THREAD_CACHE to record allocations and counter changes in per thread caches which are published in batches, implies MP_THREAD_SAFE
+// -> Freeing a block which is still in the cache of the same thread never touches shared state
+// -> Caches are published when full, on thread exit, and in mp_terminate
+// MP_THREAD_CACHE_LEN (default 64) sets how many allocations a thread can hold before publishing them
+// MP_SEPARATE_META to store block info in slabs of fixed size records instead of in front of every allocation
+// -> User blocks are allocated at their requested size plus MP_BUFFER_PAD_LEN, which fits malloc size classes better
+// -> Keeps tracking info out of the cache lines of user data
+// MP_SLAB_LEN (default 1024) sets how many block records are allocated at once with MP_SEPARATE_META
+// MP_SAMPLE to only track a random sample of allocations, implies MP_SEPARATE_META
+// -> Allocations are sampled by bytes, on average one sample per MP_SAMPLE_INTERVAL bytes allocated
+// -> Unsampled allocations go straight to malloc and are not checked for leaks, overflows or invalid frees
+// -> mp_print_locations reports estimated allocation counts and bytes scaled from the samples
+// -> The size of unsampled blocks is counted by their usable size where the platform provides it
+// MP_SAMPLE_INTERVAL (default 512 KiB) sets the mean number of bytes between samples, can be changed with mp_set_sample_interval
+// MP_TRACE to record every tracked malloc, calloc, realloc and free as a binary event between mp_trace_start and mp_trace_stop, implies MP_THREAD_SAFE
+// -> Events are appended to lock free per thread ring buffers and written to the file by a background thread
+// -> Events are dropped and the next event flagged with MP_TRACE_FLAG_DROPPED when a ring is full
+// MP_TRACE_LOSSLESS to make threads wait for the writer instead of dropping events, for recording traces to replay
+// MP_TRACE_RING_LEN (default 4096) sets how many events each thread can buffer, must be a power of two
+// MP_TRACE_FLUSH_MS (default 10) sets how long the writer sleeps when there are no events to write
+// MP_BACKTRACE to record the call stack of every tracked allocation, leaks and locations are then reported per stack
+// -> Stacks are walked through frame pointers, build with -fno-omit-frame-pointer so no frames are skipped
+// -> Identical stacks from the same location are stored once and shared by all their blocks
+// -> Frames are named with backtrace_symbols on glibc, link with -rdynamic to get the names of functions in the executable
+// MP_BACKTRACE_DEPTH (default 16) sets the maximum number of frames recorded per stack
+// MP_GUARD_PAGES to place selected blocks at the end of their own pages followed by an inaccessible guard page, implies MP_SEPARATE_META
+// -> Writing or reading past the end of a guarded block faults on the offending instruction instead of being found on free
+// -> Blocks are selected by size, rate and site with mp_set_guard and mp_guard_site, by default every block is guarded
+// -> Mappings of freed blocks are pooled and reused without system calls, every guarded block still takes at least two pages
+// -> Every guarded block is two mappings, which count against the limit of vm.max_map_count, so guard a selection in large programs
+// -> Guarded blocks are aligned to MP_GUARD_ALIGN, or to the largest power of two dividing their size if that is larger
+// MP_GUARD_ALIGN (default _Alignof(max_align_t)) sets the minimum alignment of guarded blocks, must be a power of two
+// -> Overflows into the up to MP_GUARD_ALIGN - 1 bytes before the guard page are only found by MP_CHECK_OVERFLOW
+// -> 1 places every block right against its guard page, but blocks of odd size then get odd addresses unlike from malloc
+// MP_GUARD_MIN_SIZE (default 0), MP_GUARD_MAX_SIZE (default SIZE_MAX) and MP_GUARD_RATE (default 1) set the selection until changed by mp_set_guard
+// MP_GUARD_POOL_LEN (default 1024) sets how many free mappings of each size up to 8 pages are kept for reuse
+// MP_GUARD_SITES (default 16) sets how many sites can be selected with mp_guard_site
+// MP_QUARANTINE to hold freed blocks in a first in first out quarantine before releasing them, implies MP_FILL_ON_FREE
+// -> Blocks leaving the quarantine are checked to still be filled with MP_BUFFER_PAD_VAL
+// -> A write after free is reported with where the block was allocated and where it was freed
+// -> Blocks leave in batches once the quarantine is full, and all remaining blocks are checked in mp_terminate
+// -> Freeing a pointer again while it is in the quarantine reports where it was first freed
+// -> Only blocks released by free are quarantined, realloc releases the old bytes directly
+// MP_QUARANTINE_SIZE (default 4 MiB) sets how many freed bytes are held, larger blocks are released directly
+// MP_QUARANTINE_LEN (default 4096) sets how many freed blocks are held
+// MP_QUARANTINE_BATCH (default 32) sets how many blocks are checked and released at once
+// MP_SCAN to check the padding of live blocks from a background thread started by mp_scan_start, implies MP_CHECK_OVERFLOW and MP_THREAD_SAFE
+// -> Shards are walked a slice of slots at a time, so no shard is locked for longer than one slice
+// -> The thread runs under SCHED_IDLE on Linux and sleeps after every slice to stay within its share of a cpu
+// -> An overflowed block is reported with where it was allocated and its padding is restored, so it is reported once
+// -> Blocks still pending in a thread cache are checked once published
+// MP_SCAN_SLICE (default 256) sets how many slots are checked per slice
+// MP_SCAN_PERIOD_MS (default 1000) sets the least time from the start of one pass over the live set to the next
+// MP_SHM to publish live statistics to POSIX shared memory from a background thread started by mp_shm_start, implies MP_THREAD_SAFE
+// -> The global counters and the sites with the most live bytes are copied, allocations themselves do no extra work
+// -> Readers in other processes, like tools/mp_top, see a consistent update through a sequence counter
+// MP_SHM_SITES (default 32) sets how many sites are published
+// MP_SHM_PERIOD_MS (default 500) sets the time between updates
+// MP_RESIZE_STEP (default 16) sets how many slots are moved per malloc or free while a hashtable shard is resizing
+// -> Resizing is spread over many operations so no single malloc or free pays for rehashing every block
 
 // MP_CHECK_FULL to define MP_REPLACE_STD, MP_CHECK_OVERFLOW, MP_FILL_ON_FREE
 
@@ -44,7 +117,8 @@
 #ifndef MAGPIE_H
 #define MAGPIE_H
 
-#ifdef _STDLIB_H
+// C++ headers include stdlib.h, C++ files include magpie.hpp which does not replace the standard functions
+#if defined(_STDLIB_H) && !defined(__cplusplus)
 #error "stdlib.h should not be included before magpie.h"
 #endif
 #include <stdint.h>
@@ -62,6 +136,11 @@
 #endif
 #endif
 
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
 #define MP_VALIDATE_OK		 0
 #define MP_VALIDATE_INVALID	 -1
 #define MP_VALIDATE_OVERFLOW -2
@@ -70,6 +149,7 @@
 size_t mp_get_total_count();
 
 // Returns the total number of bytes allocated
+// A realloc only adds the bytes it grows a block by and never subtracts
 size_t mp_get_total_size();
 
 // Returns the current number of blocks allocated
@@ -78,9 +158,55 @@ size_t mp_get_count();
 // Returns the current number of bytes allocated
 size_t mp_get_size();
 
+// Returns the highest number of blocks allocated at once
+// With MP_THREAD_CACHE or MP_DISABLE the peak is only seen when counters are published or read, so short spikes
+// between two batches may be missed
+size_t mp_get_peak_count();
+
+// Returns the highest number of bytes allocated at once
+// Is exact under the same conditions as mp_get_peak_count
+size_t mp_get_peak_size();
+
 // Prints the locations of all [c,a,re]allocs and how many allocations was performed there
+// With MP_BACKTRACE the call stacks are printed first
 void mp_print_locations();
 
+// Formats of mp_dump_heap_profile
+// Legacy heap profile read by pprof with live and total allocations
+#define MP_PROFILE_PPROF 0
+// Collapsed stacks read by flamegraph.pl, valued by live bytes
+#define MP_PROFILE_COLLAPSED_LIVE 1
+// Collapsed stacks valued by all bytes ever allocated
+#define MP_PROFILE_COLLAPSED_TOTAL 2
+
+// Writes the allocations of every location, or of every call stack with MP_BACKTRACE, to the file at path
+// format is MP_PROFILE_[PPROF,COLLAPSED_LIVE,COLLAPSED_TOTAL]
+// Returns 0 on success, -1 if the file could not be written or magpie is disabled
+int mp_dump_heap_profile(const char* path, int format);
+
+// Sets the mean number of bytes allocated between samples with MP_SAMPLE
+// Takes effect for each thread after its next sample
+void mp_set_sample_interval(size_t bytes);
+
+// Selects which allocations are placed in front of a guard page with MP_GUARD_PAGES
+// Blocks of min_size to max_size bytes are eligible, one in rate eligible allocations of each thread is guarded
+void mp_set_guard(size_t min_size, size_t max_size, size_t rate);
+
+// Only guards allocations made at file:line with MP_GUARD_PAGES, or anywhere in file if line is 0
+// file is matched against the end of the path of a location, so "parser.c" selects "src/parser.c"
+// Can be called again to select more sites, the size range and rate of mp_set_guard still apply
+// Returns 0, or -1 if MP_GUARD_SITES sites are already selected or magpie is built without MP_GUARD_PAGES
+int mp_guard_site(const char* file, uint32_t line);
+
+// Starts a new generation of blocks and returns its number
+// Every block is stamped with the generation it was allocated in, so taking a snapshot copies nothing
+uint32_t mp_snapshot();
+
+// Reports the blocks per location allocated after snapshot a and before snapshot b which are still allocated
+// Blocks freed after b are not reported, so call it right after taking b
+// Returns the number of blocks reported
+size_t mp_snapshot_diff(uint32_t a, uint32_t b);
+
 // Checks if any blocks remain to be freed
 // Should only be run at the end of the program execution
 // Uses the msg
@@ -89,20 +215,248 @@ void mp_print_locations();
 // Releases all internal resources
 size_t mp_terminate();
 
+// Number of buckets in the size histogram of a location
+// Bucket i counts sizes from 2^(i-1) up to 2^i - 1, bucket 0 counts 0 bytes and the last bucket all larger sizes
+#define MP_SIZE_BUCKETS 32
+
+// Describes the location of a malloc
+// Used to track where allocations come from and how many has been allocated from the same place in the code
+// Every call site of the allocation macros owns a static location which is registered on first use
+struct MPAllocLocation
+{
+	const char* file;
+	uint32_t line;
+	// How many allocations have been done at file:line
+	// Does not decrement on free
+	uint32_t count;
+	// MP_LOCATION_STATIC or MP_LOCATION_DYNAMIC once added to the location table, otherwise 0
+	uint32_t registered;
+	// Unique id given when added to the location table
+	uint32_t id;
+	// Nonzero if file:line is selected by mp_guard_site
+	uint32_t guard;
+	// Blocks and bytes from file:line which are still allocated
+	size_t live_count;
+	size_t live_size;
+	// Bytes allocated at file:line, including growth by realloc
+	// Does not decrement on free
+	size_t total_size;
+	// Highest live_size seen
+	size_t peak_size;
+	// Reallocations of blocks from file:line, how many of them moved the block and the bytes those copied
+	size_t realloc_count;
+	size_t realloc_moved;
+	size_t realloc_copied;
+	// Allocations from file:line by log2 of their size
+	uint32_t size_histogram[MP_SIZE_BUCKETS];
+	// Return address of an allocation from file:line, names the location in heap profiles
+	void* caller;
+	// Number of allocations and bytes estimated from the samples with MP_SAMPLE
+	size_t estimated_count;
+	size_t estimated_bytes;
+};
+
+#define MP_LOCATION_STATIC	1
+#define MP_LOCATION_DYNAMIC 2
+
+// Returns the location for file:line
+// Used when the compiler can not create a static location per call site
+struct MPAllocLocation* mp_location_internal(const char* file, uint32_t line);
+
+// Evaluates to a pointer to the location of the call site
+#if defined(__GNUC__)
+#define MP_LOCATION()                                                                                                  \
+	__extension__({                                                                                                    \
+		static struct MPAllocLocation mp_location_ = {__FILE__, __LINE__, 0, 0};                                       \
+		&mp_location_;                                                                                                 \
+	})
+#else
+#define MP_LOCATION() mp_location_internal(__FILE__, __LINE__)
+#endif
+
+// Binary allocation trace written with MP_TRACE
+// All values are in native byte order, every part starts at a multiple of 8 bytes so the file can be mapped
+// [struct MPTraceHeader]
+// [struct MPTraceChunk][event_count * struct MPTraceEvent] repeated
+// [struct MPTraceSiteTable][count * struct MPTraceSite][file names]
+// The site table and the totals of the header are written when the trace stops
+// A trace which was not stopped has a site_offset of 0 and its chunks continue until the end of the file
+#define MP_TRACE_MAGIC	 "MPTRACE"
+#define MP_TRACE_VERSION 2
+
+#define MP_TRACE_MALLOC	 1
+#define MP_TRACE_CALLOC	 2
+#define MP_TRACE_REALLOC 3
+#define MP_TRACE_FREE	 4
+
+// Events of the same thread were dropped before this one since its buffer was full
+#define MP_TRACE_FLAG_DROPPED 1
+
+struct MPTraceHeader
+{
+	char magic[8];
+	uint32_t version;
+	// Size of struct MPTraceEvent
+	uint32_t event_size;
+	// Offset of the site table from the start of the file, 0 if the trace was not stopped
+	uint64_t site_offset;
+	uint64_t chunk_count;
+	uint64_t event_count;
+	// Monotonic clock in nanoseconds when the trace started and stopped
+	uint64_t start_time;
+	uint64_t stop_time;
+};
+
+// A batch of events from one thread in the order they happened
+// Chunks of different threads are interleaved and may be out of order with each other
+struct MPTraceChunk
+{
+	uint32_t event_count;
+	uint32_t thread;
+};
+
+struct MPTraceSiteTable
+{
+	uint64_t count;
+	// Total size of the file names following the sites
+	uint64_t names_size;
+};
+
+struct MPTraceSite
+{
+	uint32_t id;
+	uint32_t line;
+	// Offset of the file name from the start of the names, the names are not terminated
+	uint32_t name_offset;
+	uint32_t name_len;
+};
+
+struct MPTraceEvent
+{
+	// Nanoseconds of the monotonic clock
+	uint64_t time;
+	// The block after the operation, or the block being freed
+	uint64_t ptr;
+	// The block before a realloc
+	uint64_t old_ptr;
+	// Size of the block after the operation
+	uint64_t size;
+	// Id of the location which allocated the block, 0 if unknown
+	uint32_t site;
+	// Number of the thread in the trace, starts at 1
+	uint16_t thread;
+	// MP_TRACE_[MALLOC,CALLOC,REALLOC,FREE]
+	uint8_t op;
+	uint8_t flags;
+};
+
+// Starts writing allocation events to the file at path, stopping any running trace
+// Returns 0 on success, -1 if the file could not be opened, the writer thread could not be started or MP_TRACE is not
+// defined
+int mp_trace_start(const char* path);
+
+// Stops the running trace after writing all buffered events
+// Is called by mp_terminate
+void mp_trace_stop();
+
+// Starts a background thread checking the padding of every live block with MP_SCAN, stopping any running scanner
+// budget is the percentage of one cpu the thread may use, from 1 to 100
+// Returns 0, or -1 if the thread could not be started or MP_SCAN is not defined
+int mp_scan_start(uint32_t budget);
+
+// Stops the scanner and returns how many overflowed blocks it found
+// Is called by mp_terminate
+size_t mp_scan_stop();
+
+// Live statistics published with MP_SHM
+// A shared memory object holding a struct MPShmHeader followed by site_capacity struct MPShmSite
+// The publisher makes sequence odd, writes the update, then makes it even again
+// Readers copy the segment and retry while sequence is odd or changed during the copy
+#define MP_SHM_MAGIC	 "MPSHM"
+#define MP_SHM_VERSION	 1
+#define MP_SHM_FILE_LEN	 64
+
+struct MPShmHeader
+{
+	char magic[8];
+	uint32_t version;
+	// Size of struct MPShmSite
+	uint32_t site_size;
+	uint64_t sequence;
+	uint64_t pid;
+	// Monotonic clock in nanoseconds of the last update
+	uint64_t time;
+	uint64_t count;
+	uint64_t size;
+	uint64_t peak_count;
+	uint64_t peak_size;
+	uint64_t total_count;
+	uint64_t total_size;
+	// Published sites, sorted by live bytes with the biggest first
+	uint32_t site_count;
+	uint32_t site_capacity;
+	// Nonzero once the publisher stopped, the segment keeps the last update
+	uint32_t stopped;
+	uint32_t reserved;
+};
+
+struct MPShmSite
+{
+	uint64_t live_count;
+	uint64_t live_size;
+	uint64_t peak_size;
+	uint64_t total_count;
+	uint64_t total_size;
+	uint32_t line;
+	uint32_t reserved;
+	// The end of long file names is kept, always terminated
+	char file[MP_SHM_FILE_LEN];
+};
+
+// Starts a background thread publishing live statistics to the shared memory object name with MP_SHM, stopping any
+// running publisher
+// name is passed to shm_open, NULL uses /magpie.<pid>
+// Returns 0, or -1 if the object could not be created or MP_SHM is not defined
+int mp_shm_start(const char* name);
+
+// Publishes a last update, marks it stopped and removes the name of the object
+// Is called by mp_terminate
+void mp_shm_stop();
+
 // Checks for buffer overruns and pointer life
 // Returns MP_VALIDATE_[OK,INVALID,OVERFLOW]
 int mp_validate_internal(void* ptr, const char* file, uint32_t line);
 
-void* mp_malloc_internal(size_t size, const char* file, uint32_t line);
-void* mp_calloc_internal(size_t num, size_t size, const char* file, uint32_t line);
-void* mp_realloc_internal(void* ptr, size_t size, const char* file, uint32_t line);
+void* mp_malloc_internal(size_t size, struct MPAllocLocation* location);
+void* mp_calloc_internal(size_t num, size_t size, struct MPAllocLocation* location);
+void* mp_realloc_internal(void* ptr, size_t size, struct MPAllocLocation* location);
 void mp_free_internal(void* ptr, const char* file, uint32_t line);
 
-#define mp_validate(ptr)	  mp_validate_internal(ptr, __FILE__, __LINE__)
-#define mp_malloc(size)		  mp_malloc_internal(size, __FILE__, __LINE__)
-#define mp_calloc(num, size)  mp_calloc_internal(num, size, __FILE__, __LINE__)
-#define mp_realloc(ptr, size) mp_realloc_internal(ptr, size, __FILE__, __LINE__)
-#define mp_free(ptr)		  mp_free_internal(ptr, __FILE__, __LINE__)
+// Allocates size bytes aligned to alignment, which must be a power of two
+// Returns NULL if the alignment is invalid or the allocation failed
+// Blocks are freed with mp_free, mp_realloc keeps their contents but only the alignment of malloc
+void* mp_aligned_alloc_internal(size_t alignment, size_t size, struct MPAllocLocation* location);
+
+// Allocates like mp_aligned_alloc_internal and stores the block in ptr
+// Returns 0, EINVAL if alignment is not a power of two multiple of sizeof(void*), or ENOMEM
+int mp_posix_memalign_internal(void** ptr, size_t alignment, size_t size, struct MPAllocLocation* location);
+
+// Frees a block the caller knows the size of, like C++ sized delete
+// Reports a size other than the one the block was allocated with
+void mp_free_sized_internal(void* ptr, size_t size, const char* file, uint32_t line);
+
+#define mp_validate(ptr)						mp_validate_internal(ptr, __FILE__, __LINE__)
+#define mp_malloc(size)							mp_malloc_internal(size, MP_LOCATION())
+#define mp_calloc(num, size)					mp_calloc_internal(num, size, MP_LOCATION())
+#define mp_realloc(ptr, size)					mp_realloc_internal(ptr, size, MP_LOCATION())
+#define mp_free(ptr)							mp_free_internal(ptr, __FILE__, __LINE__)
+#define mp_aligned_alloc(alignment, size)		mp_aligned_alloc_internal(alignment, size, MP_LOCATION())
+#define mp_posix_memalign(ptr, alignment, size) mp_posix_memalign_internal(ptr, alignment, size, MP_LOCATION())
+#define mp_free_sized(ptr, size)				mp_free_sized_internal(ptr, size, __FILE__, __LINE__)
+
+#ifdef __cplusplus
+}
+#endif
 
 // End of header
 // Implementation
@@ -112,10 +466,14 @@ void mp_free_internal(void* ptr, const char* file, uint32_t line);
 #undef calloc
 #undef realloc
 #undef free
+#undef aligned_alloc
+#undef posix_memalign
 #endif
 #include <stdio.h>
 #include <string.h>
+#include <errno.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdlib.h>
 #ifndef MP_MSG_LEN
 #define MP_MSG_LEN 512
@@ -132,6 +490,231 @@ void mp_free_internal(void* ptr, const char* file, uint32_t line);
 #define MP_MESSAGE(m) puts(m)
 #endif
 
+#if defined(MP_THREAD_CACHE) && !defined(MP_THREAD_SAFE)
+#define MP_THREAD_SAFE
+#endif
+
+#if defined(MP_SAMPLE) && !defined(MP_SEPARATE_META)
+#define MP_SEPARATE_META
+#endif
+
+#if defined(MP_GUARD_PAGES) && !defined(MP_SEPARATE_META)
+#define MP_SEPARATE_META
+#endif
+
+#if defined(MP_QUARANTINE) && !defined(MP_FILL_ON_FREE)
+#define MP_FILL_ON_FREE
+#endif
+
+#if defined(MP_TRACE) && !defined(MP_THREAD_SAFE)
+#define MP_THREAD_SAFE
+#endif
+
+#if defined(MP_SHM) && !defined(MP_THREAD_SAFE)
+#define MP_THREAD_SAFE
+#endif
+
+#ifdef MP_SCAN
+#ifndef MP_THREAD_SAFE
+#define MP_THREAD_SAFE
+#endif
+#ifndef MP_CHECK_OVERFLOW
+#define MP_CHECK_OVERFLOW
+#endif
+#endif
+
+// Sampled allocations are rare and published directly, so that a free never has to search other threads
+#if defined(MP_THREAD_CACHE) && !defined(MP_SAMPLE)
+#define MP_DEFER_PUBLISH
+#endif
+
+#ifndef MP_SAMPLE_INTERVAL
+#define MP_SAMPLE_INTERVAL (512 * 1024)
+#endif
+
+#ifndef MP_THREAD_CACHE_LEN
+#define MP_THREAD_CACHE_LEN 64
+#endif
+
+#ifndef MP_SHARD_COUNT
+#ifdef MP_THREAD_SAFE
+#define MP_SHARD_COUNT 16
+#else
+#define MP_SHARD_COUNT 1
+#endif
+#endif
+
+// Load at which a shard of the hashtable grows to double size, giving half the load
+#define MP_INDEX_GROW_LOAD 0.7
+// Load at which a shard shrinks to half size
+// Kept well below half the grow load so that shrinking never triggers a grow and the other way around
+#define MP_INDEX_SHRINK_LOAD 0.125
+#define MP_INDEX_MIN_SIZE	 16
+
+#ifndef MP_RESIZE_STEP
+#define MP_RESIZE_STEP 16
+#endif
+
+#ifndef MP_SLAB_LEN
+#define MP_SLAB_LEN 1024
+#endif
+
+#ifndef MP_COUNTER_STRIPES
+#define MP_COUNTER_STRIPES 16
+#endif
+
+#ifndef MP_TRACE_RING_LEN
+#define MP_TRACE_RING_LEN 4096
+#endif
+
+#ifndef MP_TRACE_FLUSH_MS
+#define MP_TRACE_FLUSH_MS 10
+#endif
+
+#ifndef MP_GUARD_ALIGN
+#define MP_GUARD_ALIGN _Alignof(max_align_t)
+#endif
+
+#ifndef MP_GUARD_MIN_SIZE
+#define MP_GUARD_MIN_SIZE 0
+#endif
+
+#ifndef MP_GUARD_MAX_SIZE
+#define MP_GUARD_MAX_SIZE SIZE_MAX
+#endif
+
+#ifndef MP_GUARD_RATE
+#define MP_GUARD_RATE 1
+#endif
+
+#ifndef MP_GUARD_POOL_LEN
+#define MP_GUARD_POOL_LEN 1024
+#endif
+
+#ifndef MP_GUARD_SITES
+#define MP_GUARD_SITES 16
+#endif
+
+// Number of pooled mapping sizes, mappings of up to this many pages before the guard page are reused
+#define MP_GUARD_CLASSES 8
+
+#ifndef MP_QUARANTINE_SIZE
+#define MP_QUARANTINE_SIZE (4 << 20)
+#endif
+
+#ifndef MP_QUARANTINE_LEN
+#define MP_QUARANTINE_LEN 4096
+#endif
+
+#ifndef MP_QUARANTINE_BATCH
+#define MP_QUARANTINE_BATCH 32
+#endif
+
+#ifndef MP_BACKTRACE_DEPTH
+#define MP_BACKTRACE_DEPTH 16
+#endif
+
+#ifndef MP_SCAN_SLICE
+#define MP_SCAN_SLICE 256
+#endif
+
+#ifndef MP_SCAN_PERIOD_MS
+#define MP_SCAN_PERIOD_MS 1000
+#endif
+
+#ifndef MP_SHM_SITES
+#define MP_SHM_SITES 32
+#endif
+
+#ifndef MP_SHM_PERIOD_MS
+#define MP_SHM_PERIOD_MS 500
+#endif
+
+// Number of recently used stacks each thread remembers to avoid locking the stack table
+#define MP_STACK_CACHE_LEN 64
+// How far above the first frame a stack is walked when the bounds of the thread stack are unknown
+#define MP_STACK_FALLBACK_SIZE (8 << 20)
+
+#if MP_SHARD_COUNT & (MP_SHARD_COUNT - 1)
+#error "MP_SHARD_COUNT needs to be a power of two"
+#endif
+
+#if MP_COUNTER_STRIPES & (MP_COUNTER_STRIPES - 1)
+#error "MP_COUNTER_STRIPES needs to be a power of two"
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(MP_NO_SIMD)
+#define MP_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// The default is not a preprocessor constant
+_Static_assert((MP_GUARD_ALIGN & (MP_GUARD_ALIGN - 1)) == 0, "MP_GUARD_ALIGN needs to be a power of two");
+
+#if MP_TRACE_RING_LEN & (MP_TRACE_RING_LEN - 1)
+#error "MP_TRACE_RING_LEN needs to be a power of two"
+#endif
+
+// Synchronization primitives
+// Expand to nothing when MP_THREAD_SAFE is not defined
+#ifdef MP_THREAD_SAFE
+#include <pthread.h>
+#define MP_MUTEX						   pthread_mutex_t
+#define MP_LOCK(mutex)					   pthread_mutex_lock(mutex)
+#define MP_UNLOCK(mutex)				   pthread_mutex_unlock(mutex)
+#define MP_COUNTER_ADD(counter, val)	   __atomic_fetch_add(&(counter), (val), __ATOMIC_RELAXED)
+#define MP_COUNTER_SUB(counter, val)	   __atomic_fetch_sub(&(counter), (val), __ATOMIC_RELAXED)
+#define MP_COUNTER_LOAD(counter)		   __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#define MP_COUNTER_STORE(counter, val)	   __atomic_store_n(&(counter), (val), __ATOMIC_RELAXED)
+#define MP_COUNTER_FETCH_ADD(counter, val) __atomic_fetch_add(&(counter), (val), __ATOMIC_RELAXED)
+#define MP_THREAD_LOCAL					   __thread
+#else
+#define MP_LOCK(mutex)
+#define MP_UNLOCK(mutex)
+#define MP_COUNTER_ADD(counter, val)	   ((counter) += (val))
+#define MP_COUNTER_SUB(counter, val)	   ((counter) -= (val))
+#define MP_COUNTER_LOAD(counter)		   (counter)
+#define MP_COUNTER_STORE(counter, val)	   ((counter) = (val))
+#define MP_COUNTER_FETCH_ADD(counter, val) ((counter) += (val), (counter) - (val))
+#define MP_THREAD_LOCAL
+#endif
+
+// Returns the usable size of a block from malloc, or 0 if the platform can not tell
+#if defined(__GLIBC__)
+#include <malloc.h>
+#define mp_usable_size(ptr) malloc_usable_size(ptr)
+#elif defined(__APPLE__)
+#include <malloc/malloc.h>
+#define mp_usable_size(ptr) malloc_size(ptr)
+#elif defined(_WIN32)
+#include <malloc.h>
+#define mp_usable_size(ptr) _msize(ptr)
+#else
+#define mp_usable_size(ptr) ((void)(ptr), (size_t)0)
+#endif
+
+// Returns size bytes from malloc aligned to alignment, or NULL
+// alignment is a power of two multiple of sizeof(void*), the block is released by free
+static inline void* mp_memalign(size_t alignment, size_t size)
+{
+	void* ptr;
+	return posix_memalign(&ptr, alignment, size) == 0 ? ptr : NULL;
+}
+
+// High-water marks of the current number of blocks and bytes allocated
+static size_t mp_peak_alloc_count = 0;
+static size_t mp_peak_alloc_size = 0;
+
+// Raises a high-water mark to val if it is higher
+// Always atomic since the counters of MP_DISABLE are shared by threads without MP_THREAD_SAFE
+static inline void mp_raise_peak(size_t* peak, size_t val)
+{
+	size_t cur = __atomic_load_n(peak, __ATOMIC_RELAXED);
+	while (val > cur && !__atomic_compare_exchange_n(peak, &cur, val, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+#ifndef MP_DISABLE
 // The total number of allocations for the program
 static size_t mp_total_alloc_count = 0;
 // The total size of all allocation for the program
@@ -141,627 +724,4029 @@ static size_t mp_alloc_count = 0;
 // The number of bytes allocated
 static size_t mp_alloc_size = 0;
 
-#ifndef MP_DISABLE
-// A memory block stored based on line of initial allocation in a binary tree
+// Info of a memory block
+// Placed in front of the user bytes, or in a slab record with MP_SEPARATE_META
 struct MemBlock
 {
 	size_t size;
-	const char* file;
-	uint32_t line;
+#ifdef MP_SEPARATE_META
+	union
+	{
+		struct MPAllocLocation* location;
+		// Next unused record in the free list of the shard
+		struct MemBlock* next_free;
+	};
+#else
+	struct MPAllocLocation* location;
+#endif
+	// Which number of allocation from location this is
 	uint32_t count;
-	struct MemBlock* next;
-	char bytes[1];
+	// The generation of mp_snapshot the block was allocated in
+	uint32_t generation;
+#ifndef MP_SEPARATE_META
+	// Bytes skipped before the info to align the user bytes, 0 unless allocated by mp_aligned_alloc
+	size_t offset;
+#endif
+#ifdef MP_GUARD_PAGES
+	// Nonzero if the bytes are placed in front of a guard page
+	uint32_t guarded;
+#endif
+#ifdef MP_BACKTRACE
+	// The call stack the block was allocated through, NULL if it could not be stored
+	struct MPStack* stack;
+#endif
+#ifdef MP_SEPARATE_META
+	// The separately allocated user bytes, NULL if the record is unused
+	char* bytes;
+#else
+	// Aligned like the result of malloc
+	_Alignas(max_align_t) char bytes[1];
+#endif
+};
+
+#ifdef MP_SEPARATE_META
+// A batch of block records
+struct MPSlab
+{
+	struct MPSlab* next;
+	// How many records have been handed out from the slab
+	size_t used;
+	struct MemBlock blocks[MP_SLAB_LEN];
 };
 
+// Size of the allocation backing a block of size bytes
+#define MP_BLOCK_ALLOC_SIZE(size) ((size) + MP_BUFFER_PAD_LEN)
+// Start of the allocation backing a block
+#define MP_BLOCK_BASE(block) ((void*)(block)->bytes)
+#else
+// Size of the block info before the user bytes
+#define MP_BLOCK_HEADER offsetof(struct MemBlock, bytes)
+#define MP_BLOCK_ALLOC_SIZE(size) (MP_BLOCK_HEADER + (size) + MP_BUFFER_PAD_LEN)
+#define MP_BLOCK_BASE(block)	  ((void*)((char*)(block) - (block)->offset))
+#endif
+
+// A slot in the pointer hashtable
+// Keeps the key next to the block so probing never touches user memory
+struct MPIndexEntry
+{
+	// The pointer given to the user, NULL if the slot is empty
+	void* ptr;
+	struct MemBlock* block;
+};
+
+// Marks a slot in a table being migrated away from whose entry has been moved or removed
+#define MP_INDEX_TOMBSTONE ((void*)1)
+
+// A shard of the pointer hashtable
+// Open addressing with robin hood probing and backward shift deletion
+// Resizing is incremental, entries are moved from old_items to items a few slots per operation
+// Each shard is independently locked when MP_THREAD_SAFE is defined
 struct MPHashTable
 {
-	// Describes the allocated amount of buckets in the hash table
+	// Describes the allocated amount of slots in the hash table
 	size_t size;
-	// Describes how many buckets are in use
+	// Describes how many entries are stored in both tables
 	size_t count;
-	struct MemBlock** items;
+	struct MPIndexEntry* items;
+	// The table being migrated from, NULL if no resize is in progress
+	// Only ever has entries removed, replaced by MP_INDEX_TOMBSTONE
+	struct MPIndexEntry* old_items;
+	size_t old_size;
+	// The next slot in old_items to migrate
+	size_t migrate_pos;
+#ifdef MP_SEPARATE_META
+	// Records of the blocks stored in the shard, newest slab first
+	struct MPSlab* slabs;
+	struct MemBlock* free_blocks;
+#endif
+#ifdef MP_THREAD_SAFE
+	// Guards all other members of the shard
+	MP_MUTEX lock;
+#endif
 };
 
-// Describes the location of a malloc
-// Used to track where allocations come from and how many has been allocated from the same place in the code
-struct MPAllocLocation
+// Open addressing hashtable of all registered allocation locations keyed by file pointer and line
+// Static locations of different call sites on the same line are all stored
+// Locations are never removed until mp_terminate
+struct MPLocationTable
 {
-	const char* file;
-	uint32_t line;
-	// How many allocations have been done at file:line
-	// Does not decrement on free
-	uint32_t count;
-	struct MPAllocLocation *prev, *next;
+	size_t size;
+	size_t count;
+	struct MPAllocLocation** items;
 };
 
-static struct MPHashTable mp_hashtable = {0};
-static struct MPAllocLocation* mp_locations = NULL;
+#ifdef MP_THREAD_SAFE
+static struct MPHashTable mp_hashtable[MP_SHARD_COUNT] = {[0 ... MP_SHARD_COUNT - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+// Guards mp_locations
+static MP_MUTEX mp_locations_lock = PTHREAD_MUTEX_INITIALIZER;
+#else
+static struct MPHashTable mp_hashtable[MP_SHARD_COUNT] = {0};
+#endif
+static struct MPLocationTable mp_locations = {0};
+
+#ifdef MP_SAMPLE
+// Mean number of bytes between samples
+static size_t mp_sample_interval = MP_SAMPLE_INTERVAL;
+// Bytes left to allocate on this thread before the next sample
+static MP_THREAD_LOCAL size_t mp_sample_countdown = 0;
+// State of the random generator of this thread, 0 until seeded
+static MP_THREAD_LOCAL uint64_t mp_sample_rng = 0;
 
-// Hash functions from https://gist.github.com/badboy/6267743
-#if SIZE_MAX == 0xffffffff // 32 bit
-size mp_hash_ptr(void* ptr)
+// Returns the number of bytes until the next sample, exponentially distributed around the interval
+size_t mp_next_sample_distance();
+
+// Returns nonzero if an allocation of size bytes should be sampled
+static inline int mp_should_sample(size_t size)
 {
-	int c2 = 0x27d4eb2d; // a prime or an odd constant
-	key = (key ^ 61) ^ (key >>> 16);
-	key = key + (key << 3);
-	key = key ^ (key >>> 4);
-	key = key * c2;
-	key = key ^ (key >>> 15);
-	return key;
+	if (mp_sample_rng == 0)
+	{
+		// The address of a thread local differs between threads
+		mp_sample_rng = (uint64_t)(uintptr_t)&mp_sample_countdown ^ 0x9e3779b97f4a7c15;
+		mp_sample_countdown = mp_next_sample_distance();
+	}
+	if (size < mp_sample_countdown)
+	{
+		mp_sample_countdown -= size;
+		return 0;
+	}
+	mp_sample_countdown = mp_next_sample_distance();
+	return 1;
 }
-#elif SIZE_MAX == 0xffffffffffffffff // 64 bit
-size_t mp_hash_ptr(void* ptr)
-{
 
-	size_t key = (size_t)ptr;
-	key = (~key) + (key << 21); // key = (key << 21) - key - 1;
-	key = key ^ (key >> 24);
-	key = (key + (key << 3)) + (key << 8); // key * 265
-	key = key ^ (key >> 14);
-	key = (key + (key << 2)) + (key << 4); // key * 21
-	key = key ^ (key >> 28);
-	key = key + (key << 31);
+// Adds the allocations and bytes a sample of size bytes stands for to location
+void mp_record_sample(struct MPAllocLocation* location, size_t size);
 
-	// Fit to table
-	// Since size is a power of two, it is faster than modulo
-	return key & (mp_hashtable.size - 1);
-}
+// Counts an allocation which is not sampled and reports if it failed
+// Returns ptr
+void* mp_unsampled(void* ptr, size_t size, struct MPAllocLocation* location);
 #endif
 
-// Inserts block and correctly resizes the hashtable
-// Counts and increases how many allocations have come from the same file and line
-void mp_insert(struct MemBlock* block, const char* file, uint32_t line);
-
-// Resizes the list either up (1) or down (-1), does nothing if incorrect value
-void mp_resize(int direction);
+// The last id given to a location
+static uint32_t mp_location_ids = 0;
 
-// Searches for the pointer in the tree
-struct MemBlock* mp_search(void* ptr);
+// The generation new blocks are stamped with, increased by mp_snapshot
+static uint32_t mp_generation = 0;
 
-// Searches and removes a memblock storing the ptr from the hashmap
-// Returns the memblock, or NULL if failed
-struct MemBlock* mp_remove(void* ptr);
+// Blocks and bytes counted for a location, or a stack with MP_BACKTRACE, by a walk over the blocks
+struct MPSiteTotal
+{
+	// The stack or location, NULL if the slot is empty
+	void* key;
+	struct MPAllocLocation* location;
+#ifdef MP_BACKTRACE
+	struct MPStack* stack;
 #endif
+	size_t count;
+	size_t size;
+};
 
-size_t mp_get_total_count()
+// Open addressing map of site totals keyed by the stack or location of the blocks
+struct MPSiteTotals
 {
-	return mp_total_alloc_count;
-}
+	size_t size;
+	size_t count;
+	struct MPSiteTotal* items;
+};
 
-size_t mp_get_total_size()
-{
-	return mp_total_alloc_size;
-}
+// Counts block to the totals of its site
+void mp_site_totals_add(struct MPSiteTotals* totals, struct MemBlock* block);
 
-size_t mp_get_count()
+#ifdef MP_BACKTRACE
+#include <pthread.h>
+#ifdef __GLIBC__
+#include <execinfo.h>
+// Only declared by pthread.h with _GNU_SOURCE, which can not be defined after the first system header
+extern int pthread_getattr_np(pthread_t thread, pthread_attr_t* attr);
+#endif
+
+// A call stack which allocations have been made through
+// Every distinct stack and location is stored once and shared by all blocks allocated through it
+struct MPStack
 {
-	return mp_alloc_count;
-}
+	size_t hash;
+	struct MPAllocLocation* location;
+	// How many allocations have been made through the stack
+	size_t count;
+	size_t live_count;
+	size_t live_size;
+	size_t total_size;
+	uint32_t depth;
+	// Return addresses, innermost first
+	void* frames[];
+};
 
-size_t mp_get_size()
+// A shard of the stack table selected by the top bits of the stack hash
+// Open addressing with linear probing, stacks are only removed by mp_terminate
+struct MPStackTable
 {
-	return mp_alloc_size;
-}
+	size_t size;
+	size_t count;
+	struct MPStack** items;
+#ifdef MP_THREAD_SAFE
+	// Guards all other members of the shard
+	MP_MUTEX lock;
+#endif
+};
 
-// Remove print locations
-// Terminate function does nothing
-// Remove validation function
-// Make allocation functions simple wrappers that increment count
-// Do not build hash table functions if MP_DISABLE is defined
-#ifdef MP_DISABLE
-void mp_print_locations()
+// Stacks recently used by a thread, indexed by the low bits of their hash
+struct MPStackCache
 {
-	MP_MESSAGE("Failed to fetch locations since magpie is disabled in build");
+	// Value of mp_stack_generation when the cache was filled
+	size_t generation;
+	struct MPStack* items[MP_STACK_CACHE_LEN];
+};
+
+#ifdef MP_THREAD_SAFE
+static struct MPStackTable mp_stacks[MP_SHARD_COUNT] = {[0 ... MP_SHARD_COUNT - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+#else
+static struct MPStackTable mp_stacks[MP_SHARD_COUNT] = {0};
+#endif
+// Increased by mp_terminate when it releases the stacks so threads drop the stacks they remember
+static size_t mp_stack_generation = 1;
+static MP_THREAD_LOCAL struct MPStackCache mp_stack_cache;
+// Bounds of the stack of the calling thread, 0 until looked up
+static MP_THREAD_LOCAL uintptr_t mp_stack_low = 0;
+static MP_THREAD_LOCAL uintptr_t mp_stack_high = 0;
+
+// Walks the frame pointers from frame and returns the stored stack of the return addresses and location
+// Pass __builtin_frame_address(0) of the function called by the user so the first frame is the call site
+// Returns NULL if the stack could not be stored
+struct MPStack* mp_capture_stack(void* frame, struct MPAllocLocation* location);
+
+// Records the call stack of a new block
+// Is a macro so that the frame is the one of the allocation function
+#define MP_CAPTURE_STACK(block, location) ((block)->stack = mp_capture_stack(__builtin_frame_address(0), location))
+
+// Returns a malloced array of all stacks and stores their number in count
+struct MPStack** mp_collect_stacks(size_t* count);
+
+// Prints the frames of a stack, one per message
+void mp_print_frames(struct MPStack* stack);
+
+// Prints every stack with live blocks, or every stack by allocation count if leaks is 0
+void mp_print_stacks(int leaks);
+
+// Frees all stacks
+void mp_release_stacks();
+#else
+#define MP_CAPTURE_STACK(block, location)
+#endif
+
+#ifdef MP_TRACE
+#include <time.h>
+#include <sched.h>
+// Single producer single consumer queue of the events of one thread
+// Only the owning thread pushes, only the writer thread pops
+struct MPTraceRing
+{
+	struct MPTraceEvent events[MP_TRACE_RING_LEN];
+	// Number of events pushed, written by the owning thread
+	size_t head;
+	// Number of events popped, written by the writer thread
+	size_t tail;
+	// Set by the owning thread when an event was dropped, cleared by the next pushed event
+	uint8_t dropped;
+	uint16_t thread;
+	// Set when the owning thread exits, the ring is released once drained
+	int dead;
+	struct MPTraceRing* next;
+};
+
+// All rings, including those of exited threads which are not yet drained
+static struct MPTraceRing* mp_trace_rings = NULL;
+// Guards mp_trace_rings
+static MP_MUTEX mp_trace_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t mp_trace_key;
+static pthread_once_t mp_trace_once = PTHREAD_ONCE_INIT;
+static MP_THREAD_LOCAL struct MPTraceRing* mp_trace_ring = NULL;
+// The last thread number given to a ring
+static uint16_t mp_trace_threads = 0;
+// Nonzero while events are recorded
+static int mp_trace_enabled = 0;
+// Tells the writer to write the remaining events and exit
+static int mp_trace_stopping = 0;
+static pthread_t mp_trace_writer;
+// The file of the running trace, NULL if no trace is running
+static FILE* mp_trace_file = NULL;
+// Totals written to the start of the file when the trace stops
+static struct MPTraceHeader mp_trace_header;
+// Serializes starting and stopping traces
+static MP_MUTEX mp_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the ring of the calling thread, creating it on first use
+struct MPTraceRing* mp_get_trace_ring();
+
+// Appends an event to the ring of the calling thread if a trace is running
+// Never blocks, the event is dropped if the ring is full
+// With MP_TRACE_LOSSLESS waits until the writer makes room instead
+static inline void mp_trace_push(uint8_t op, void* ptr, void* old_ptr, size_t size, struct MPAllocLocation* location)
+{
+	if (MP_COUNTER_LOAD(mp_trace_enabled) == 0)
+		return;
+	struct MPTraceRing* ring = mp_get_trace_ring();
+	size_t head = ring->head;
+	while (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == MP_TRACE_RING_LEN)
+	{
+#ifdef MP_TRACE_LOSSLESS
+		// The writer never allocates through magpie so it can always make progress
+		if (MP_COUNTER_LOAD(mp_trace_enabled) == 0)
+			return;
+		sched_yield();
+#else
+		ring->dropped = 1;
+		return;
+#endif
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	struct MPTraceEvent* event = &ring->events[head & (MP_TRACE_RING_LEN - 1)];
+	event->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	event->ptr = (uint64_t)(uintptr_t)ptr;
+	event->old_ptr = (uint64_t)(uintptr_t)old_ptr;
+	event->size = size;
+	event->site = location ? location->id : 0;
+	event->thread = ring->thread;
+	event->op = op;
+	event->flags = ring->dropped ? MP_TRACE_FLAG_DROPPED : 0;
+	ring->dropped = 0;
+	// Publishes the event to the writer
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Writes all buffered events to the trace file as one chunk per ring and releases the rings of exited threads
+// Returns the number of events written
+size_t mp_trace_drain();
+
+// Writes the site table of all registered locations and the totals of the header
+void mp_trace_finish();
+
+#define MP_TRACE_EVENT(op, ptr, old_ptr, size, location) mp_trace_push(op, ptr, old_ptr, size, location)
+#else
+#define MP_TRACE_EVENT(op, ptr, old_ptr, size, location)
+#endif
+
+#ifdef MP_THREAD_CACHE
+// An allocation recorded by a thread but not yet inserted into the hashtable
+struct MPPendingBlock
+{
+	// The pointer given to the user, NULL if the block has been taken back before being published
+	void* ptr;
+	struct MemBlock* block;
+#ifdef MP_SEPARATE_META
+	// Block info until it is copied into a record of the shard
+	struct MemBlock meta;
+#endif
+	// Location to count when published, NULL if the block is being reinserted
+	struct MPAllocLocation* location;
+};
+
+// Bits in the filter of pending pointers of a cache, a multiple of 64
+#define MP_PENDING_FILTER_BITS 512
+
+// Per thread buffer of allocations and counter changes
+// Allocations are published to the hashtable in batches
+// Counter changes are signed deltas stored as wrapping unsigned values
+struct MPThreadCache
+{
+	struct MPPendingBlock pending[MP_THREAD_CACHE_LEN];
+	size_t pending_count;
+	// Bloom filter of the pointers in pending, cleared when they are published
+	// Lets other threads skip the caches which can not hold a pointer missing from the hashtable
+	uint64_t filter[MP_PENDING_FILTER_BITS / 64];
+	size_t total_alloc_count;
+	size_t total_alloc_size;
+	size_t alloc_count;
+	size_t alloc_size;
+	// Spinlock taken by the owning thread when modifying pending
+	// Other threads only take it to publish pending blocks
+	int busy;
+	struct MPThreadCache *prev, *next;
+};
+
+// All live thread caches
+static struct MPThreadCache* mp_thread_caches = NULL;
+// Guards mp_thread_caches
+static MP_MUTEX mp_thread_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t mp_thread_cache_key;
+static pthread_once_t mp_thread_cache_once = PTHREAD_ONCE_INIT;
+static MP_THREAD_LOCAL struct MPThreadCache* mp_thread_cache = NULL;
+
+// Returns the cache of the calling thread, creating it on first use
+struct MPThreadCache* mp_get_thread_cache();
+
+// Publishes all pending blocks of the cache to the hashtable
+// Adds the counter deltas to the global counters if flush_counters is set, should only be done by the owning thread
+// Cache needs to be locked
+void mp_flush_cache(struct MPThreadCache* cache, int flush_counters);
+
+// Publishes the pending blocks of all threads
+void mp_flush_all_caches(int flush_counters);
+
+// Publishes the caches whose filter matches ptr
+void mp_flush_caches_holding(void* ptr);
+
+// Adds to a counter delta of the calling thread
+// Only the owning thread writes the deltas, other threads may read them
+static inline void mp_cache_stat_add(size_t* stat, size_t val)
+{
+	__atomic_store_n(stat, *stat + val, __ATOMIC_RELAXED);
+}
+
+// Returns the sum of a global counter and the unpublished deltas of all threads
+size_t mp_cache_stat_sum(size_t counter, size_t offset);
+
+#define MP_STAT_ADD(stat, val) mp_cache_stat_add(&mp_get_thread_cache()->stat, (val))
+#define MP_STAT_SUB(stat, val) mp_cache_stat_add(&mp_get_thread_cache()->stat, -(size_t)(val))
+#else
+#define MP_STAT_ADD(stat, val) MP_COUNTER_ADD(mp_##stat, val)
+#define MP_STAT_SUB(stat, val) MP_COUNTER_SUB(mp_##stat, val)
+#endif
+
+// Hash functions from https://gist.github.com/badboy/6267743
+// Returns the full hash, the low bits select the bucket and the high bits the shard
+#if SIZE_MAX == 0xffffffff // 32 bit
+size_t mp_hash_ptr(void* ptr)
+{
+	size_t key = (size_t)ptr;
+	key = (key ^ 61) ^ (key >> 16);
+	key = key + (key << 3);
+	key = key ^ (key >> 4);
+	key = key * 0x27d4eb2d; // a prime or an odd constant
+	key = key ^ (key >> 15);
+	return key;
+}
+#elif SIZE_MAX == 0xffffffffffffffff // 64 bit
+size_t mp_hash_ptr(void* ptr)
+{
+
+	size_t key = (size_t)ptr;
+	key = (~key) + (key << 21); // key = (key << 21) - key - 1;
+	key = key ^ (key >> 24);
+	key = (key + (key << 3)) + (key << 8); // key * 265
+	key = key ^ (key >> 14);
+	key = (key + (key << 2)) + (key << 4); // key * 21
+	key = key ^ (key >> 28);
+	key = key + (key << 31);
+	return key;
+}
+#endif
+
+// Returns the shard which stores the pointer with the given hash
+// Uses the top bits of the hash so that they are independent of the bucket index
+struct MPHashTable* mp_get_shard(size_t hash)
+{
+	return &mp_hashtable[(hash >> (sizeof(size_t) * CHAR_BIT - 16)) & (MP_SHARD_COUNT - 1)];
+}
+
+// Inserts block and correctly resizes the shard
+// Shard needs to be locked
+void mp_insert(struct MPHashTable* table, struct MemBlock* block);
+
+// Starts resizing the shard either up (1) or down (-1), does nothing if incorrect value
+// Finishes any resize already in progress first
+// Shard needs to be locked
+void mp_resize(struct MPHashTable* table, int direction);
+
+// Moves up to steps slots from the old table of an ongoing resize to the new one
+// Shard needs to be locked
+void mp_migrate(struct MPHashTable* table, size_t steps);
+
+// Returns the slot index of ptr in items, or SIZE_MAX if not found
+size_t mp_probe(struct MPIndexEntry* items, size_t size, void* ptr);
+
+// Searches for the pointer in the shard
+// Shard needs to be locked
+struct MemBlock* mp_search(struct MPHashTable* table, void* ptr);
+
+// Searches and removes a memblock storing the ptr from the shard
+// Shard needs to be locked
+// Returns the memblock, or NULL if failed
+struct MemBlock* mp_remove(struct MPHashTable* table, void* ptr);
+
+// Adds a location to the location table
+// mp_locations_lock needs to be locked
+void mp_add_location(struct MPAllocLocation* location);
+
+// Adds a static location to the location table on its first use
+void mp_register_location(struct MPAllocLocation* location);
+
+// Counts and increases how many allocations have come from location
+// Returns which number of allocation from location this is
+static inline uint32_t mp_count_location(struct MPAllocLocation* location)
+{
+	if (MP_COUNTER_LOAD(location->registered) == 0)
+		mp_register_location(location);
+	return MP_COUNTER_FETCH_ADD(location->count, 1);
+}
+
+// Returns the bucket of the size histogram counting size
+static inline size_t mp_size_bucket(size_t size)
+{
+	if (size == 0)
+		return 0;
+	size_t bucket = 64 - __builtin_clzll((unsigned long long)size);
+	return bucket < MP_SIZE_BUCKETS ? bucket : MP_SIZE_BUCKETS - 1;
+}
+
+// Counts a new block to the live and total bytes of its location and stack
+// Also counts it to the size histogram and peak of the location
+static inline void mp_site_alloc(struct MemBlock* block)
+{
+	struct MPAllocLocation* location = block->location;
+	MP_COUNTER_ADD(location->live_count, 1);
+	MP_COUNTER_ADD(location->live_size, block->size);
+	MP_COUNTER_ADD(location->total_size, block->size);
+	MP_COUNTER_ADD(location->size_histogram[mp_size_bucket(block->size)], 1);
+	mp_raise_peak(&location->peak_size, MP_COUNTER_LOAD(location->live_size));
+#ifdef MP_BACKTRACE
+	if (block->stack)
+	{
+		MP_COUNTER_ADD(block->stack->live_count, 1);
+		MP_COUNTER_ADD(block->stack->live_size, block->size);
+		MP_COUNTER_ADD(block->stack->total_size, block->size);
+	}
+#endif
+}
+
+// Counts a block changing size from old_size to block->size
+// moved is nonzero if realloc copied the bytes to a new address
+static inline void mp_site_resize(struct MemBlock* block, size_t old_size, int moved)
+{
+	struct MPAllocLocation* location = block->location;
+	MP_COUNTER_ADD(location->realloc_count, 1);
+	if (moved)
+	{
+		MP_COUNTER_ADD(location->realloc_moved, 1);
+		MP_COUNTER_ADD(location->realloc_copied, old_size < block->size ? old_size : block->size);
+	}
+	MP_COUNTER_ADD(location->live_size, block->size - old_size);
+	if (block->size > old_size)
+	{
+		MP_COUNTER_ADD(location->total_size, block->size - old_size);
+		mp_raise_peak(&location->peak_size, MP_COUNTER_LOAD(location->live_size));
+	}
+#ifdef MP_BACKTRACE
+	if (block->stack)
+	{
+		MP_COUNTER_ADD(block->stack->live_size, block->size - old_size);
+		if (block->size > old_size)
+			MP_COUNTER_ADD(block->stack->total_size, block->size - old_size);
+	}
+#endif
+}
+
+// Removes a freed block from the live bytes of its location and stack
+static inline void mp_site_free(struct MemBlock* block)
+{
+	MP_COUNTER_SUB(block->location->live_count, 1);
+	MP_COUNTER_SUB(block->location->live_size, block->size);
+#ifdef MP_BACKTRACE
+	if (block->stack)
+	{
+		MP_COUNTER_SUB(block->stack->live_count, 1);
+		MP_COUNTER_SUB(block->stack->live_size, block->size);
+	}
+#endif
+}
+
+// Remembers a return address into the code of the location for naming it in heap profiles
+// Is a macro so that the return address is the one of the allocation function
+#define MP_RECORD_CALLER(location)                                                                                     \
+	do                                                                                                                 \
+	{                                                                                                                  \
+		if (MP_COUNTER_LOAD((location)->caller) == NULL)                                                               \
+			MP_COUNTER_STORE((location)->caller, __builtin_return_address(0));                                         \
+	} while (0)
+
+// Returns the block info of an allocation from its base, or NULL if base is NULL
+// With MP_SEPARATE_META the info is kept in storage until published
+static inline struct MemBlock* mp_block_from_base(void* base, struct MemBlock* storage)
+{
+	if (base == NULL)
+		return NULL;
+#ifdef MP_SEPARATE_META
+	storage->bytes = base;
+#ifdef MP_GUARD_PAGES
+	storage->guarded = 0;
+#endif
+	return storage;
+#else
+	((struct MemBlock*)base)->offset = 0;
+	return base;
+#endif
+}
+
+// Returns the block info of size bytes aligned to alignment, or NULL if they could not be allocated
+// alignment is a power of two of at least the alignment of malloc
+// The info is placed right before the aligned bytes and the bytes in front of it are skipped
+static inline struct MemBlock* mp_block_aligned(size_t alignment, size_t size, struct MemBlock* storage)
+{
+#ifdef MP_SEPARATE_META
+	return mp_block_from_base(mp_memalign(alignment, MP_BLOCK_ALLOC_SIZE(size)), storage);
+#else
+	size_t offset = (MP_BLOCK_HEADER + alignment - 1) / alignment * alignment - MP_BLOCK_HEADER;
+	char* base = mp_memalign(alignment, offset + MP_BLOCK_ALLOC_SIZE(size));
+	if (base == NULL)
+		return NULL;
+	struct MemBlock* block = (struct MemBlock*)(base + offset);
+	block->offset = offset;
+	return block;
+#endif
+}
+
+// Resizes the allocation of block to hold size bytes and returns its new info, or NULL with block left untouched
+// Blocks placed for alignment keep their offset, the bytes only keep the alignment of malloc if they move
+static inline struct MemBlock* mp_block_realloc(struct MemBlock* block, size_t size, struct MemBlock* storage)
+{
+#ifdef MP_SEPARATE_META
+	return mp_block_from_base(realloc(block->bytes, MP_BLOCK_ALLOC_SIZE(size)), storage);
+#else
+	size_t offset = block->offset;
+	char* base = realloc(MP_BLOCK_BASE(block), offset + MP_BLOCK_ALLOC_SIZE(size));
+	return base ? (struct MemBlock*)(base + offset) : NULL;
+#endif
+}
+
+// Returns a block info that stays valid after its record is released
+// Copies block into storage with MP_SEPARATE_META, otherwise returns block
+static inline struct MemBlock* mp_block_copy(struct MemBlock* block, struct MemBlock* storage)
+{
+#ifdef MP_SEPARATE_META
+	if (block == NULL)
+		return NULL;
+	*storage = *block;
+	return storage;
+#else
+	return block;
+#endif
+}
+
+#ifdef MP_GUARD_PAGES
+#include <sys/mman.h>
+#include <unistd.h>
+
+// A free mapping kept for reuse, stored in its first page
+struct MPGuardMapping
+{
+	struct MPGuardMapping* next;
+};
+
+// A site selected by mp_guard_site
+struct MPGuardSite
+{
+	const char* file;
+	// 0 to select every line of file
+	uint32_t line;
+};
+
+// Free mappings by their number of pages before the guard page, the guard pages stay protected
+static struct MPGuardMapping* mp_guard_pool[MP_GUARD_CLASSES];
+static size_t mp_guard_pool_len[MP_GUARD_CLASSES];
+#ifdef MP_THREAD_SAFE
+// Guards mp_guard_pool and mp_guard_pool_len
+static MP_MUTEX mp_guard_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static size_t mp_page_size = 0;
+// Selection of guarded blocks, set by mp_set_guard
+static size_t mp_guard_min_size = MP_GUARD_MIN_SIZE;
+static size_t mp_guard_max_size = MP_GUARD_MAX_SIZE;
+static size_t mp_guard_rate = MP_GUARD_RATE;
+// Eligible allocations of this thread since the last guarded one
+static MP_THREAD_LOCAL size_t mp_guard_skipped = 0;
+// Guarded by mp_locations_lock, a location is marked when it is added to the location table
+static struct MPGuardSite mp_guard_sites[MP_GUARD_SITES];
+static uint32_t mp_guard_site_count = 0;
+
+// Bytes between the end of a guarded block of size bytes and its guard page
+#define MP_GUARD_SLACK(size) ((0 - (size_t)(size)) & (MP_GUARD_ALIGN - 1))
+
+// Returns nonzero if an allocation of size bytes from location should be guarded
+static inline int mp_should_guard(size_t size, struct MPAllocLocation* location)
+{
+	if (size < MP_COUNTER_LOAD(mp_guard_min_size) || size > MP_COUNTER_LOAD(mp_guard_max_size))
+		return 0;
+	if (MP_COUNTER_LOAD(mp_guard_site_count))
+	{
+		// Sites are marked when registered, which otherwise happens after the block is allocated
+		if (MP_COUNTER_LOAD(location->registered) == 0)
+			mp_register_location(location);
+		if (!MP_COUNTER_LOAD(location->guard))
+			return 0;
+	}
+	if (++mp_guard_skipped < MP_COUNTER_LOAD(mp_guard_rate))
+		return 0;
+	mp_guard_skipped = 0;
+	return 1;
+}
+
+// Returns nonzero if location is selected by a site of mp_guard_site
+// mp_locations_lock needs to be held
+int mp_guard_site_match(struct MPAllocLocation* location);
+
+// Returns size bytes ending right before a guard page, or at MP_GUARD_SLACK(size) bytes before it
+// Reuses a pooled mapping when possible, otherwise maps new pages
+// Returns NULL if the pages can not be mapped
+void* mp_guard_map(size_t size);
+
+// Returns the mapping of guarded bytes of size bytes to the pool, or unmaps it if the pool is full
+void mp_guard_unmap(void* bytes, size_t size);
+
+// Moves the bytes of block to new bytes of size bytes, placed in front of a guard page if guard is nonzero
+// Returns NULL and leaves block untouched if the new bytes can not be allocated
+struct MemBlock* mp_guard_move(struct MemBlock* block, size_t size, int guard);
+
+// Unmaps all pooled mappings
+void mp_guard_release_pool();
+
+// Returns the block info of bytes from mp_guard_map, or NULL if bytes is NULL
+static inline struct MemBlock* mp_guard_block(void* bytes, struct MemBlock* storage)
+{
+	if (bytes == NULL)
+		return NULL;
+	storage->bytes = bytes;
+	storage->guarded = 1;
+	return storage;
+}
+
+// Number of padding bytes after a block of size bytes
+// Guarded blocks only have the bytes left before the guard page
+#define MP_PAD_LEN(block, size)                                                                                        \
+	((block)->guarded ? (MP_GUARD_SLACK(size) < MP_BUFFER_PAD_LEN ? MP_GUARD_SLACK(size) : MP_BUFFER_PAD_LEN)          \
+					  : MP_BUFFER_PAD_LEN)
+// Releases the bytes of a block
+#define MP_BLOCK_FREE(block)                                                                                           \
+	((block)->guarded ? mp_guard_unmap((block)->bytes, (block)->size) : free(MP_BLOCK_BASE(block)))
+#else
+#define MP_PAD_LEN(block, size) MP_BUFFER_PAD_LEN
+#define MP_BLOCK_FREE(block)	free(MP_BLOCK_BASE(block))
+#endif
+
+// Kernels returning the offset of the first of len bytes from p which is not MP_BUFFER_PAD_VAL, or len if all of them are
+size_t mp_find_unfilled_byte(const char* p, size_t len);
+size_t mp_find_unfilled_word(const char* p, size_t len);
+#ifdef MP_SIMD_X86
+size_t mp_find_unfilled_sse2(const char* p, size_t len);
+size_t mp_find_unfilled_avx2(const char* p, size_t len);
+#endif
+
+// Picks the fastest kernel the cpu supports on first use
+size_t mp_find_unfilled_init(const char* p, size_t len);
+
+// The kernel used by mp_find_unfilled
+static size_t (*mp_unfilled_kernel)(const char* p, size_t len) = mp_find_unfilled_init;
+
+// Returns the offset of the first of len bytes from p which is not MP_BUFFER_PAD_VAL, or len if all of them are
+// Short ranges like the default padding are compared in place, longer ones by the selected kernel
+static inline size_t mp_find_unfilled(const char* p, size_t len)
+{
+	if (len < 16)
+	{
+		for (size_t i = 0; i < len; i++)
+		{
+			if (p[i] != (char)MP_BUFFER_PAD_VAL)
+				return i;
+		}
+		return len;
+	}
+	return MP_COUNTER_LOAD(mp_unfilled_kernel)(p, len);
+}
+
+// Returns nonzero if the padding after block is intact
+static inline int mp_pad_intact(struct MemBlock* block)
+{
+	size_t len = MP_PAD_LEN(block, block->size);
+	return mp_find_unfilled(block->bytes + block->size, len) == len;
+}
+
+#ifdef MP_QUARANTINE
+// A freed block held back from being released
+struct MPQuarantined
+{
+	// The user bytes, filled with MP_BUFFER_PAD_VAL
+	char* bytes;
+	size_t size;
+	// Where the block was allocated
+	struct MPAllocLocation* location;
+	// Where the block was freed
+	const char* free_file;
+	uint32_t free_line;
+#ifdef MP_GUARD_PAGES
+	uint32_t guarded;
+#endif
+#ifndef MP_SEPARATE_META
+	// Offset of the info of an aligned block from the start of its allocation
+	size_t offset;
+#endif
+#ifdef MP_BACKTRACE
+	struct MPStack* stack;
+#endif
+};
+
+// Ring buffer of freed blocks, oldest first
+struct MPQuarantine
+{
+	struct MPQuarantined items[MP_QUARANTINE_LEN];
+	// Position of the oldest block
+	size_t head;
+	size_t count;
+	// Bytes of all blocks held
+	size_t size;
+};
+
+static struct MPQuarantine mp_quarantine;
+#ifdef MP_THREAD_SAFE
+// Guards mp_quarantine
+static MP_MUTEX mp_quarantine_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+// Holds a freed and filled block in the quarantine, releasing the oldest blocks in a batch if it is full
+void mp_quarantine_push(struct MemBlock* block, const char* file, uint32_t line);
+
+// Searches the quarantine for ptr and copies its entry into entry
+// Returns 0 if ptr is not held
+int mp_quarantine_find(void* ptr, struct MPQuarantined* entry);
+
+// Checks and releases every block in the quarantine
+void mp_quarantine_flush();
+#endif
+
+#ifdef MP_SCAN
+#include <time.h>
+#include <sched.h>
+// SCHED_IDLE is only declared with _GNU_SOURCE, its value is part of the Linux ABI
+#if defined(SCHED_IDLE)
+#define MP_SCHED_IDLE SCHED_IDLE
+#elif defined(__linux__)
+#define MP_SCHED_IDLE 5
+#endif
+
+// An overflowed block found by the scanner, reported once its shard is unlocked
+struct MPScanReport
+{
+	void* ptr;
+	size_t size;
+	struct MPAllocLocation* location;
+#ifdef MP_BACKTRACE
+	struct MPStack* stack;
+#endif
+};
+
+// The overflowed blocks found in one slice
+struct MPScanSlice
+{
+	struct MPScanReport reports[MP_SCAN_SLICE];
+	size_t count;
+};
+
+static pthread_t mp_scan_thread;
+// Nonzero while the scanner thread exists
+static int mp_scan_running = 0;
+// Tells the scanner to exit
+static int mp_scan_stopping = 0;
+// Percentage of a cpu the scanner may use
+static uint32_t mp_scan_budget = 1;
+// Overflowed blocks found since the scanner started
+static size_t mp_scan_found = 0;
+// Serializes starting and stopping the scanner
+static MP_MUTEX mp_scan_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Checks the padding of every live block a slice at a time until stopped
+void* mp_scan_main(void* arg);
+#endif
+
+#ifdef MP_SHM
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+static pthread_t mp_shm_thread;
+// The mapped segment, NULL while no publisher runs
+static struct MPShmHeader* mp_shm = NULL;
+static char mp_shm_name[256];
+// Tells the publisher to exit
+static int mp_shm_stopping = 0;
+// Serializes starting and stopping the publisher
+static MP_MUTEX mp_shm_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Copies the statistics to the segment every MP_SHM_PERIOD_MS until stopped
+void* mp_shm_main(void* arg);
+#endif
+
+#ifdef MP_SEPARATE_META
+// Returns an unused record from the slabs of the shard
+// Shard needs to be locked
+struct MemBlock* mp_block_alloc(struct MPHashTable* table);
+
+// Returns a record to the free list of the shard
+// Shard needs to be locked
+void mp_block_release(struct MPHashTable* table, struct MemBlock* block);
+#endif
+
+// Locks the owning shard and inserts block
+// With MP_SEPARATE_META block is copied into a record
+void mp_track(struct MemBlock* block);
+
+// Locks the owning shard and removes the block storing ptr
+// Returns the memblock, or NULL if ptr is not tracked
+// With MP_SEPARATE_META the record is released and the info is copied into storage
+struct MemBlock* mp_untrack(void* ptr, struct MemBlock* storage);
+
+// Makes a newly allocated block known to the tracker and counts its location
+// Pass location as NULL to reinsert a block without counting it again
+// Is deferred to the thread cache with MP_THREAD_CACHE, unless MP_SAMPLE is defined
+void mp_publish(struct MemBlock* block, struct MPAllocLocation* location);
+
+// Takes back the block storing ptr from the tracker
+// Looks in the thread cache of the calling thread before the hashtable
+// Returns the memblock, or NULL if ptr is not tracked
+// With MP_SEPARATE_META the returned info is stored in storage
+struct MemBlock* mp_take(void* ptr, struct MemBlock* storage);
+
+// Searches for ptr without removing it
+// With MP_SEPARATE_META the returned info is a copy stored in storage
+struct MemBlock* mp_find(void* ptr, struct MemBlock* storage);
+
+// Calls callback with every tracked block while its shard is locked
+// Blocks still pending in thread caches need to be published first
+void mp_walk_blocks(void (*callback)(struct MemBlock* block, void* data), void* data);
+
+// Calls callback with the blocks at up to count positions of a shard, starting at position first
+// Positions run over the slab records with MP_SEPARATE_META, otherwise over the index followed by the entries of a
+// resize in progress, so a walk spread over several locks may miss or repeat blocks moved in between
+// Returns the position to continue from, or SIZE_MAX once the end of the shard is reached
+// Shard needs to be locked
+size_t mp_walk_shard(struct MPHashTable* table, size_t first, size_t count,
+					 void (*callback)(struct MemBlock* block, void* data), void* data);
+#else
+// A set of counters on its own cache line
+// Threads are spread over the stripes so that they rarely write to the same line
+struct MPCounterStripe
+{
+	_Alignas(64) size_t total_alloc_count;
+	size_t total_alloc_size;
+	size_t alloc_count;
+	size_t alloc_size;
+};
+
+static struct MPCounterStripe mp_counter_stripes[MP_COUNTER_STRIPES] = {0};
+// The stripe of the calling thread, NULL until its first allocation
+static _Thread_local struct MPCounterStripe* mp_counter_stripe = NULL;
+// Hands out stripes to threads round robin
+static size_t mp_next_stripe = 0;
+
+// Returns the stripe of the calling thread
+static inline struct MPCounterStripe* mp_get_stripe()
+{
+	if (mp_counter_stripe == NULL)
+	{
+		size_t i = __atomic_fetch_add(&mp_next_stripe, 1, __ATOMIC_RELAXED);
+		mp_counter_stripe = &mp_counter_stripes[i & (MP_COUNTER_STRIPES - 1)];
+	}
+	return mp_counter_stripe;
+}
+
+// Returns the sum of a counter over all stripes
+// The counters wrap, so a sum is exact even if single stripes underflow
+size_t mp_stripe_sum(size_t offset);
+
+// Stripes are shared by threads when there are more threads than stripes, so the counters are always atomic
+#define MP_STAT_ADD(stat, val) __atomic_fetch_add(&mp_get_stripe()->stat, (val), __ATOMIC_RELAXED)
+#define MP_STAT_SUB(stat, val) __atomic_fetch_sub(&mp_get_stripe()->stat, (val), __ATOMIC_RELAXED)
+#endif
+
+#ifdef MP_DISABLE
+#define MP_STAT_LOAD(stat) mp_stripe_sum(offsetof(struct MPCounterStripe, stat))
+#elif defined(MP_THREAD_CACHE)
+#define MP_STAT_LOAD(stat) mp_cache_stat_sum(MP_COUNTER_LOAD(mp_##stat), offsetof(struct MPThreadCache, stat))
+#else
+#define MP_STAT_LOAD(stat) MP_COUNTER_LOAD(mp_##stat)
+#endif
+
+// Raises the global peaks after allocating
+// The counters of MP_THREAD_CACHE and MP_DISABLE are too costly to sum on every allocation, their peaks are raised
+// when the counters are published or read
+#if defined(MP_DISABLE) || defined(MP_THREAD_CACHE)
+#define MP_RAISE_PEAK()
+#else
+#define MP_RAISE_PEAK()                                                                                                \
+	(mp_raise_peak(&mp_peak_alloc_count, MP_COUNTER_LOAD(mp_alloc_count)),                                             \
+	 mp_raise_peak(&mp_peak_alloc_size, MP_COUNTER_LOAD(mp_alloc_size)))
+#endif
+
+size_t mp_get_total_count()
+{
+	return MP_STAT_LOAD(total_alloc_count);
+}
+
+size_t mp_get_total_size()
+{
+	return MP_STAT_LOAD(total_alloc_size);
+}
+
+size_t mp_get_count()
+{
+	return MP_STAT_LOAD(alloc_count);
+}
+
+size_t mp_get_size()
+{
+	return MP_STAT_LOAD(alloc_size);
+}
+
+size_t mp_get_peak_count()
+{
+	mp_raise_peak(&mp_peak_alloc_count, MP_STAT_LOAD(alloc_count));
+	return __atomic_load_n(&mp_peak_alloc_count, __ATOMIC_RELAXED);
+}
+
+size_t mp_get_peak_size()
+{
+	mp_raise_peak(&mp_peak_alloc_size, MP_STAT_LOAD(alloc_size));
+	return __atomic_load_n(&mp_peak_alloc_size, __ATOMIC_RELAXED);
+}
+
+void mp_set_sample_interval(size_t bytes)
+{
+#if defined(MP_SAMPLE) && !defined(MP_DISABLE)
+	MP_COUNTER_STORE(mp_sample_interval, bytes ? bytes : 1);
+#else
+	(void)bytes;
+#endif
+}
+
+void mp_set_guard(size_t min_size, size_t max_size, size_t rate)
+{
+#if defined(MP_GUARD_PAGES) && !defined(MP_DISABLE)
+	MP_COUNTER_STORE(mp_guard_min_size, min_size);
+	MP_COUNTER_STORE(mp_guard_max_size, max_size);
+	MP_COUNTER_STORE(mp_guard_rate, rate ? rate : 1);
+#else
+	(void)min_size;
+	(void)max_size;
+	(void)rate;
+#endif
+}
+
+#if !defined(MP_GUARD_PAGES) || defined(MP_DISABLE)
+int mp_guard_site(const char* file, uint32_t line)
+{
+	(void)file;
+	(void)line;
+	MP_MESSAGE("Failed to select guarded site since magpie is built without MP_GUARD_PAGES");
+	return -1;
+}
+#endif
+
+#if !defined(MP_TRACE) || defined(MP_DISABLE)
+int mp_trace_start(const char* path)
+{
+	(void)path;
+	MP_MESSAGE("Failed to start trace since magpie is built without MP_TRACE");
+	return -1;
+}
+
+void mp_trace_stop()
+{
+}
+#endif
+
+#if !defined(MP_SCAN) || defined(MP_DISABLE)
+int mp_scan_start(uint32_t budget)
+{
+	(void)budget;
+	MP_MESSAGE("Failed to start scanner since magpie is built without MP_SCAN");
+	return -1;
+}
+
+size_t mp_scan_stop()
+{
+	return 0;
+}
+#endif
+
+#if !defined(MP_SHM) || defined(MP_DISABLE)
+int mp_shm_start(const char* name)
+{
+	(void)name;
+	MP_MESSAGE("Failed to start shared memory statistics since magpie is built without MP_SHM");
+	return -1;
+}
+
+void mp_shm_stop()
+{
+}
+#endif
+
+// Remove print locations
+// Terminate function does nothing
+// Remove validation function
+// Make allocation functions simple wrappers that increment count
+// Do not build hash table functions if MP_DISABLE is defined
+#ifdef MP_DISABLE
+struct MPAllocLocation* mp_location_internal(const char* file, uint32_t line)
+{
+	// Only used for messages, which are written before the next allocation on the same thread
+	static _Thread_local struct MPAllocLocation location;
+	location.file = file;
+	location.line = line;
+	return &location;
+}
+
+void mp_print_locations()
+{
+	MP_MESSAGE("Failed to fetch locations since magpie is disabled in build");
+}
+
+int mp_dump_heap_profile(const char* path, int format)
+{
+	(void)path;
+	(void)format;
+	MP_MESSAGE("Failed to write heap profile since magpie is disabled in build");
+	return -1;
+}
+
+uint32_t mp_snapshot()
+{
+	MP_MESSAGE("Failed to take snapshot since magpie is disabled in build");
+	return 0;
+}
+
+size_t mp_snapshot_diff(uint32_t a, uint32_t b)
+{
+	(void)a;
+	(void)b;
+	MP_MESSAGE("Failed to compare snapshots since magpie is disabled in build");
+	return 0;
+}
+
+size_t mp_terminate()
+{
+	MP_MESSAGE("Failed to fetch remaining blocks since magpie is disabled in build");
+	return 0;
+}
+
+int mp_validate_internal(void* ptr, const char* file, uint32_t line)
+{
+	MP_MESSAGE("Failed to validate pointer since magpie is disabled in build");
+	return MP_VALIDATE_OK;
+}
+
+void* mp_malloc_internal(size_t size, struct MPAllocLocation* location)
+{
+	void* ptr = malloc(size);
+	if (ptr == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%d Failed to allocate memory for %zu bytes", location->file, location->line,
+				 size);
+		MP_MESSAGE(msg);
+		return NULL;
+	}
+	MP_STAT_ADD(total_alloc_count, 1);
+	MP_STAT_ADD(total_alloc_size, size);
+	MP_STAT_ADD(alloc_count, 1);
+	MP_STAT_ADD(alloc_size, mp_usable_size(ptr));
+	return ptr;
+}
+
+void* mp_calloc_internal(size_t num, size_t size, struct MPAllocLocation* location)
+{
+	void* ptr = calloc(num, size);
+	if (ptr == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%d Failed to allocate memory for %zu bytes", location->file, location->line,
+				 size);
+		MP_MESSAGE(msg);
+		return NULL;
+	}
+	MP_STAT_ADD(total_alloc_count, 1);
+	MP_STAT_ADD(total_alloc_size, num * size);
+	MP_STAT_ADD(alloc_count, 1);
+	MP_STAT_ADD(alloc_size, mp_usable_size(ptr));
+	return ptr;
+}
+
+void* mp_realloc_internal(void* ptr, size_t size, struct MPAllocLocation* location)
+{
+	// Behaves as malloc
+	if (ptr == NULL)
+		return mp_malloc_internal(size, location);
+
+	// Behaves as free, like the tracked realloc, instead of leaving it to the C library
+	if (size == 0)
+	{
+		mp_free_internal(ptr, location->file, location->line);
+		return NULL;
+	}
+
+	size_t old_usable = mp_usable_size(ptr);
+	void* new_ptr = realloc(ptr, size);
+	// The old block is untouched when realloc fails
+	if (new_ptr == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%d Failed to reallocate memory to %zu bytes", location->file, location->line,
+				 size);
+		MP_MESSAGE(msg);
+		return NULL;
+	}
+	size_t new_usable = mp_usable_size(new_ptr);
+	// Only growth counts towards the bytes ever allocated, the live bytes follow both ways
+	if (new_usable > old_usable)
+		MP_STAT_ADD(total_alloc_size, new_usable - old_usable);
+	MP_STAT_ADD(alloc_size, new_usable - old_usable);
+	return new_ptr;
+}
+
+void mp_free_internal(void* ptr, const char* file, uint32_t line)
+{
+#ifdef MP_WARN_NULL
+	if (ptr == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%u Freeing NULL pointer", file, line);
+		MP_MESSAGE(msg);
+		return;
+	}
+#endif
+	if (ptr == NULL)
+		return;
+	MP_STAT_SUB(alloc_count, 1);
+	MP_STAT_SUB(alloc_size, mp_usable_size(ptr));
+	free(ptr);
+}
+
+void* mp_aligned_alloc_internal(size_t alignment, size_t size, struct MPAllocLocation* location)
+{
+	void* ptr = NULL;
+	if (alignment && (alignment & (alignment - 1)) == 0)
+		ptr = mp_memalign(alignment < sizeof(void*) ? sizeof(void*) : alignment, size);
+	if (ptr == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%d Failed to allocate memory for %zu bytes aligned to %zu", location->file,
+				 location->line, size, alignment);
+		MP_MESSAGE(msg);
+		return NULL;
+	}
+	MP_STAT_ADD(total_alloc_count, 1);
+	MP_STAT_ADD(total_alloc_size, size);
+	MP_STAT_ADD(alloc_count, 1);
+	MP_STAT_ADD(alloc_size, mp_usable_size(ptr));
+	return ptr;
+}
+
+int mp_posix_memalign_internal(void** ptr, size_t alignment, size_t size, struct MPAllocLocation* location)
+{
+	if (alignment % sizeof(void*) || (alignment & (alignment - 1)))
+		return EINVAL;
+	void* block = mp_aligned_alloc_internal(alignment, size, location);
+	if (block == NULL)
+		return ENOMEM;
+	*ptr = block;
+	return 0;
+}
+
+void mp_free_sized_internal(void* ptr, size_t size, const char* file, uint32_t line)
+{
+	// The counters hold usable sizes, which size does not tell
+	mp_free_internal(ptr, file, line);
+}
+
+size_t mp_stripe_sum(size_t offset)
+{
+	size_t sum = 0;
+	for (size_t i = 0; i < MP_COUNTER_STRIPES; i++)
+		sum += __atomic_load_n((size_t*)((char*)&mp_counter_stripes[i] + offset), __ATOMIC_RELAXED);
+	return sum;
+}
+
+#else
+// Orders locations by peak live bytes, biggest first
+// Orders by estimated bytes with MP_SAMPLE
+int mp_location_cmp(const void* a, const void* b)
+{
+	const struct MPAllocLocation* la = *(const struct MPAllocLocation**)a;
+	const struct MPAllocLocation* lb = *(const struct MPAllocLocation**)b;
+#ifdef MP_SAMPLE
+	return (la->estimated_bytes < lb->estimated_bytes) - (la->estimated_bytes > lb->estimated_bytes);
+#else
+	return (la->peak_size < lb->peak_size) - (la->peak_size > lb->peak_size);
+#endif
+}
+
+// Prints the non empty buckets of the size histogram of a location
+void mp_print_histogram(struct MPAllocLocation* location)
+{
+	char msg[MP_MSG_LEN];
+	int len = snprintf(msg, sizeof msg, "-> Sizes");
+	for (size_t i = 0; i < MP_SIZE_BUCKETS && len < (int)sizeof msg; i++)
+	{
+		uint32_t count = MP_COUNTER_LOAD(location->size_histogram[i]);
+		if (count == 0)
+			continue;
+		size_t low = i ? (size_t)1 << (i - 1) : 0;
+		if (i == MP_SIZE_BUCKETS - 1)
+			len += snprintf(msg + len, sizeof msg - len, " %zu+: %u", low, count);
+		else
+			len += snprintf(msg + len, sizeof msg - len, " %zu-%zu: %u", low, i ? ((size_t)1 << i) - 1 : 0, count);
+	}
+	MP_MESSAGE(msg);
+}
+
+// Copies the name and counters of a location to report them without holding mp_locations_lock
+static void mp_location_copy(struct MPAllocLocation* copy, struct MPAllocLocation* location)
+{
+	*copy = (struct MPAllocLocation){location->file, location->line};
+	copy->count = MP_COUNTER_LOAD(location->count);
+	copy->live_count = MP_COUNTER_LOAD(location->live_count);
+	copy->live_size = MP_COUNTER_LOAD(location->live_size);
+	copy->total_size = MP_COUNTER_LOAD(location->total_size);
+	copy->peak_size = MP_COUNTER_LOAD(location->peak_size);
+	copy->realloc_count = MP_COUNTER_LOAD(location->realloc_count);
+	copy->realloc_moved = MP_COUNTER_LOAD(location->realloc_moved);
+	copy->realloc_copied = MP_COUNTER_LOAD(location->realloc_copied);
+	for (size_t i = 0; i < MP_SIZE_BUCKETS; i++)
+		copy->size_histogram[i] = MP_COUNTER_LOAD(location->size_histogram[i]);
+	copy->estimated_count = MP_COUNTER_LOAD(location->estimated_count);
+	copy->estimated_bytes = MP_COUNTER_LOAD(location->estimated_bytes);
+}
+
+void mp_print_locations()
+{
+#ifdef MP_THREAD_CACHE
+	// Allocations are counted to their location when published
+	mp_flush_all_caches(0);
+#endif
+#ifdef MP_BACKTRACE
+	// The locations below sum the stacks passing through them
+	mp_print_stacks(0);
+#endif
+	// Reported from copies outside the lock since the message callback may allocate at a new location
+	MP_LOCK(&mp_locations_lock);
+	size_t count = 0;
+	struct MPAllocLocation* copies = malloc((mp_locations.count + 1) * sizeof(*copies));
+	for (size_t i = 0; i < mp_locations.size; i++)
+	{
+		if (mp_locations.items[i])
+			mp_location_copy(&copies[count++], mp_locations.items[i]);
+	}
+	MP_UNLOCK(&mp_locations_lock);
+
+	// Sort by peak bytes, biggest first
+	struct MPAllocLocation** sorted = malloc((count + 1) * sizeof(*sorted));
+	for (size_t i = 0; i < count; i++)
+		sorted[i] = &copies[i];
+	qsort(sorted, count, sizeof(*sorted), mp_location_cmp);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		struct MPAllocLocation* it = sorted[i];
+		char msg[MP_MSG_LEN];
+#ifdef MP_SAMPLE
+		snprintf(msg, sizeof msg, "Allocator at %s:%u made an estimated %zu allocations of %zu bytes from %u samples",
+				 it->file, it->line, MP_COUNTER_LOAD(it->estimated_count), MP_COUNTER_LOAD(it->estimated_bytes),
+				 MP_COUNTER_LOAD(it->count));
+#else
+		snprintf(msg, sizeof msg,
+				 "Allocator at %s:%u made %u allocations of %zu bytes, %zu blocks of %zu bytes are live with a peak of "
+				 "%zu bytes",
+				 it->file, it->line, MP_COUNTER_LOAD(it->count), MP_COUNTER_LOAD(it->total_size),
+				 MP_COUNTER_LOAD(it->live_count), MP_COUNTER_LOAD(it->live_size), MP_COUNTER_LOAD(it->peak_size));
+#endif
+		MP_MESSAGE(msg);
+		size_t reallocs = MP_COUNTER_LOAD(it->realloc_count);
+		if (reallocs)
+		{
+			size_t moved = MP_COUNTER_LOAD(it->realloc_moved);
+			snprintf(msg, sizeof msg, "-> Reallocated %zu times, %zu in place and %zu moved copying %zu bytes",
+					 reallocs, reallocs - moved, moved, MP_COUNTER_LOAD(it->realloc_copied));
+			MP_MESSAGE(msg);
+		}
+		mp_print_histogram(it);
+	}
+	free(sorted);
+	free(copies);
+}
+
+uint32_t mp_snapshot()
+{
+	return MP_COUNTER_FETCH_ADD(mp_generation, 1) + 1;
+}
+
+// Returns the slot of key in items, which is empty if key is not in items
+static inline struct MPSiteTotal* mp_site_total_slot(struct MPSiteTotal* items, size_t size, void* key)
+{
+	size_t mask = size - 1;
+	size_t pos = mp_hash_ptr(key) & mask;
+	while (items[pos].key && items[pos].key != key)
+		pos = (pos + 1) & mask;
+	return &items[pos];
+}
+
+void mp_site_totals_add(struct MPSiteTotals* totals, struct MemBlock* block)
+{
+	if (totals->count + 1 >= totals->size * 0.7)
+	{
+		// Rehash into a table of double size
+		size_t old_size = totals->size;
+		struct MPSiteTotal* old_items = totals->items;
+		totals->size = old_size ? old_size * 2 : 64;
+		totals->items = calloc(totals->size, sizeof(*totals->items));
+		for (size_t i = 0; i < old_size; i++)
+		{
+			if (old_items[i].key)
+				*mp_site_total_slot(totals->items, totals->size, old_items[i].key) = old_items[i];
+		}
+		free(old_items);
+	}
+
+	void* key = block->location;
+#ifdef MP_BACKTRACE
+	if (block->stack)
+		key = block->stack;
+#endif
+	struct MPSiteTotal* total = mp_site_total_slot(totals->items, totals->size, key);
+	if (total->key == NULL)
+	{
+		total->key = key;
+		total->location = block->location;
+#ifdef MP_BACKTRACE
+		total->stack = block->stack;
+#endif
+		totals->count++;
+	}
+	total->count++;
+	total->size += block->size;
+}
+
+// Orders site totals by size, biggest first
+int mp_site_total_cmp(const void* a, const void* b)
+{
+	const struct MPSiteTotal* ta = a;
+	const struct MPSiteTotal* tb = b;
+	return (ta->size < tb->size) - (ta->size > tb->size);
+}
+
+// Blocks counted by mp_snapshot_diff
+struct MPSnapshotDiff
+{
+	uint32_t a;
+	uint32_t b;
+	struct MPSiteTotals totals;
+};
+
+void mp_snapshot_diff_block(struct MemBlock* block, void* data)
+{
+	struct MPSnapshotDiff* diff = data;
+	// Generations wrap, so compare distances from a
+	if (block->generation - diff->a < diff->b - diff->a)
+		mp_site_totals_add(&diff->totals, block);
+}
+
+size_t mp_snapshot_diff(uint32_t a, uint32_t b)
+{
+#ifdef MP_THREAD_CACHE
+	mp_flush_all_caches(0);
+#endif
+	struct MPSnapshotDiff diff = {a, b, {0}};
+	mp_walk_blocks(mp_snapshot_diff_block, &diff);
+
+	// Pack the sites to sort them
+	size_t count = 0;
+	size_t size = 0;
+	size_t sites = 0;
+	for (size_t i = 0; i < diff.totals.size; i++)
+	{
+		if (diff.totals.items[i].key)
+			diff.totals.items[sites++] = diff.totals.items[i];
+	}
+	qsort(diff.totals.items, sites, sizeof(*diff.totals.items), mp_site_total_cmp);
+
+	char msg[MP_MSG_LEN];
+	for (size_t i = 0; i < sites; i++)
+	{
+		struct MPSiteTotal* it = &diff.totals.items[i];
+		snprintf(msg, sizeof msg,
+				 "%zu memory blocks with a total size of %zu bytes allocated at %s:%u since snapshot %u are still live",
+				 it->count, it->size, it->location->file, it->location->line, a);
+		MP_MESSAGE(msg);
+#ifdef MP_BACKTRACE
+		if (it->stack)
+			mp_print_frames(it->stack);
+#endif
+		count += it->count;
+		size += it->size;
+	}
+	free(diff.totals.items);
+	snprintf(msg, sizeof msg,
+			 "A total of %zu memory blocks of %zu bytes allocated between snapshot %u and %u are still live", count,
+			 size, a, b);
+	MP_MESSAGE(msg);
+	return count;
+}
+
+// Reports a block remaining at termination and checks its padding
+// With MP_BACKTRACE the block is reported with the other live blocks of its stack instead
+void mp_report_leak(struct MemBlock* it)
+{
+	char msg[MP_MSG_LEN];
+#ifdef MP_BACKTRACE
+	if (it->stack == NULL)
+#endif
+	{
+		snprintf(msg, sizeof msg,
+				 "Memory block allocated at %s:%u with a size of %zu bytes has not been freed. Block was "
+				 "allocation num %u",
+				 it->location->file, it->location->line, it->size, it->count);
+		MP_MESSAGE(msg);
+	}
+#ifdef MP_CHECK_OVERFLOW
+	// Validate directly
+	// Check integrity of buffer padding to detect overflows/overruns
+	if (!mp_pad_intact(it))
+	{
+		snprintf(msg, sizeof msg, "Buffer overflow after %zu bytes on pointer %p allocated at %s:%u", it->size,
+				 it->bytes, it->location->file, it->location->line);
+		MP_MESSAGE(msg);
+	}
+#endif
+	//free(it);
+}
+
+size_t mp_terminate()
+{
+	char msg[MP_MSG_LEN];
+	size_t remaining_blocks = 0;
+
+	// Locations may not be released before the scanner, the publisher and the writer are done with them
+	mp_scan_stop();
+	mp_shm_stop();
+	mp_trace_stop();
+#ifdef MP_THREAD_CACHE
+	mp_flush_all_caches(1);
+#endif
+#ifdef MP_QUARANTINE
+	// Reports writes after free while the locations and stacks still exist
+	mp_quarantine_flush();
+#endif
+
+	// Free remaining blocks
+	for (size_t s = 0; s < MP_SHARD_COUNT; s++)
+	{
+		struct MPHashTable* table = &mp_hashtable[s];
+		MP_LOCK(&table->lock);
+#ifdef MP_SEPARATE_META
+		// Walk the records sequentially instead of through the index
+		struct MPSlab* slab = table->slabs;
+		while (slab)
+		{
+			for (size_t i = 0; i < slab->used; i++)
+			{
+				if (slab->blocks[i].bytes)
+				{
+					remaining_blocks++;
+					mp_report_leak(&slab->blocks[i]);
+				}
+			}
+			struct MPSlab* next = slab->next;
+			free(slab);
+			slab = next;
+		}
+		table->slabs = NULL;
+		table->free_blocks = NULL;
+#else
+		if (table->old_items)
+			mp_migrate(table, SIZE_MAX);
+		for (size_t i = 0; i < table->size; i++)
+		{
+			struct MemBlock* it = table->items[i].block;
+			if (it)
+			{
+				remaining_blocks++;
+				mp_report_leak(it);
+			}
+		}
+#endif
+		free(table->old_items);
+		table->old_items = NULL;
+		table->old_size = 0;
+		table->migrate_pos = 0;
+		if (table->items)
+		{
+			free(table->items);
+			table->items = NULL;
+			table->count = 0;
+			table->size = 0;
+		}
+		MP_UNLOCK(&table->lock);
+	}
+#ifdef MP_BACKTRACE
+	mp_print_stacks(1);
+	mp_release_stacks();
+#endif
+	snprintf(msg, sizeof msg, "A total of %zu memory blocks remain to be freed after program execution",
+			 remaining_blocks);
+	MP_MESSAGE(msg);
+
+	// Free the location table
+	MP_LOCK(&mp_locations_lock);
+	for (size_t i = 0; i < mp_locations.size; i++)
+	{
+		struct MPAllocLocation* it = mp_locations.items[i];
+		if (it == NULL)
+			continue;
+		// Static locations are registered again on next use
+		if (it->registered == MP_LOCATION_DYNAMIC)
+			free(it);
+		else
+			it->registered = 0;
+	}
+	free(mp_locations.items);
+	mp_locations.items = NULL;
+	mp_locations.count = 0;
+	mp_locations.size = 0;
+	MP_UNLOCK(&mp_locations_lock);
+#ifdef MP_GUARD_PAGES
+	mp_guard_release_pool();
+#endif
+	return remaining_blocks;
+}
+
+int mp_validate_internal(void* ptr, const char* file, uint32_t line)
+{
+	struct MemBlock storage;
+	struct MemBlock* block = mp_find(ptr, &storage);
+#if defined(MP_SAMPLE) || defined(MP_ALLOW_FOREIGN)
+	// Unsampled or foreign pointers can not be told apart from invalid ones
+	if (block == NULL)
+		return MP_VALIDATE_OK;
+#endif
+	if (block == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%u Validation of invalid or already freed pointer with adress %p", file, line,
+				 ptr);
+		MP_MESSAGE(msg);
+		return MP_VALIDATE_INVALID;
+	}
+#ifdef MP_CHECK_OVERFLOW
+	// Check integrity of buffer padding to detect overflows/overruns
+	if (!mp_pad_intact(block))
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "Buffer overflow after %zu bytes on pointer %p allocated at %s:%u", block->size, ptr,
+				 block->location->file, block->location->line);
+		MP_MESSAGE(msg);
+		return MP_VALIDATE_OVERFLOW;
+	}
+#endif
+	return MP_VALIDATE_OK;
+}
+
+void* mp_malloc_internal(size_t size, struct MPAllocLocation* location)
+{
+#ifdef MP_SAMPLE
+	if (!mp_should_sample(size))
+		return mp_unsampled(malloc(size), size, location);
+#endif
+	// Allocate size for the block info and the buffer requested
+	struct MemBlock storage;
+	struct MemBlock* new_block;
+#ifdef MP_GUARD_PAGES
+	if (mp_should_guard(size, location))
+		new_block = mp_guard_block(mp_guard_map(size), &storage);
+	else
+#endif
+		new_block = mp_block_from_base(malloc(MP_BLOCK_ALLOC_SIZE(size)), &storage);
+
+	// Allocate request
+	if (new_block == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%u Failed to allocate memory for %zu bytes", location->file, location->line,
+				 size);
+		MP_MESSAGE(msg);
+		return NULL;
+	}
+
+// Fill the padding with MP_BUFFER_PAD_VAL
+#ifdef MP_CHECK_OVERFLOW
+	memset(new_block->bytes + size, MP_BUFFER_PAD_VAL, MP_PAD_LEN(new_block, size));
+#endif
+
+	MP_STAT_ADD(total_alloc_count, 1);
+	MP_STAT_ADD(total_alloc_size, size);
+	MP_STAT_ADD(alloc_count, 1);
+	MP_STAT_ADD(alloc_size, size);
+	MP_RAISE_PEAK();
+	new_block->size = size;
+	new_block->location = location;
+	new_block->generation = MP_COUNTER_LOAD(mp_generation);
+	MP_CAPTURE_STACK(new_block, location);
+	MP_RECORD_CALLER(location);
+	mp_site_alloc(new_block);
+#ifdef MP_SAMPLE
+	mp_record_sample(location, size);
+#endif
+
+	// Insert
+	mp_publish(new_block, location);
+	MP_TRACE_EVENT(MP_TRACE_MALLOC, new_block->bytes, NULL, size, location);
+
+	return new_block->bytes;
+}
+void* mp_calloc_internal(size_t num, size_t size, struct MPAllocLocation* location)
+{
+#ifdef MP_SAMPLE
+	if (!mp_should_sample(num * size))
+		return mp_unsampled(calloc(num, size), num * size, location);
+#endif
+	// Allocate size for the block info and the buffer requested
+	struct MemBlock storage;
+	struct MemBlock* new_block;
+#ifdef MP_GUARD_PAGES
+	if (mp_should_guard(num * size, location))
+	{
+		new_block = mp_guard_block(mp_guard_map(num * size), &storage);
+		// Pooled mappings still hold the bytes of their last block
+		if (new_block)
+			memset(new_block->bytes, 0, num * size);
+	}
+	else
+#endif
+		new_block = mp_block_from_base(calloc(1, MP_BLOCK_ALLOC_SIZE(num * size)), &storage);
+
+	// Allocate request
+	if (new_block == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%u Failed to allocate memory for %zu bytes", location->file, location->line,
+				 size * num);
+		MP_MESSAGE(msg);
+		return NULL;
+	}
+
+	// Fill the padding with MP_BUFFER_PAD_VAL
+#ifdef MP_CHECK_OVERFLOW
+	memset(new_block->bytes + num * size, MP_BUFFER_PAD_VAL, MP_PAD_LEN(new_block, num * size));
+#endif
+
+	MP_STAT_ADD(total_alloc_count, 1);
+	MP_STAT_ADD(total_alloc_size, num * size);
+	MP_STAT_ADD(alloc_count, 1);
+	MP_STAT_ADD(alloc_size, num * size);
+	MP_RAISE_PEAK();
+	new_block->size = num * size;
+	new_block->location = location;
+	new_block->generation = MP_COUNTER_LOAD(mp_generation);
+	MP_CAPTURE_STACK(new_block, location);
+	MP_RECORD_CALLER(location);
+	mp_site_alloc(new_block);
+#ifdef MP_SAMPLE
+	mp_record_sample(location, num * size);
+#endif
+	// Insert
+	mp_publish(new_block, location);
+	MP_TRACE_EVENT(MP_TRACE_CALLOC, new_block->bytes, NULL, num * size, location);
+
+	return new_block->bytes;
+}
+// Counts a finished realloc of ptr to new_block and returns its bytes
+static inline void* mp_realloc_done(struct MemBlock* new_block, void* ptr, size_t old_size, int moved)
+{
+	// Only growth counts towards the bytes ever allocated, like the total of the location
+	if (new_block->size > old_size)
+		MP_STAT_ADD(total_alloc_size, new_block->size - old_size);
+	MP_STAT_SUB(alloc_size, old_size);
+	MP_STAT_ADD(alloc_size, new_block->size);
+	MP_RAISE_PEAK();
+	mp_site_resize(new_block, old_size, moved);
+	MP_TRACE_EVENT(MP_TRACE_REALLOC, new_block->bytes, ptr, new_block->size, new_block->location);
+	return new_block->bytes;
+}
+
+void* mp_realloc_internal(void* ptr, size_t size, struct MPAllocLocation* location)
+{
+	// Allocate if ptr is NULL
+	if (ptr == NULL)
+		return mp_malloc_internal(size, location);
+
+	// Free if size is 0
+	if (ptr && size == 0)
+	{
+		mp_free_internal(ptr, location->file, location->line);
+		return NULL;
+	}
+	struct MemBlock storage;
+	struct MemBlock* new_block;
+	size_t old_size;
+#ifndef MP_GUARD_PAGES
+	// The slot of a block in the hashtable is taken out so its shard is not locked while the C library reallocates,
+	// a block left in place gets the same info back and only a moved block is published again
+	// The old address may be handed out again as soon as realloc returns, so no slot keeps it meanwhile
+	// Guarded blocks may have to move between mappings and always take the path below
+	struct MPHashTable* table = mp_get_shard(mp_hash_ptr(ptr));
+	MP_LOCK(&table->lock);
+	struct MemBlock* record = mp_remove(table, ptr);
+	if (record)
+	{
+		struct MemBlock* block = mp_block_copy(record, &storage);
+#ifdef MP_SEPARATE_META
+		// The record stays in its slab, walks skip it until it has bytes again
+		record->bytes = NULL;
+#endif
+		MP_UNLOCK(&table->lock);
+		old_size = block->size;
+		new_block = mp_block_realloc(block, size, &storage);
+		int moved = new_block && new_block->bytes != ptr;
+		if (new_block)
+		{
+			new_block->size = size;
+#ifdef MP_CHECK_OVERFLOW
+			memset(new_block->bytes + size, MP_BUFFER_PAD_VAL, MP_PAD_LEN(new_block, size));
+#endif
+		}
+		if (moved)
+		{
+#ifdef MP_SEPARATE_META
+			MP_LOCK(&table->lock);
+			mp_block_release(table, record);
+			MP_UNLOCK(&table->lock);
+#endif
+			mp_publish(new_block, NULL);
+			return mp_realloc_done(new_block, ptr, old_size, moved);
+		}
+
+		// Left in place or untouched, block was given to realloc so the header is found from ptr again
+#ifndef MP_SEPARATE_META
+		record = (struct MemBlock*)((char*)ptr - MP_BLOCK_HEADER);
+#endif
+		MP_LOCK(&table->lock);
+#ifdef MP_SEPARATE_META
+		// Walks read the record under the lock, bytes marks it used again so it is set after the size
+		if (new_block)
+			record->size = size;
+		record->bytes = ptr;
+#endif
+		mp_insert(table, record);
+		MP_UNLOCK(&table->lock);
+		if (new_block == NULL)
+		{
+			char msg[MP_MSG_LEN];
+			snprintf(msg, sizeof msg, "%s:%u Failed to reallocate memory from %zu to %zu bytes", location->file,
+					 location->line, old_size, size);
+			MP_MESSAGE(msg);
+			return NULL;
+		}
+		return mp_realloc_done(new_block, ptr, old_size, moved);
+	}
+	MP_UNLOCK(&table->lock);
+#endif
+
+	// Pending in a thread cache, unsampled or not tracked
+	struct MemBlock* block = mp_take(ptr, &storage);
+#ifdef MP_SAMPLE
+	// Not sampled, stays unsampled
+	if (block == NULL)
+	{
+		size_t old_usable = mp_usable_size(ptr);
+		void* new_ptr = realloc(ptr, size);
+		if (new_ptr == NULL)
+		{
+			char msg[MP_MSG_LEN];
+			snprintf(msg, sizeof msg, "%s:%u Failed to reallocate memory to %zu bytes", location->file,
+					 location->line, size);
+			MP_MESSAGE(msg);
+			return NULL;
+		}
+		size_t new_usable = mp_usable_size(new_ptr);
+		// Only growth counts towards the bytes ever allocated, like the tracked realloc
+		if (new_usable > old_usable)
+			MP_STAT_ADD(total_alloc_size, new_usable - old_usable);
+		MP_STAT_SUB(alloc_size, old_usable);
+		MP_STAT_ADD(alloc_size, new_usable);
+		MP_RAISE_PEAK();
+		return new_ptr;
+	}
+#endif
+#ifdef MP_ALLOW_FOREIGN
+	// Not allocated by magpie, stays untracked
+	if (block == NULL)
+		return realloc(ptr, size);
+#endif
+	if (block == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%u Reallocating invalid or already freed pointer with adress %p",
+				 location->file, location->line, ptr);
+		MP_MESSAGE(msg);
+		return NULL;
+	}
+	old_size = block->size;
+#ifdef MP_GUARD_PAGES
+	int guard = mp_should_guard(size, block->location);
+	if (guard || block->guarded)
+		new_block = mp_guard_move(block, size, guard);
+	else
+#endif
+		new_block = mp_block_realloc(block, size, &storage);
+	if (new_block == NULL)
+	{
+
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%u Failed to reallocate memory from %zu to %zu bytes", location->file,
+				 location->line, old_size, size);
+		MP_MESSAGE(msg);
+		// The original block is left untouched, but block was given to realloc so its header is found from ptr again
+#ifndef MP_SEPARATE_META
+		block = (struct MemBlock*)((char*)ptr - MP_BLOCK_HEADER);
+#endif
+		mp_publish(block, NULL);
+		return NULL;
+	}
+	new_block->size = size;
+#ifdef MP_CHECK_OVERFLOW
+	memset(new_block->bytes + size, MP_BUFFER_PAD_VAL, MP_PAD_LEN(new_block, size));
+#endif
+	// Stays counted as an allocation of the location it was first allocated at
+	mp_publish(new_block, NULL);
+	return mp_realloc_done(new_block, ptr, old_size, new_block->bytes != ptr);
+}
+
+// Frees ptr, size is the size the caller expects the block to have or SIZE_MAX if unknown
+static inline void mp_free_block(void* ptr, size_t size, const char* file, uint32_t line)
+{
+#ifndef MP_WARN_NULL
+	if (ptr == NULL)
+	{
+		return;
+	}
+#endif
+	struct MemBlock storage;
+	struct MemBlock* block = mp_take(ptr, &storage);
+#ifdef MP_SAMPLE
+	// Not sampled
+	if (block == NULL)
+	{
+		MP_STAT_SUB(alloc_count, 1);
+		MP_STAT_SUB(alloc_size, mp_usable_size(ptr));
+		free(ptr);
+		return;
+	}
+#endif
+	if (block == NULL)
+	{
+		char msg[MP_MSG_LEN];
+#ifdef MP_QUARANTINE
+		struct MPQuarantined entry;
+		if (mp_quarantine_find(ptr, &entry))
+		{
+			snprintf(msg, sizeof msg, "%s:%u Freeing pointer %p allocated at %s:%u again, it was already freed at %s:%u",
+					 file, line, ptr, entry.location->file, entry.location->line, entry.free_file, entry.free_line);
+			MP_MESSAGE(msg);
+			return;
+		}
+#endif
+#ifdef MP_ALLOW_FOREIGN
+		// Not allocated by magpie
+		free(ptr);
+		return;
+#endif
+		snprintf(msg, sizeof msg, "%s:%u Freeing invalid or already freed pointer with adress %p", file, line, ptr);
+		MP_MESSAGE(msg);
+		return;
+	}
+	if (size != SIZE_MAX && size != block->size)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%u Freeing pointer %p as %zu bytes but it was allocated with %zu bytes at %s:%u",
+				 file, line, ptr, size, block->size, block->location->file, block->location->line);
+		MP_MESSAGE(msg);
+	}
+	MP_STAT_SUB(alloc_count, 1);
+	MP_STAT_SUB(alloc_size, block->size);
+	mp_site_free(block);
+	MP_TRACE_EVENT(MP_TRACE_FREE, ptr, NULL, block->size, block->location);
+
+#ifdef MP_CHECK_OVERFLOW
+	// Check integrity of buffer padding to detect overflows/overruns
+	if (!mp_pad_intact(block))
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "Buffer overflow after %zu bytes on pointer %p allocated at %s:%u", block->size, ptr,
+				 block->location->file, block->location->line);
+		MP_MESSAGE(msg);
+	}
+#endif
+#ifdef MP_FILL_ON_FREE
+	memset(block->bytes, MP_BUFFER_PAD_VAL, block->size);
+#endif
+#ifdef MP_QUARANTINE
+	mp_quarantine_push(block, file, line);
+#else
+	MP_BLOCK_FREE(block);
+#endif
+}
+
+void mp_free_internal(void* ptr, const char* file, uint32_t line)
+{
+	mp_free_block(ptr, SIZE_MAX, file, line);
+}
+
+void mp_free_sized_internal(void* ptr, size_t size, const char* file, uint32_t line)
+{
+	mp_free_block(ptr, size, file, line);
+}
+
+// Shared by mp_aligned_alloc_internal and mp_posix_memalign_internal
+// Always inlined so the stack and caller recorded are the ones of the public function
+static inline __attribute__((always_inline)) void* mp_aligned_alloc_inline(size_t alignment, size_t size,
+																		   struct MPAllocLocation* location)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)))
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg,
+				 "%s:%u Failed to allocate memory for %zu bytes aligned to %zu, which is not a power of two",
+				 location->file, location->line, size, alignment);
+		MP_MESSAGE(msg);
+		return NULL;
+	}
+	// Blocks are always aligned like the result of malloc
+	if (alignment < _Alignof(max_align_t))
+		alignment = _Alignof(max_align_t);
+#ifdef MP_SAMPLE
+	if (!mp_should_sample(size))
+		return mp_unsampled(mp_memalign(alignment, size), size, location);
+#endif
+	struct MemBlock storage;
+	struct MemBlock* new_block;
+#ifdef MP_GUARD_PAGES
+	// Guarded bytes end at a page boundary, so they are aligned to the largest power of two dividing their size up to
+	// the page size, which is at least 4 KiB
+	if (alignment <= 4096 && (size + MP_GUARD_SLACK(size)) % alignment == 0 &&
+		mp_should_guard(size, location))
+		new_block = mp_guard_block(mp_guard_map(size), &storage);
+	else
+#endif
+		new_block = mp_block_aligned(alignment, size, &storage);
+
+	if (new_block == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%u Failed to allocate memory for %zu bytes aligned to %zu", location->file,
+				 location->line, size, alignment);
+		MP_MESSAGE(msg);
+		return NULL;
+	}
+
+#ifdef MP_CHECK_OVERFLOW
+	memset(new_block->bytes + size, MP_BUFFER_PAD_VAL, MP_PAD_LEN(new_block, size));
+#endif
+
+	MP_STAT_ADD(total_alloc_count, 1);
+	MP_STAT_ADD(total_alloc_size, size);
+	MP_STAT_ADD(alloc_count, 1);
+	MP_STAT_ADD(alloc_size, size);
+	MP_RAISE_PEAK();
+	new_block->size = size;
+	new_block->location = location;
+	new_block->generation = MP_COUNTER_LOAD(mp_generation);
+	MP_CAPTURE_STACK(new_block, location);
+	MP_RECORD_CALLER(location);
+	mp_site_alloc(new_block);
+#ifdef MP_SAMPLE
+	mp_record_sample(location, size);
+#endif
+
+	mp_publish(new_block, location);
+	MP_TRACE_EVENT(MP_TRACE_MALLOC, new_block->bytes, NULL, size, location);
+
+	return new_block->bytes;
+}
+
+void* mp_aligned_alloc_internal(size_t alignment, size_t size, struct MPAllocLocation* location)
+{
+	return mp_aligned_alloc_inline(alignment, size, location);
+}
+
+int mp_posix_memalign_internal(void** ptr, size_t alignment, size_t size, struct MPAllocLocation* location)
+{
+	if (alignment % sizeof(void*) || (alignment & (alignment - 1)))
+		return EINVAL;
+	void* block = mp_aligned_alloc_inline(alignment, size, location);
+	if (block == NULL)
+		return ENOMEM;
+	*ptr = block;
+	return 0;
+}
+
+#ifdef MP_SAMPLE
+// Returns ln(x) for x > 0
+// Accurate to about 1e-5, avoids depending on libm
+static inline double mp_log(double x)
+{
+	union
+	{
+		double d;
+		uint64_t i;
+	} v = {x};
+	// x = m * 2^e with m in [1, 2)
+	int e = (int)((v.i >> 52) & 0x7ff) - 1023;
+	v.i = (v.i & 0xfffffffffffffull) | 0x3ff0000000000000ull;
+	// ln(m) = 2 * atanh((m - 1) / (m + 1))
+	double t = (v.d - 1) / (v.d + 1);
+	double t2 = t * t;
+	return e * 0.6931471805599453 + 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7))));
+}
+
+// Returns e^-x for x >= 0
+static inline double mp_exp_neg(double x)
+{
+	// e^-x = 2^-n * e^(-f * ln 2) with f in [0, 1)
+	double y = x * 1.4426950408889634;
+	if (y >= 1000)
+		return 0;
+	int n = (int)y;
+	double z = (n - y) * 0.6931471805599453;
+	union
+	{
+		double d;
+		uint64_t i;
+	} v = {1 + z * (1 + z * (1.0 / 2 + z * (1.0 / 6 + z * (1.0 / 24 + z * (1.0 / 120 + z * (1.0 / 720))))))};
+	v.i -= (uint64_t)n << 52;
+	return v.d;
+}
+
+size_t mp_next_sample_distance()
+{
+	// xorshift64*
+	uint64_t x = mp_sample_rng;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	mp_sample_rng = x;
+	// Uniform in (0, 1]
+	double u = (double)(((x * 0x2545f4914f6cdd1dull) >> 11) + 1) * (1.0 / 9007199254740992.0);
+	return (size_t)(-mp_log(u) * MP_COUNTER_LOAD(mp_sample_interval)) + 1;
+}
+
+void mp_record_sample(struct MPAllocLocation* location, size_t size)
+{
+	// Probability of an allocation of size bytes being sampled
+	double p = 1 - mp_exp_neg((double)size / MP_COUNTER_LOAD(mp_sample_interval));
+	MP_COUNTER_ADD(location->estimated_count, (size_t)(1 / p + 0.5));
+	MP_COUNTER_ADD(location->estimated_bytes, (size_t)(size / p + 0.5));
+}
+
+void* mp_unsampled(void* ptr, size_t size, struct MPAllocLocation* location)
+{
+	if (ptr == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "%s:%u Failed to allocate memory for %zu bytes", location->file, location->line,
+				 size);
+		MP_MESSAGE(msg);
+		return NULL;
+	}
+	MP_STAT_ADD(total_alloc_count, 1);
+	MP_STAT_ADD(total_alloc_size, size);
+	MP_STAT_ADD(alloc_count, 1);
+	MP_STAT_ADD(alloc_size, mp_usable_size(ptr));
+	MP_RAISE_PEAK();
+	return ptr;
+}
+#endif
+
+#ifdef MP_GUARD_PAGES
+// Returns the number of pages before the guard page of guarded bytes of size bytes
+static inline size_t mp_guard_pages(size_t size)
+{
+	size_t pages = (size + MP_GUARD_SLACK(size) + mp_page_size - 1) / mp_page_size;
+	return pages ? pages : 1;
+}
+
+int mp_guard_site_match(struct MPAllocLocation* location)
+{
+	size_t len = strlen(location->file);
+	for (uint32_t i = 0; i < mp_guard_site_count; i++)
+	{
+		struct MPGuardSite* site = &mp_guard_sites[i];
+		size_t site_len = strlen(site->file);
+		if ((site->line && site->line != location->line) || site_len > len ||
+			strcmp(location->file + len - site_len, site->file) != 0)
+			continue;
+		// Only match whole path components
+		if (site_len == len || location->file[len - site_len - 1] == '/')
+			return 1;
+	}
+	return 0;
+}
+
+int mp_guard_site(const char* file, uint32_t line)
+{
+	MP_LOCK(&mp_locations_lock);
+	if (mp_guard_site_count == MP_GUARD_SITES)
+	{
+		MP_UNLOCK(&mp_locations_lock);
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "Failed to select guarded site %s:%u since %d sites are already selected", file,
+				 line, MP_GUARD_SITES);
+		MP_MESSAGE(msg);
+		return -1;
+	}
+	mp_guard_sites[mp_guard_site_count] = (struct MPGuardSite){file, line};
+	MP_COUNTER_STORE(mp_guard_site_count, mp_guard_site_count + 1);
+	// Mark the locations already registered
+	for (size_t i = 0; i < mp_locations.size; i++)
+	{
+		struct MPAllocLocation* it = mp_locations.items[i];
+		if (it)
+			MP_COUNTER_STORE(it->guard, mp_guard_site_match(it));
+	}
+	MP_UNLOCK(&mp_locations_lock);
+	return 0;
+}
+
+void* mp_guard_map(size_t size)
+{
+	if (MP_COUNTER_LOAD(mp_page_size) == 0)
+		MP_COUNTER_STORE(mp_page_size, (size_t)sysconf(_SC_PAGESIZE));
+	size_t pages = mp_guard_pages(size);
+	char* map = NULL;
+	if (pages <= MP_GUARD_CLASSES)
+	{
+		MP_LOCK(&mp_guard_lock);
+		struct MPGuardMapping* it = mp_guard_pool[pages - 1];
+		if (it)
+		{
+			mp_guard_pool[pages - 1] = it->next;
+			mp_guard_pool_len[pages - 1]--;
+			map = (char*)it;
+		}
+		MP_UNLOCK(&mp_guard_lock);
+	}
+	if (map == NULL)
+	{
+		map = mmap(NULL, (pages + 1) * mp_page_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED)
+			return NULL;
+		if (mprotect(map + pages * mp_page_size, mp_page_size, PROT_NONE) != 0)
+		{
+			munmap(map, (pages + 1) * mp_page_size);
+			return NULL;
+		}
+	}
+	char* bytes = map + pages * mp_page_size - MP_GUARD_SLACK(size) - size;
+	// The slack before the guard page is checked like the padding of other blocks
+	memset(bytes + size, MP_BUFFER_PAD_VAL, MP_GUARD_SLACK(size));
+	return bytes;
+}
+
+void mp_guard_unmap(void* bytes, size_t size)
+{
+	size_t pages = mp_guard_pages(size);
+	char* map = (char*)bytes + size + MP_GUARD_SLACK(size) - pages * mp_page_size;
+	if (pages <= MP_GUARD_CLASSES)
+	{
+		MP_LOCK(&mp_guard_lock);
+		if (mp_guard_pool_len[pages - 1] < MP_GUARD_POOL_LEN)
+		{
+			struct MPGuardMapping* it = (struct MPGuardMapping*)map;
+			it->next = mp_guard_pool[pages - 1];
+			mp_guard_pool[pages - 1] = it;
+			mp_guard_pool_len[pages - 1]++;
+			MP_UNLOCK(&mp_guard_lock);
+			return;
+		}
+		MP_UNLOCK(&mp_guard_lock);
+	}
+	munmap(map, (pages + 1) * mp_page_size);
+}
+
+struct MemBlock* mp_guard_move(struct MemBlock* block, size_t size, int guard)
+{
+	char* bytes = guard ? mp_guard_map(size) : malloc(MP_BLOCK_ALLOC_SIZE(size));
+	if (bytes == NULL)
+		return NULL;
+	memcpy(bytes, block->bytes, size < block->size ? size : block->size);
+	MP_BLOCK_FREE(block);
+	block->bytes = bytes;
+	block->guarded = guard;
+	return block;
+}
+
+void mp_guard_release_pool()
+{
+	MP_LOCK(&mp_guard_lock);
+	for (size_t i = 0; i < MP_GUARD_CLASSES; i++)
+	{
+		struct MPGuardMapping* it = mp_guard_pool[i];
+		while (it)
+		{
+			struct MPGuardMapping* next = it->next;
+			munmap(it, (i + 2) * mp_page_size);
+			it = next;
+		}
+		mp_guard_pool[i] = NULL;
+		mp_guard_pool_len[i] = 0;
+	}
+	MP_UNLOCK(&mp_guard_lock);
+}
+#endif
+
+size_t mp_find_unfilled_byte(const char* p, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+	{
+		if (p[i] != (char)MP_BUFFER_PAD_VAL)
+			return i;
+	}
+	return len;
+}
+
+size_t mp_find_unfilled_word(const char* p, size_t len)
+{
+	const uint64_t pattern = 0x0101010101010101ull * (unsigned char)MP_BUFFER_PAD_VAL;
+	size_t i = 0;
+	// Compare 64 bytes at a time without branching on each word, the byte loop finds the offset in the failing part
+	for (; i + 64 <= len; i += 64)
+	{
+		uint64_t diff = 0;
+		for (size_t j = 0; j < 64; j += 8)
+		{
+			uint64_t word;
+			memcpy(&word, p + i + j, sizeof word);
+			diff |= word ^ pattern;
+		}
+		if (diff)
+			break;
+	}
+	return i + mp_find_unfilled_byte(p + i, len - i);
+}
+
+#ifdef MP_SIMD_X86
+// Loads are unaligned and never read past p + len, so guarded blocks can be checked up to their guard page
+__attribute__((target("sse2"))) size_t mp_find_unfilled_sse2(const char* p, size_t len)
+{
+	const __m128i pattern = _mm_set1_epi8((char)MP_BUFFER_PAD_VAL);
+	size_t i = 0;
+	for (; i + 64 <= len; i += 64)
+	{
+		__m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), pattern);
+		__m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 16)), pattern);
+		__m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 32)), pattern);
+		__m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i + 48)), pattern);
+		if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d))) != 0xffff)
+			break;
+	}
+	for (; i + 16 <= len; i += 16)
+	{
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + i)), pattern));
+		if (mask != 0xffff)
+			return i + __builtin_ctz(~mask);
+	}
+	if (i == len || len < 16)
+		return i + mp_find_unfilled_byte(p + i, len - i);
+	// The last 16 bytes overlap bytes already found equal, so the first difference is not before i
+	unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + len - 16)), pattern));
+	return mask != 0xffff ? len - 16 + __builtin_ctz(~mask) : len;
+}
+
+__attribute__((target("avx2"))) size_t mp_find_unfilled_avx2(const char* p, size_t len)
+{
+	const __m256i pattern = _mm256_set1_epi8((char)MP_BUFFER_PAD_VAL);
+	size_t i = 0;
+	for (; i + 128 <= len; i += 128)
+	{
+		__m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), pattern);
+		__m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 32)), pattern);
+		__m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 64)), pattern);
+		__m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i + 96)), pattern);
+		if ((unsigned)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, d))) !=
+			0xffffffffu)
+			break;
+	}
+	for (; i + 32 <= len; i += 32)
+	{
+		unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + i)), pattern));
+		if (mask != 0xffffffffu)
+			return i + __builtin_ctz(~mask);
+	}
+	if (i == len)
+		return len;
+	if (len < 32)
+	{
+		// Compared here instead of calling the SSE2 kernel, so no legacy SSE instructions follow AVX ones
+		const __m128i half = _mm_set1_epi8((char)MP_BUFFER_PAD_VAL);
+		if (len < 16)
+			return mp_find_unfilled_byte(p, len);
+		unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), half));
+		if (mask != 0xffff)
+			return __builtin_ctz(~mask);
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(p + len - 16)), half));
+		return mask != 0xffff ? len - 16 + __builtin_ctz(~mask) : len;
+	}
+	// The last 32 bytes overlap bytes already found equal, so the first difference is not before i
+	unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(p + len - 32)), pattern));
+	return mask != 0xffffffffu ? len - 32 + __builtin_ctz(~mask) : len;
+}
+#endif
+
+size_t mp_find_unfilled_init(const char* p, size_t len)
+{
+	size_t (*kernel)(const char* p, size_t len) = mp_find_unfilled_word;
+#ifdef MP_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		kernel = mp_find_unfilled_avx2;
+	else if (__builtin_cpu_supports("sse2"))
+		kernel = mp_find_unfilled_sse2;
+#endif
+	// Every thread picks the same kernel, so racing stores are harmless
+	MP_COUNTER_STORE(mp_unfilled_kernel, kernel);
+	return kernel(p, len);
+}
+
+#ifdef MP_QUARANTINE
+// Checks that the bytes of a block leaving the quarantine are still filled and releases them
+void mp_quarantine_release(struct MPQuarantined* it)
+{
+	size_t offset = mp_find_unfilled(it->bytes, it->size);
+	if (offset != it->size)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg,
+				 "Memory block %p of %zu bytes allocated at %s:%u was written to at offset %zu after being freed "
+				 "at %s:%u",
+				 it->bytes, it->size, it->location->file, it->location->line, offset, it->free_file, it->free_line);
+		MP_MESSAGE(msg);
+#ifdef MP_BACKTRACE
+		if (it->stack)
+			mp_print_frames(it->stack);
+#endif
+	}
+#ifdef MP_GUARD_PAGES
+	if (it->guarded)
+	{
+		mp_guard_unmap(it->bytes, it->size);
+		return;
+	}
+#endif
+#ifdef MP_SEPARATE_META
+	free(it->bytes);
+#else
+	free(it->bytes - MP_BLOCK_HEADER - it->offset);
+#endif
+}
+
+void mp_quarantine_push(struct MemBlock* block, const char* file, uint32_t line)
+{
+	struct MPQuarantined entry = {block->bytes, block->size, block->location, file, line};
+#ifdef MP_GUARD_PAGES
+	entry.guarded = block->guarded;
+#endif
+#ifndef MP_SEPARATE_META
+	entry.offset = block->offset;
+#endif
+#ifdef MP_BACKTRACE
+	entry.stack = block->stack;
+#endif
+	if (entry.size > MP_QUARANTINE_SIZE)
+	{
+		mp_quarantine_release(&entry);
+		return;
+	}
+
+	struct MPQuarantined batch[MP_QUARANTINE_BATCH];
+	for (;;)
+	{
+		size_t count = 0;
+		MP_LOCK(&mp_quarantine_lock);
+		struct MPQuarantine* q = &mp_quarantine;
+		int full = q->count == MP_QUARANTINE_LEN || q->size + entry.size > MP_QUARANTINE_SIZE;
+		if (full)
+		{
+			// Take a whole batch so the next frees do not have to
+			while (q->count && count < MP_QUARANTINE_BATCH)
+			{
+				batch[count++] = q->items[q->head];
+				q->size -= q->items[q->head].size;
+				q->head = (q->head + 1) % MP_QUARANTINE_LEN;
+				q->count--;
+			}
+		}
+		else
+		{
+			q->items[(q->head + q->count) % MP_QUARANTINE_LEN] = entry;
+			q->count++;
+			q->size += entry.size;
+		}
+		MP_UNLOCK(&mp_quarantine_lock);
+
+		// Check outside the lock
+		for (size_t i = 0; i < count; i++)
+			mp_quarantine_release(&batch[i]);
+		if (!full)
+			return;
+	}
+}
+
+int mp_quarantine_find(void* ptr, struct MPQuarantined* entry)
+{
+	int found = 0;
+	MP_LOCK(&mp_quarantine_lock);
+	for (size_t i = 0; i < mp_quarantine.count && !found; i++)
+	{
+		struct MPQuarantined* it = &mp_quarantine.items[(mp_quarantine.head + i) % MP_QUARANTINE_LEN];
+		if (it->bytes == ptr)
+		{
+			*entry = *it;
+			found = 1;
+		}
+	}
+	MP_UNLOCK(&mp_quarantine_lock);
+	return found;
+}
+
+void mp_quarantine_flush()
+{
+	MP_LOCK(&mp_quarantine_lock);
+	while (mp_quarantine.count)
+	{
+		mp_quarantine_release(&mp_quarantine.items[mp_quarantine.head]);
+		mp_quarantine.head = (mp_quarantine.head + 1) % MP_QUARANTINE_LEN;
+		mp_quarantine.count--;
+	}
+	mp_quarantine.head = 0;
+	mp_quarantine.size = 0;
+	MP_UNLOCK(&mp_quarantine_lock);
+}
+#endif
+
+#ifdef MP_SCAN
+static inline uint64_t mp_scan_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Sleeps for ns nanoseconds, waking up early when the scanner is stopped
+static void mp_scan_sleep(uint64_t ns)
+{
+	while (ns && !__atomic_load_n(&mp_scan_stopping, __ATOMIC_ACQUIRE))
+	{
+		uint64_t step = ns < 10000000 ? ns : 10000000;
+		struct timespec ts = {0, (long)step};
+		nanosleep(&ts, NULL);
+		ns -= step;
+	}
+}
+
+// Keeps a block with overwritten padding for reporting and restores its padding
+void mp_scan_block(struct MemBlock* block, void* data)
+{
+	if (mp_pad_intact(block))
+		return;
+	struct MPScanSlice* slice = data;
+	struct MPScanReport* report = &slice->reports[slice->count++];
+	report->ptr = block->bytes;
+	report->size = block->size;
+	report->location = block->location;
+#ifdef MP_BACKTRACE
+	report->stack = block->stack;
+#endif
+	memset(block->bytes + block->size, MP_BUFFER_PAD_VAL, MP_PAD_LEN(block, block->size));
+}
+
+void* mp_scan_main(void* arg)
+{
+	(void)arg;
+#ifdef MP_SCHED_IDLE
+	// Only runs on cpus which would otherwise be idle
+	struct sched_param param = {0};
+	pthread_setschedparam(pthread_self(), MP_SCHED_IDLE, &param);
+#endif
+	static struct MPScanSlice slice;
+	uint32_t budget = mp_scan_budget;
+	while (!__atomic_load_n(&mp_scan_stopping, __ATOMIC_ACQUIRE))
+	{
+		uint64_t pass_start = mp_scan_now();
+		for (size_t s = 0; s < MP_SHARD_COUNT; s++)
+		{
+			struct MPHashTable* table = &mp_hashtable[s];
+			size_t pos = 0;
+			while (pos != SIZE_MAX && !__atomic_load_n(&mp_scan_stopping, __ATOMIC_ACQUIRE))
+			{
+				uint64_t start = mp_scan_now();
+				slice.count = 0;
+				MP_LOCK(&table->lock);
+				pos = mp_walk_shard(table, pos, MP_SCAN_SLICE, mp_scan_block, &slice);
+				MP_UNLOCK(&table->lock);
+
+				// Reported outside the lock since the message callback may allocate
+				for (size_t i = 0; i < slice.count; i++)
+				{
+					struct MPScanReport* it = &slice.reports[i];
+					char msg[MP_MSG_LEN];
+					snprintf(msg, sizeof msg,
+							 "Buffer overflow after %zu bytes on pointer %p allocated at %s:%u found by the scanner",
+							 it->size, it->ptr, it->location->file, it->location->line);
+					MP_MESSAGE(msg);
+#ifdef MP_BACKTRACE
+					if (it->stack)
+						mp_print_frames(it->stack);
+#endif
+					MP_COUNTER_ADD(mp_scan_found, 1);
+				}
+				// The slice takes budget percent of the time until the next one
+				mp_scan_sleep((mp_scan_now() - start) * (100 - budget) / budget);
+			}
+		}
+		uint64_t elapsed = mp_scan_now() - pass_start;
+		if (elapsed < (uint64_t)MP_SCAN_PERIOD_MS * 1000000)
+			mp_scan_sleep((uint64_t)MP_SCAN_PERIOD_MS * 1000000 - elapsed);
+	}
+	return NULL;
+}
+
+int mp_scan_start(uint32_t budget)
+{
+	mp_scan_stop();
+	MP_LOCK(&mp_scan_lock);
+	mp_scan_budget = budget < 1 ? 1 : budget > 100 ? 100 : budget;
+	MP_COUNTER_STORE(mp_scan_found, 0);
+	__atomic_store_n(&mp_scan_stopping, 0, __ATOMIC_RELEASE);
+	if (pthread_create(&mp_scan_thread, NULL, mp_scan_main, NULL) != 0)
+	{
+		MP_MESSAGE("Failed to start scanner thread");
+		MP_UNLOCK(&mp_scan_lock);
+		return -1;
+	}
+	mp_scan_running = 1;
+	MP_UNLOCK(&mp_scan_lock);
+	return 0;
+}
+
+size_t mp_scan_stop()
+{
+	MP_LOCK(&mp_scan_lock);
+	if (mp_scan_running)
+	{
+		__atomic_store_n(&mp_scan_stopping, 1, __ATOMIC_RELEASE);
+		pthread_join(mp_scan_thread, NULL);
+		mp_scan_running = 0;
+	}
+	MP_UNLOCK(&mp_scan_lock);
+	return MP_COUNTER_LOAD(mp_scan_found);
+}
+#endif
+
+#ifdef MP_SHM
+// Writes the global counters and the sites with the most live bytes to the segment
+static void mp_shm_update(struct MPShmHeader* shm)
+{
+	struct MPShmSite* sites = (struct MPShmSite*)(shm + 1);
+	// Kept sorted by live bytes while the location table is walked
+	struct MPAllocLocation* top[MP_SHM_SITES];
+	size_t top_count = 0;
+	MP_LOCK(&mp_locations_lock);
+	for (size_t i = 0; i < mp_locations.size; i++)
+	{
+		struct MPAllocLocation* it = mp_locations.items[i];
+		if (it == NULL)
+			continue;
+		size_t live_size = MP_COUNTER_LOAD(it->live_size);
+		size_t pos = top_count < MP_SHM_SITES ? top_count++ : MP_SHM_SITES;
+		while (pos && MP_COUNTER_LOAD(top[pos - 1]->live_size) < live_size)
+		{
+			if (pos < MP_SHM_SITES)
+				top[pos] = top[pos - 1];
+			pos--;
+		}
+		if (pos < MP_SHM_SITES)
+			top[pos] = it;
+	}
+
+	__atomic_store_n(&shm->sequence, shm->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	for (size_t i = 0; i < top_count; i++)
+	{
+		struct MPAllocLocation* it = top[i];
+		struct MPShmSite* site = &sites[i];
+		site->live_count = MP_COUNTER_LOAD(it->live_count);
+		site->live_size = MP_COUNTER_LOAD(it->live_size);
+		site->peak_size = MP_COUNTER_LOAD(it->peak_size);
+		site->total_count = MP_COUNTER_LOAD(it->count);
+		site->total_size = MP_COUNTER_LOAD(it->total_size);
+		site->line = it->line;
+		size_t len = strlen(it->file);
+		const char* file = len < MP_SHM_FILE_LEN ? it->file : it->file + len - (MP_SHM_FILE_LEN - 1);
+		memcpy(site->file, file, strlen(file) + 1);
+	}
+	MP_UNLOCK(&mp_locations_lock);
+	shm->site_count = top_count;
+	shm->count = mp_get_count();
+	shm->size = mp_get_size();
+	shm->peak_count = mp_get_peak_count();
+	shm->peak_size = mp_get_peak_size();
+	shm->total_count = mp_get_total_count();
+	shm->total_size = mp_get_total_size();
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	shm->time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	__atomic_store_n(&shm->sequence, shm->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void* mp_shm_main(void* arg)
+{
+	struct MPShmHeader* shm = arg;
+	while (!__atomic_load_n(&mp_shm_stopping, __ATOMIC_ACQUIRE))
+	{
+		mp_shm_update(shm);
+		// Wakes up at least every 10 ms to check for stopping
+		for (uint32_t waited = 0; waited < MP_SHM_PERIOD_MS && !__atomic_load_n(&mp_shm_stopping, __ATOMIC_ACQUIRE);
+			 waited += 10)
+		{
+			uint32_t step = MP_SHM_PERIOD_MS - waited < 10 ? MP_SHM_PERIOD_MS - waited : 10;
+			struct timespec ts = {0, (long)step * 1000000};
+			nanosleep(&ts, NULL);
+		}
+	}
+	return NULL;
+}
+
+int mp_shm_start(const char* name)
+{
+	mp_shm_stop();
+	MP_LOCK(&mp_shm_lock);
+	char msg[MP_MSG_LEN];
+	if (name)
+		snprintf(mp_shm_name, sizeof mp_shm_name, "%s", name);
+	else
+		snprintf(mp_shm_name, sizeof mp_shm_name, "/magpie.%d", (int)getpid());
+
+	size_t len = sizeof(struct MPShmHeader) + MP_SHM_SITES * sizeof(struct MPShmSite);
+	int fd = shm_open(mp_shm_name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || ftruncate(fd, len) != 0)
+	{
+		snprintf(msg, sizeof msg, "Failed to create shared memory object %s", mp_shm_name);
+		MP_MESSAGE(msg);
+		if (fd >= 0)
+		{
+			close(fd);
+			shm_unlink(mp_shm_name);
+		}
+		MP_UNLOCK(&mp_shm_lock);
+		return -1;
+	}
+	struct MPShmHeader* shm = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+	{
+		snprintf(msg, sizeof msg, "Failed to map shared memory object %s", mp_shm_name);
+		MP_MESSAGE(msg);
+		shm_unlink(mp_shm_name);
+		MP_UNLOCK(&mp_shm_lock);
+		return -1;
+	}
+	// The object starts out zeroed, readers wait for the magic
+	shm->version = MP_SHM_VERSION;
+	shm->site_size = sizeof(struct MPShmSite);
+	shm->pid = getpid();
+	shm->site_capacity = MP_SHM_SITES;
+	mp_shm_update(shm);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(shm->magic, MP_SHM_MAGIC, sizeof MP_SHM_MAGIC);
+
+	__atomic_store_n(&mp_shm_stopping, 0, __ATOMIC_RELEASE);
+	if (pthread_create(&mp_shm_thread, NULL, mp_shm_main, shm) != 0)
+	{
+		MP_MESSAGE("Failed to start shared memory publisher thread");
+		munmap(shm, len);
+		shm_unlink(mp_shm_name);
+		MP_UNLOCK(&mp_shm_lock);
+		return -1;
+	}
+	mp_shm = shm;
+	MP_UNLOCK(&mp_shm_lock);
+	return 0;
+}
+
+void mp_shm_stop()
+{
+	MP_LOCK(&mp_shm_lock);
+	if (mp_shm)
+	{
+		__atomic_store_n(&mp_shm_stopping, 1, __ATOMIC_RELEASE);
+		pthread_join(mp_shm_thread, NULL);
+		// Readers attached before now keep their mapping and see the final numbers
+		mp_shm_update(mp_shm);
+		__atomic_store_n(&mp_shm->stopped, 1, __ATOMIC_RELEASE);
+		munmap(mp_shm, sizeof(struct MPShmHeader) + MP_SHM_SITES * sizeof(struct MPShmSite));
+		shm_unlink(mp_shm_name);
+		mp_shm = NULL;
+	}
+	MP_UNLOCK(&mp_shm_lock);
+}
+#endif
+
+#ifdef MP_TRACE
+// Marks the ring of an exiting thread to be released by the writer
+void mp_trace_ring_destroy(void* data)
+{
+	struct MPTraceRing* ring = data;
+	if (mp_trace_ring == ring)
+		mp_trace_ring = NULL;
+	__atomic_store_n(&ring->dead, 1, __ATOMIC_RELEASE);
+}
+
+void mp_trace_init()
+{
+	pthread_key_create(&mp_trace_key, mp_trace_ring_destroy);
+}
+
+struct MPTraceRing* mp_get_trace_ring()
+{
+	if (mp_trace_ring)
+		return mp_trace_ring;
+
+	pthread_once(&mp_trace_once, mp_trace_init);
+	struct MPTraceRing* ring = calloc(1, sizeof(struct MPTraceRing));
+	ring->thread = __atomic_add_fetch(&mp_trace_threads, 1, __ATOMIC_RELAXED);
+	MP_LOCK(&mp_trace_rings_lock);
+	ring->next = mp_trace_rings;
+	mp_trace_rings = ring;
+	MP_UNLOCK(&mp_trace_rings_lock);
+
+	pthread_setspecific(mp_trace_key, ring);
+	mp_trace_ring = ring;
+	return ring;
+}
+
+size_t mp_trace_drain()
+{
+	size_t written = 0;
+	MP_LOCK(&mp_trace_rings_lock);
+	struct MPTraceRing** link = &mp_trace_rings;
+	while (*link)
+	{
+		struct MPTraceRing* ring = *link;
+		// Read before head so no event pushed before the thread exited is missed
+		int dead = __atomic_load_n(&ring->dead, __ATOMIC_ACQUIRE);
+		size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if (head != ring->tail)
+		{
+			struct MPTraceChunk chunk = {head - ring->tail, ring->thread};
+			fwrite(&chunk, sizeof chunk, 1, mp_trace_file);
+			// The events may wrap around the end of the ring
+			size_t begin = ring->tail & (MP_TRACE_RING_LEN - 1);
+			size_t first = MP_TRACE_RING_LEN - begin < chunk.event_count ? MP_TRACE_RING_LEN - begin : chunk.event_count;
+			fwrite(ring->events + begin, sizeof(struct MPTraceEvent), first, mp_trace_file);
+			fwrite(ring->events, sizeof(struct MPTraceEvent), chunk.event_count - first, mp_trace_file);
+			mp_trace_header.chunk_count++;
+			mp_trace_header.event_count += chunk.event_count;
+		}
+		written += head - ring->tail;
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+		if (dead)
+		{
+			*link = ring->next;
+			free(ring);
+		}
+		else
+			link = &ring->next;
+	}
+	MP_UNLOCK(&mp_trace_rings_lock);
+	return written;
+}
+
+void mp_trace_finish()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	mp_trace_header.stop_time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	mp_trace_header.site_offset = ftell(mp_trace_file);
+
+	MP_LOCK(&mp_locations_lock);
+	struct MPTraceSiteTable table = {mp_locations.count, 0};
+	fwrite(&table, sizeof table, 1, mp_trace_file);
+	for (size_t i = 0; i < mp_locations.size; i++)
+	{
+		struct MPAllocLocation* it = mp_locations.items[i];
+		if (it == NULL)
+			continue;
+		struct MPTraceSite site = {it->id, it->line, table.names_size, strlen(it->file)};
+		fwrite(&site, sizeof site, 1, mp_trace_file);
+		table.names_size += site.name_len;
+	}
+	for (size_t i = 0; i < mp_locations.size; i++)
+	{
+		if (mp_locations.items[i])
+			fputs(mp_locations.items[i]->file, mp_trace_file);
+	}
+	MP_UNLOCK(&mp_locations_lock);
+
+	fseek(mp_trace_file, mp_trace_header.site_offset, SEEK_SET);
+	fwrite(&table, sizeof table, 1, mp_trace_file);
+	fseek(mp_trace_file, 0, SEEK_SET);
+	fwrite(&mp_trace_header, sizeof mp_trace_header, 1, mp_trace_file);
+}
+
+void* mp_trace_writer_main(void* arg)
+{
+	(void)arg;
+	while (1)
+	{
+		int stopping = __atomic_load_n(&mp_trace_stopping, __ATOMIC_ACQUIRE);
+		size_t written = mp_trace_drain();
+		if (stopping)
+			break;
+		if (written == 0)
+		{
+			struct timespec ts = {0, MP_TRACE_FLUSH_MS * 1000000L};
+			nanosleep(&ts, NULL);
+		}
+	}
+	return NULL;
+}
+
+int mp_trace_start(const char* path)
+{
+	mp_trace_stop();
+	MP_LOCK(&mp_trace_lock);
+	FILE* file = fopen(path, "wb");
+	if (file == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "Failed to open trace file %s", path);
+		MP_MESSAGE(msg);
+		MP_UNLOCK(&mp_trace_lock);
+		return -1;
+	}
+	setvbuf(file, NULL, _IOFBF, 1 << 16);
+	struct MPTraceHeader header = {MP_TRACE_MAGIC, MP_TRACE_VERSION, sizeof(struct MPTraceEvent)};
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	header.start_time = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+	mp_trace_header = header;
+	fwrite(&header, sizeof header, 1, file);
+	mp_trace_file = file;
+
+	// Discard events left from an earlier trace
+	MP_LOCK(&mp_trace_rings_lock);
+	for (struct MPTraceRing* ring = mp_trace_rings; ring; ring = ring->next)
+		ring->tail = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+	MP_UNLOCK(&mp_trace_rings_lock);
+	MP_COUNTER_STORE(mp_trace_enabled, 1);
+
+	__atomic_store_n(&mp_trace_stopping, 0, __ATOMIC_RELEASE);
+	if (pthread_create(&mp_trace_writer, NULL, mp_trace_writer_main, NULL) != 0)
+	{
+		// Nothing would empty the rings, and mp_trace_stop only joins a writer of an open file
+		MP_COUNTER_STORE(mp_trace_enabled, 0);
+		fclose(file);
+		mp_trace_file = NULL;
+		MP_MESSAGE("Failed to start trace writer thread");
+		MP_UNLOCK(&mp_trace_lock);
+		return -1;
+	}
+	MP_UNLOCK(&mp_trace_lock);
+	return 0;
+}
+
+void mp_trace_stop()
+{
+	MP_LOCK(&mp_trace_lock);
+	if (mp_trace_file)
+	{
+		MP_COUNTER_STORE(mp_trace_enabled, 0);
+		__atomic_store_n(&mp_trace_stopping, 1, __ATOMIC_RELEASE);
+		pthread_join(mp_trace_writer, NULL);
+		mp_trace_finish();
+		fclose(mp_trace_file);
+		mp_trace_file = NULL;
+	}
+	MP_UNLOCK(&mp_trace_lock);
+}
+#endif
+
+#ifdef MP_BACKTRACE
+// Looks up the bounds of the stack of the calling thread
+void mp_stack_bounds()
+{
+#ifdef __GLIBC__
+	pthread_attr_t attr;
+	void* addr;
+	size_t size;
+	if (pthread_getattr_np(pthread_self(), &attr) == 0)
+	{
+		int found = pthread_attr_getstack(&attr, &addr, &size) == 0;
+		pthread_attr_destroy(&attr);
+		if (found)
+		{
+			mp_stack_low = (uintptr_t)addr;
+			mp_stack_high = (uintptr_t)addr + size;
+			return;
+		}
+	}
+#endif
+	mp_stack_low = (uintptr_t)__builtin_frame_address(0);
+	mp_stack_high = mp_stack_low + MP_STACK_FALLBACK_SIZE;
+}
+
+// Stores the return addresses of the frames from frame in frames
+// Stops at the first frame pointer which is outside the thread stack, misaligned or not above the previous one
+// Returns the number of frames stored
+static inline uint32_t mp_walk_stack(void* frame, void** frames)
+{
+	if (mp_stack_high == 0)
+		mp_stack_bounds();
+	uintptr_t* fp = frame;
+	uint32_t depth = 0;
+	while (depth < MP_BACKTRACE_DEPTH && (uintptr_t)fp >= mp_stack_low &&
+		   (uintptr_t)fp + 2 * sizeof(uintptr_t) <= mp_stack_high && ((uintptr_t)fp & (sizeof(uintptr_t) - 1)) == 0)
+	{
+		// The saved frame pointer of the caller followed by the return address
+		uintptr_t* next = (uintptr_t*)fp[0];
+		// Frames at the top of the stack may hold anything, no code lives in the first page
+		if (fp[1] < 4096)
+			break;
+		frames[depth++] = (void*)fp[1];
+		if (next <= fp)
+			break;
+		fp = next;
+	}
+	return depth;
+}
+
+static inline int mp_stack_equal(struct MPStack* stack, size_t hash, struct MPAllocLocation* location, void** frames,
+								 uint32_t depth)
+{
+	return stack->hash == hash && stack->location == location && stack->depth == depth &&
+		   memcmp(stack->frames, frames, depth * sizeof(*frames)) == 0;
+}
+
+// Returns the stored stack equal to frames, storing a new one if there is none
+// Returns NULL if out of memory
+struct MPStack* mp_intern_stack(size_t hash, struct MPAllocLocation* location, void** frames, uint32_t depth)
+{
+	struct MPStackTable* table = &mp_stacks[(hash >> (sizeof(size_t) * CHAR_BIT - 16)) & (MP_SHARD_COUNT - 1)];
+	MP_LOCK(&table->lock);
+	size_t mask = table->size - 1;
+	if (table->size)
+	{
+		for (size_t pos = hash & mask; table->items[pos]; pos = (pos + 1) & mask)
+		{
+			if (mp_stack_equal(table->items[pos], hash, location, frames, depth))
+			{
+				MP_UNLOCK(&table->lock);
+				return table->items[pos];
+			}
+		}
+	}
+
+	if (table->count + 1 >= table->size * 0.7)
+	{
+		// Rehash into a table of double size
+		size_t old_size = table->size;
+		struct MPStack** old_items = table->items;
+		table->size = old_size ? old_size * 2 : 64;
+		table->items = calloc(table->size, sizeof(*table->items));
+		mask = table->size - 1;
+		for (size_t i = 0; i < old_size; i++)
+		{
+			if (old_items[i] == NULL)
+				continue;
+			size_t pos = old_items[i]->hash & mask;
+			while (table->items[pos])
+				pos = (pos + 1) & mask;
+			table->items[pos] = old_items[i];
+		}
+		free(old_items);
+	}
+
+	struct MPStack* stack = malloc(sizeof(struct MPStack) + depth * sizeof(*frames));
+	if (stack == NULL)
+	{
+		MP_UNLOCK(&table->lock);
+		return NULL;
+	}
+	stack->hash = hash;
+	stack->location = location;
+	stack->count = 0;
+	stack->live_count = 0;
+	stack->live_size = 0;
+	stack->total_size = 0;
+	stack->depth = depth;
+	memcpy(stack->frames, frames, depth * sizeof(*frames));
+
+	size_t pos = hash & mask;
+	while (table->items[pos])
+		pos = (pos + 1) & mask;
+	table->items[pos] = stack;
+	table->count++;
+	MP_UNLOCK(&table->lock);
+	return stack;
+}
+
+struct MPStack* mp_capture_stack(void* frame, struct MPAllocLocation* location)
+{
+	void* frames[MP_BACKTRACE_DEPTH];
+	uint32_t depth = mp_walk_stack(frame, frames);
+	size_t hash = mp_hash_ptr(location);
+	for (uint32_t i = 0; i < depth; i++)
+		hash = mp_hash_ptr((void*)(hash * 31 + (size_t)frames[i]));
+
+	size_t generation = MP_COUNTER_LOAD(mp_stack_generation);
+	if (mp_stack_cache.generation != generation)
+	{
+		memset(mp_stack_cache.items, 0, sizeof(mp_stack_cache.items));
+		mp_stack_cache.generation = generation;
+	}
+	struct MPStack** cached = &mp_stack_cache.items[hash & (MP_STACK_CACHE_LEN - 1)];
+	struct MPStack* stack = *cached;
+	if (stack == NULL || !mp_stack_equal(stack, hash, location, frames, depth))
+	{
+		stack = mp_intern_stack(hash, location, frames, depth);
+		*cached = stack;
+		if (stack == NULL)
+			return NULL;
+	}
+	MP_COUNTER_ADD(stack->count, 1);
+	return stack;
+}
+
+// Orders stacks by live bytes, biggest first
+int mp_stack_live_cmp(const void* a, const void* b)
+{
+	const struct MPStack* sa = *(const struct MPStack**)a;
+	const struct MPStack* sb = *(const struct MPStack**)b;
+	return (sa->live_size < sb->live_size) - (sa->live_size > sb->live_size);
+}
+
+// Orders stacks by count, biggest first
+int mp_stack_count_cmp(const void* a, const void* b)
+{
+	const struct MPStack* sa = *(const struct MPStack**)a;
+	const struct MPStack* sb = *(const struct MPStack**)b;
+	return (sa->count < sb->count) - (sa->count > sb->count);
+}
+
+void mp_print_frames(struct MPStack* stack)
+{
+	char msg[MP_MSG_LEN];
+	char** symbols = NULL;
+#ifdef __GLIBC__
+	symbols = backtrace_symbols(stack->frames, stack->depth);
+#endif
+	for (uint32_t i = 0; i < stack->depth; i++)
+	{
+		if (symbols)
+			snprintf(msg, sizeof msg, "    #%u %s", i, symbols[i]);
+		else
+			snprintf(msg, sizeof msg, "    #%u %p", i, stack->frames[i]);
+		MP_MESSAGE(msg);
+	}
+	free(symbols);
+}
+
+struct MPStack** mp_collect_stacks(size_t* count)
+{
+	size_t cap = 0;
+	struct MPStack** stacks = NULL;
+	*count = 0;
+	for (size_t s = 0; s < MP_SHARD_COUNT; s++)
+	{
+		struct MPStackTable* table = &mp_stacks[s];
+		MP_LOCK(&table->lock);
+		if (*count + table->count > cap)
+		{
+			cap = (*count + table->count) * 2;
+			stacks = realloc(stacks, cap * sizeof(*stacks));
+		}
+		for (size_t i = 0; i < table->size; i++)
+		{
+			if (table->items[i])
+				stacks[(*count)++] = table->items[i];
+		}
+		MP_UNLOCK(&table->lock);
+	}
+	return stacks;
+}
+
+void mp_print_stacks(int leaks)
+{
+	size_t count;
+	struct MPStack** sorted = mp_collect_stacks(&count);
+	if (leaks)
+	{
+		// Only keep the stacks with live blocks
+		size_t live = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			if (MP_COUNTER_LOAD(sorted[i]->live_count))
+				sorted[live++] = sorted[i];
+		}
+		count = live;
+	}
+	qsort(sorted, count, sizeof(*sorted), leaks ? mp_stack_live_cmp : mp_stack_count_cmp);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		struct MPStack* it = sorted[i];
+		char msg[MP_MSG_LEN];
+		if (leaks)
+			snprintf(msg, sizeof msg,
+					 "%zu memory blocks with a total size of %zu bytes allocated at %s:%u have not been freed. "
+					 "Blocks were allocated through",
+					 MP_COUNTER_LOAD(it->live_count), MP_COUNTER_LOAD(it->live_size), it->location->file,
+					 it->location->line);
+		else
+			snprintf(msg, sizeof msg, "Allocator at %s:%u made %zu allocations through", it->location->file,
+					 it->location->line, MP_COUNTER_LOAD(it->count));
+		MP_MESSAGE(msg);
+		mp_print_frames(it);
+	}
+	free(sorted);
+}
+
+void mp_release_stacks()
+{
+	for (size_t s = 0; s < MP_SHARD_COUNT; s++)
+	{
+		struct MPStackTable* table = &mp_stacks[s];
+		MP_LOCK(&table->lock);
+		for (size_t i = 0; i < table->size; i++)
+			free(table->items[i]);
+		free(table->items);
+		table->items = NULL;
+		table->size = 0;
+		table->count = 0;
+		MP_UNLOCK(&table->lock);
+	}
+	MP_COUNTER_ADD(mp_stack_generation, 1);
+}
+#endif
+
+// Scales the counts of sampled blocks to estimates of all blocks, like pprof does for heap_v2 profiles
+static inline void mp_profile_scale(size_t* count, size_t* size)
+{
+#ifdef MP_SAMPLE
+	if (*count == 0)
+		return;
+	// Probability of a block of the average size being sampled
+	double p = 1 - mp_exp_neg((double)*size / *count / MP_COUNTER_LOAD(mp_sample_interval));
+	*count = (size_t)(*count / p + 0.5);
+	*size = (size_t)(*size / p + 0.5);
+#else
+	(void)count;
+	(void)size;
+#endif
+}
+
+#ifdef MP_BACKTRACE
+// Writes the function name of a frame for a collapsed stack
+// Falls back to the module and offset, or the address, for frames without a name
+void mp_write_frame_name(FILE* file, const char* symbol, void* frame)
+{
+	// Symbols look like module(function+offset) [address]
+	const char* open = symbol ? strchr(symbol, '(') : NULL;
+	if (open == NULL)
+	{
+		fprintf(file, "%p", frame);
+		return;
+	}
+	size_t len = strcspn(open + 1, "+)");
+	if (len)
+	{
+		fprintf(file, "%.*s", (int)len, open + 1);
+		return;
+	}
+	const char* module = symbol;
+	for (const char* c = symbol; c < open; c++)
+	{
+		if (*c == '/')
+			module = c + 1;
+	}
+	fprintf(file, "%.*s%.*s", (int)(open - module), module, (int)strcspn(open + 1, ")"), open + 1);
+}
+#endif
+
+int mp_dump_heap_profile(const char* path, int format)
+{
+	FILE* file = fopen(path, "w");
+	if (file == NULL)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "Failed to open %s for writing heap profile", path);
+		MP_MESSAGE(msg);
+		return -1;
+	}
+
+#ifdef MP_THREAD_CACHE
+	// Allocations are counted to their location when published
+	mp_flush_all_caches(0);
+#endif
+	// Profiled sites are stacks with MP_BACKTRACE, otherwise locations
+#ifdef MP_BACKTRACE
+	size_t count;
+	struct MPStack** sites = mp_collect_stacks(&count);
+#else
+	MP_LOCK(&mp_locations_lock);
+	size_t count = 0;
+	struct MPAllocLocation** sites = malloc((mp_locations.count + 1) * sizeof(*sites));
+	for (size_t i = 0; i < mp_locations.size; i++)
+	{
+		if (mp_locations.items[i])
+			sites[count++] = mp_locations.items[i];
+	}
+#endif
+
+	if (format == MP_PROFILE_PPROF)
+	{
+		size_t live_count = 0, live_size = 0, total_count = 0, total_size = 0;
+		for (size_t i = 0; i < count; i++)
+		{
+			live_count += MP_COUNTER_LOAD(sites[i]->live_count);
+			live_size += MP_COUNTER_LOAD(sites[i]->live_size);
+			total_count += MP_COUNTER_LOAD(sites[i]->count);
+			total_size += MP_COUNTER_LOAD(sites[i]->total_size);
+		}
+#ifdef MP_SAMPLE
+		size_t rate = MP_COUNTER_LOAD(mp_sample_interval);
+#else
+		// A rate of 1 tells pprof that the counts are exact
+		size_t rate = 1;
+#endif
+		// pprof scales sampled counts itself
+		fprintf(file, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", live_count, live_size, total_count,
+				total_size, rate);
+		for (size_t i = 0; i < count; i++)
+		{
+			fprintf(file, "%zu: %zu [%zu: %zu] @", (size_t)MP_COUNTER_LOAD(sites[i]->live_count),
+					(size_t)MP_COUNTER_LOAD(sites[i]->live_size), (size_t)MP_COUNTER_LOAD(sites[i]->count),
+					(size_t)MP_COUNTER_LOAD(sites[i]->total_size));
+#ifdef MP_BACKTRACE
+			for (uint32_t j = 0; j < sites[i]->depth; j++)
+				fprintf(file, " %p", sites[i]->frames[j]);
+#else
+			fprintf(file, " %p", MP_COUNTER_LOAD(sites[i]->caller));
+#endif
+			fputc('\n', file);
+		}
+
+		// pprof finds the binaries to symbolize the addresses from the mappings
+		FILE* maps = fopen("/proc/self/maps", "r");
+		if (maps)
+		{
+			fputs("\nMAPPED_LIBRARIES:\n", file);
+			char buf[4096];
+			size_t len;
+			while ((len = fread(buf, 1, sizeof buf, maps)))
+				fwrite(buf, 1, len, file);
+			fclose(maps);
+		}
+	}
+	else
+	{
+		// One line per site of its frames from the outermost to file:line followed by the bytes
+		for (size_t i = 0; i < count; i++)
+		{
+			size_t blocks = MP_COUNTER_LOAD(sites[i]->live_count);
+			size_t size = MP_COUNTER_LOAD(sites[i]->live_size);
+			if (format == MP_PROFILE_COLLAPSED_TOTAL)
+			{
+				blocks = MP_COUNTER_LOAD(sites[i]->count);
+				size = MP_COUNTER_LOAD(sites[i]->total_size);
+			}
+			mp_profile_scale(&blocks, &size);
+			if (size == 0)
+				continue;
+#ifdef MP_BACKTRACE
+			char** symbols = NULL;
+#ifdef __GLIBC__
+			symbols = backtrace_symbols(sites[i]->frames, sites[i]->depth);
+#endif
+			for (uint32_t j = sites[i]->depth; j > 0; j--)
+			{
+				mp_write_frame_name(file, symbols ? symbols[j - 1] : NULL, sites[i]->frames[j - 1]);
+				fputc(';', file);
+			}
+			free(symbols);
+			fprintf(file, "%s:%u %zu\n", sites[i]->location->file, sites[i]->location->line, size);
+#else
+			fprintf(file, "%s:%u %zu\n", sites[i]->file, sites[i]->line, size);
+#endif
+		}
+	}
+
+#ifndef MP_BACKTRACE
+	MP_UNLOCK(&mp_locations_lock);
+#endif
+	free(sites);
+	if (fclose(file) != 0)
+	{
+		char msg[MP_MSG_LEN];
+		snprintf(msg, sizeof msg, "Failed to write heap profile to %s", path);
+		MP_MESSAGE(msg);
+		return -1;
+	}
+	return 0;
+}
+
+#ifdef MP_SEPARATE_META
+struct MemBlock* mp_block_alloc(struct MPHashTable* table)
+{
+	struct MemBlock* block = table->free_blocks;
+	if (block)
+	{
+		table->free_blocks = block->next_free;
+		return block;
+	}
+	if (table->slabs == NULL || table->slabs->used == MP_SLAB_LEN)
+	{
+		struct MPSlab* slab = malloc(sizeof(struct MPSlab));
+		slab->used = 0;
+		slab->next = table->slabs;
+		table->slabs = slab;
+	}
+	return &table->slabs->blocks[table->slabs->used++];
+}
+
+void mp_block_release(struct MPHashTable* table, struct MemBlock* block)
+{
+	block->bytes = NULL;
+	block->next_free = table->free_blocks;
+	table->free_blocks = block;
+}
+#endif
+
+void mp_track(struct MemBlock* block)
+{
+	struct MPHashTable* table = mp_get_shard(mp_hash_ptr(block->bytes));
+	MP_LOCK(&table->lock);
+#ifdef MP_SEPARATE_META
+	struct MemBlock* record = mp_block_alloc(table);
+	*record = *block;
+	block = record;
+#endif
+	mp_insert(table, block);
+	MP_UNLOCK(&table->lock);
+}
+
+struct MemBlock* mp_untrack(void* ptr, struct MemBlock* storage)
+{
+	struct MPHashTable* table = mp_get_shard(mp_hash_ptr(ptr));
+	MP_LOCK(&table->lock);
+	struct MemBlock* record = mp_remove(table, ptr);
+	struct MemBlock* block = mp_block_copy(record, storage);
+#ifdef MP_SEPARATE_META
+	if (record)
+		mp_block_release(table, record);
+#endif
+	MP_UNLOCK(&table->lock);
+	return block;
+}
+
+#ifdef MP_THREAD_CACHE
+static inline void mp_cache_lock(struct MPThreadCache* cache)
+{
+	while (__atomic_exchange_n(&cache->busy, 1, __ATOMIC_ACQUIRE))
+		;
+}
+
+static inline void mp_cache_unlock(struct MPThreadCache* cache)
+{
+	__atomic_store_n(&cache->busy, 0, __ATOMIC_RELEASE);
+}
+
+// Publishes and releases the cache of an exiting thread
+void mp_thread_cache_destroy(void* data)
+{
+	struct MPThreadCache* cache = data;
+	// The list lock is taken before the cache like in mp_flush_all_caches
+	// Unlinking and publishing under both keeps the pending blocks visible to other threads until they are tracked
+	MP_LOCK(&mp_thread_caches_lock);
+	if (cache->prev)
+		cache->prev->next = cache->next;
+	else
+		mp_thread_caches = cache->next;
+	if (cache->next)
+		cache->next->prev = cache->prev;
+	mp_cache_lock(cache);
+	mp_flush_cache(cache, 1);
+	MP_UNLOCK(&mp_thread_caches_lock);
+
+	if (mp_thread_cache == cache)
+		mp_thread_cache = NULL;
+	free(cache);
 }
 
-size_t mp_terminate()
+void mp_thread_cache_init()
 {
-	MP_MESSAGE("Failed to fetch remaining blocks since magpie is disabled in build");
-	return 0;
+	pthread_key_create(&mp_thread_cache_key, mp_thread_cache_destroy);
 }
 
-int mp_validate_internal(void* ptr, const char* file, uint32_t line)
+struct MPThreadCache* mp_get_thread_cache()
 {
-	MP_MESSAGE("Failed to validate pointer since magpie is disabled in build");
-	return MP_VALIDATE_OK;
+	if (mp_thread_cache)
+		return mp_thread_cache;
+
+	pthread_once(&mp_thread_cache_once, mp_thread_cache_init);
+	struct MPThreadCache* cache = calloc(1, sizeof(struct MPThreadCache));
+	MP_LOCK(&mp_thread_caches_lock);
+	cache->next = mp_thread_caches;
+	if (mp_thread_caches)
+		mp_thread_caches->prev = cache;
+	mp_thread_caches = cache;
+	MP_UNLOCK(&mp_thread_caches_lock);
+
+	pthread_setspecific(mp_thread_cache_key, cache);
+	mp_thread_cache = cache;
+	return cache;
 }
 
-void* mp_malloc_internal(size_t size, const char* file, uint32_t line)
+void mp_flush_cache(struct MPThreadCache* cache, int flush_counters)
 {
-	void* ptr = malloc(size);
-	if (ptr == NULL)
+	for (size_t i = 0; i < cache->pending_count; i++)
 	{
-		char msg[MP_MSG_LEN];
-		snprintf(msg, sizeof msg, "%s:%d Failed to allocate memory for %zu bytes", file, line, size);
-		MP_MESSAGE(msg);
-		return NULL;
+		struct MPPendingBlock* pending = &cache->pending[i];
+		uint32_t count = 0;
+		if (pending->location)
+			count = mp_count_location(pending->location);
+		if (pending->ptr)
+		{
+			if (pending->location)
+				pending->block->count = count;
+			mp_track(pending->block);
+		}
 	}
-	mp_total_alloc_count++;
-	mp_total_alloc_size += size;
-	mp_alloc_count++;
-	return ptr;
-}
+	cache->pending_count = 0;
+	// Released after the blocks are tracked, a thread seeing the cleared filter finds them in the hashtable
+	for (size_t i = 0; i < MP_PENDING_FILTER_BITS / 64; i++)
+		__atomic_store_n(&cache->filter[i], 0, __ATOMIC_RELEASE);
 
-void* mp_calloc_internal(size_t num, size_t size, const char* file, uint32_t line)
-{
-	void* ptr = calloc(num, size);
-	if (ptr == NULL)
+	if (flush_counters)
 	{
-		char msg[MP_MSG_LEN];
-		snprintf(msg, sizeof msg, "%s:%d Failed to allocate memory for %zu bytes", file, line, size);
-		MP_MESSAGE(msg);
-		return NULL;
+		MP_COUNTER_ADD(mp_total_alloc_count, cache->total_alloc_count);
+		MP_COUNTER_ADD(mp_total_alloc_size, cache->total_alloc_size);
+		MP_COUNTER_ADD(mp_alloc_count, cache->alloc_count);
+		MP_COUNTER_ADD(mp_alloc_size, cache->alloc_size);
+		// Only sees the deltas published so far
+		mp_raise_peak(&mp_peak_alloc_count, MP_COUNTER_LOAD(mp_alloc_count));
+		mp_raise_peak(&mp_peak_alloc_size, MP_COUNTER_LOAD(mp_alloc_size));
+		__atomic_store_n(&cache->total_alloc_count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&cache->total_alloc_size, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&cache->alloc_count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&cache->alloc_size, 0, __ATOMIC_RELAXED);
 	}
-	mp_total_alloc_count++;
-	mp_total_alloc_size += num * size;
-	mp_alloc_count++;
-	return ptr;
 }
 
-void* mp_realloc_internal(void* ptr, size_t size, const char* file, uint32_t line);
-
-void mp_free_internal(void* ptr, const char* file, uint32_t line)
+void mp_flush_all_caches(int flush_counters)
 {
-#ifdef MP_WARN_NULL
-	if (ptr == NULL)
+	MP_LOCK(&mp_thread_caches_lock);
+	for (struct MPThreadCache* it = mp_thread_caches; it; it = it->next)
 	{
-		char msg[MP_MSG_LEN];
-		snprintf(msg, sizeof msg, "%s:%u Freeing NULL pointer", file, line);
-		MP_MESSAGE(msg);
-		return;
+		mp_cache_lock(it);
+		mp_flush_cache(it, flush_counters);
+		mp_cache_unlock(it);
 	}
-#endif
-	mp_alloc_count--;
-	free(ptr);
+	MP_UNLOCK(&mp_thread_caches_lock);
 }
 
-#else
-void mp_print_locations()
+void mp_flush_caches_holding(void* ptr)
 {
-	struct MPAllocLocation* it = mp_locations;
-	while (it)
+	size_t bit = mp_hash_ptr(ptr) & (MP_PENDING_FILTER_BITS - 1);
+	uint64_t mask = (uint64_t)1 << (bit % 64);
+	MP_LOCK(&mp_thread_caches_lock);
+	for (struct MPThreadCache* it = mp_thread_caches; it; it = it->next)
 	{
-		char msg[MP_MSG_LEN];
-		snprintf(msg, sizeof msg, "Allocator at %s:%u made %u allocations", it->file, it->line, it->count);
-		MP_MESSAGE(msg);
-		it = it->next;
+		if ((__atomic_load_n(&it->filter[bit / 64], __ATOMIC_ACQUIRE) & mask) == 0)
+			continue;
+		mp_cache_lock(it);
+		mp_flush_cache(it, 0);
+		mp_cache_unlock(it);
 	}
+	MP_UNLOCK(&mp_thread_caches_lock);
 }
 
-size_t mp_terminate()
+size_t mp_cache_stat_sum(size_t counter, size_t offset)
 {
-	char msg[MP_MSG_LEN];
-	size_t remaining_blocks = 0;
-
-	// Free remaining blocks
-	for (size_t i = 0; i < mp_hashtable.size; i++)
-	{
-		struct MemBlock* it = mp_hashtable.items[i];
-		struct MemBlock* next = NULL;
-		while (it)
-		{
-			remaining_blocks++;
-			next = it->next;
-			snprintf(msg, sizeof msg,
-					 "Memory block allocated at %s:%u with a size of %zu bytes has not been freed. Block was "
-					 "allocation num %u",
-					 it->file, it->line, it->size, it->count);
-			MP_MESSAGE(msg);
-			// Validate directly
-			// Check integrity of buffer padding to detect overflows/overruns
-			size_t i = 0;
-			char* p = it->bytes + it->size;
-			for (i = 0; i < MP_BUFFER_PAD_LEN; i++, p++)
-			{
-				if (*p != MP_BUFFER_PAD_VAL)
-				{
-					char msg[MP_MSG_LEN];
-					snprintf(msg, sizeof msg, "Buffer overflow after %zu bytes on pointer %p allocated at %s:%u",
-							 it->size, it->bytes, it->file, it->line);
-					MP_MESSAGE(msg);
-					return MP_VALIDATE_OVERFLOW;
-				}
-			}
-			//free(it);
-			it = next;
-		}
-	}
-	snprintf(msg, sizeof msg, "A total of %zu memory blocks remain to be freed after program execution",
-			 remaining_blocks);
-	MP_MESSAGE(msg);
-	if (mp_hashtable.items)
-	{
-		free(mp_hashtable.items);
-		mp_hashtable.items = NULL;
-		mp_hashtable.count = 0;
-		mp_hashtable.size = 0;
-	}
-
-	// Free the location list
-	struct MPAllocLocation* it = mp_locations;
-	struct MPAllocLocation* next = NULL;
-	while (it)
+	MP_LOCK(&mp_thread_caches_lock);
+	for (struct MPThreadCache* it = mp_thread_caches; it; it = it->next)
 	{
-		next = it->next;
-		free(it);
-		it = next;
+		counter += __atomic_load_n((size_t*)((char*)it + offset), __ATOMIC_RELAXED);
 	}
-	mp_locations = NULL;
-	return remaining_blocks;
+	MP_UNLOCK(&mp_thread_caches_lock);
+	return counter;
 }
+#endif
 
-int mp_validate_internal(void* ptr, const char* file, uint32_t line)
+void mp_publish(struct MemBlock* block, struct MPAllocLocation* location)
 {
-	struct MemBlock* block = mp_search(ptr);
-	if (block == NULL)
+#ifdef MP_DEFER_PUBLISH
+	struct MPThreadCache* cache = mp_get_thread_cache();
+	mp_cache_lock(cache);
+	if (cache->pending_count == MP_THREAD_CACHE_LEN)
 	{
-		char msg[MP_MSG_LEN];
-		snprintf(msg, sizeof msg, "%s:%u Validation of invalid or already freed pointer with adress %p", file, line,
-				 ptr);
-		MP_MESSAGE(msg);
-		return MP_VALIDATE_INVALID;
+		mp_flush_cache(cache, 1);
 	}
-#ifdef MP_CHECK_OVERFLOW
-	// Check integrity of buffer padding to detect overflows/overruns
-	size_t i = 0;
-	char* p = block->bytes + block->size;
-	for (i = 0; i < MP_BUFFER_PAD_LEN; i++, p++)
+	struct MPPendingBlock* pending = &cache->pending[cache->pending_count++];
+	pending->ptr = block->bytes;
+#ifdef MP_SEPARATE_META
+	pending->meta = *block;
+	block = &pending->meta;
+#endif
+	pending->block = block;
+	pending->location = location;
+	size_t bit = mp_hash_ptr(pending->ptr) & (MP_PENDING_FILTER_BITS - 1);
+	__atomic_fetch_or(&cache->filter[bit / 64], (uint64_t)1 << (bit % 64), __ATOMIC_RELAXED);
+	mp_cache_unlock(cache);
+#else
+	if (location)
 	{
-		if (*p != MP_BUFFER_PAD_VAL)
-		{
-			char msg[MP_MSG_LEN];
-			snprintf(msg, sizeof msg, "Buffer overflow after %zu bytes on pointer %p allocated at %s:%u", block->size,
-					 ptr, block->file, block->line);
-			MP_MESSAGE(msg);
-			return MP_VALIDATE_OVERFLOW;
-		}
+		block->count = mp_count_location(location);
 	}
+	mp_track(block);
 #endif
-	return MP_VALIDATE_OK;
 }
 
-void* mp_malloc_internal(size_t size, const char* file, uint32_t line)
+struct MemBlock* mp_take(void* ptr, struct MemBlock* storage)
 {
-	// Allocate size for the block info and the buffer requested
-	struct MemBlock* new_block = malloc(sizeof(struct MemBlock) + size - 1 + MP_BUFFER_PAD_LEN);
-
-// Fill the padding with MP_BUFFER_PAD_VAL
-#ifdef MP_CHECK_OVERFLOW
-	memset(new_block->bytes + size, MP_BUFFER_PAD_VAL, MP_BUFFER_PAD_LEN);
-#endif
-
-	// Allocate request
-	if (new_block == NULL)
+#ifdef MP_DEFER_PUBLISH
+	// Cancel a recent allocation from the same thread
+	// The location is still counted when the cache is published
+	struct MPThreadCache* cache = mp_get_thread_cache();
+	mp_cache_lock(cache);
+	for (size_t i = cache->pending_count; i > 0; i--)
 	{
-		char msg[MP_MSG_LEN];
-		snprintf(msg, sizeof msg, "%s:%d Failed to allocate memory for %zu bytes", file, line, size);
-		MP_MESSAGE(msg);
-		return NULL;
+		struct MPPendingBlock* pending = &cache->pending[i - 1];
+		if (pending->ptr == ptr)
+		{
+			pending->ptr = NULL;
+			struct MemBlock* block = mp_block_copy(pending->block, storage);
+			mp_cache_unlock(cache);
+			return block;
+		}
 	}
-	mp_total_alloc_count++;
-	mp_total_alloc_size += size;
-	mp_alloc_count++;
-	mp_alloc_size += size;
-	new_block->size = size;
-	new_block->file = file;
-	new_block->line = line;
-	new_block->next = NULL;
-
-	// Insert
-	mp_insert(new_block, file, line);
-
-	return new_block->bytes;
-}
-void* mp_calloc_internal(size_t num, size_t size, const char* file, uint32_t line)
-{
-	// Allocate size for the block info and the buffer requested
-	struct MemBlock* new_block = calloc(1, sizeof(struct MemBlock) + num * size - 1 + MP_BUFFER_PAD_LEN);
-
-	// Fill the padding with MP_BUFFER_PAD_VAL
-#ifdef MP_CHECK_OVERFLOW
-	memset(new_block->bytes + num * size, MP_BUFFER_PAD_VAL, MP_BUFFER_PAD_LEN);
-#endif
-
-	// Allocate request
+	mp_cache_unlock(cache);
 
-	if (new_block == NULL)
+	struct MemBlock* block = mp_untrack(ptr, storage);
+	// The block may still be pending in the cache of another thread, or have been published since the lookup
+	// Only the caches which may hold it are published, foreign and invalid pointers cost one more lookup
+	if (block == NULL)
 	{
-		char msg[MP_MSG_LEN];
-		snprintf(msg, sizeof msg, "%s:%u Failed to allocate memory for %zu bytes", file, line, size * num);
-		MP_MESSAGE(msg);
-		return NULL;
+		mp_flush_caches_holding(ptr);
+		block = mp_untrack(ptr, storage);
 	}
-	mp_total_alloc_count++;
-	mp_total_alloc_size += num * size;
-	mp_alloc_count++;
-	mp_alloc_size += num * size;
-	new_block->size = num * size;
-	new_block->file = file;
-	new_block->line = line;
-	new_block->next = NULL;
-	// Insert
-	mp_insert(new_block, file, line);
-
-	return new_block->bytes;
+	return block;
+#else
+	return mp_untrack(ptr, storage);
+#endif
 }
-void* mp_realloc_internal(void* ptr, size_t size, const char* file, uint32_t line)
-{
-	// Allocate if ptr is NULL
-	if (ptr == NULL)
-		return mp_malloc_internal(size, file, line);
 
-	// Free if size is 0
-	if (ptr && size == 0)
+struct MemBlock* mp_find(void* ptr, struct MemBlock* storage)
+{
+#ifdef MP_DEFER_PUBLISH
+	struct MPThreadCache* cache = mp_get_thread_cache();
+	mp_cache_lock(cache);
+	for (size_t i = cache->pending_count; i > 0; i--)
 	{
-		mp_free_internal(ptr, file, line);
-		return NULL;
+		struct MPPendingBlock* pending = &cache->pending[i - 1];
+		if (pending->ptr == ptr)
+		{
+			struct MemBlock* block = mp_block_copy(pending->block, storage);
+			mp_cache_unlock(cache);
+			return block;
+		}
 	}
-	struct MemBlock* block = mp_remove(ptr);
+	mp_cache_unlock(cache);
+#endif
+	struct MPHashTable* table = mp_get_shard(mp_hash_ptr(ptr));
+	MP_LOCK(&table->lock);
+	struct MemBlock* block = mp_block_copy(mp_search(table, ptr), storage);
+	MP_UNLOCK(&table->lock);
+#ifdef MP_DEFER_PUBLISH
 	if (block == NULL)
 	{
-		char msg[MP_MSG_LEN];
-		snprintf(msg, sizeof msg, "%s:%u Reallocating invalid or already freed pointer with adress %p", file, line,
-				 ptr);
-		MP_MESSAGE(msg);
-		return NULL;
+		mp_flush_caches_holding(ptr);
+		MP_LOCK(&table->lock);
+		block = mp_block_copy(mp_search(table, ptr), storage);
+		MP_UNLOCK(&table->lock);
 	}
-	mp_total_alloc_size -= block->size;
-	mp_alloc_size -= block->size;
-	struct MemBlock* new_block = realloc(block, sizeof(struct MemBlock) + size - 1 + MP_BUFFER_PAD_LEN);
-	if (new_block == NULL)
-	{
+#endif
+	return block;
+}
 
-		char msg[MP_MSG_LEN];
-		snprintf(msg, sizeof msg, "%s:%u Failed to reallocate memory from %zu to %zu bytes", file, line, block->size,
-				 size);
-		MP_MESSAGE(msg);
-		return NULL;
+void mp_walk_blocks(void (*callback)(struct MemBlock* block, void* data), void* data)
+{
+	for (size_t s = 0; s < MP_SHARD_COUNT; s++)
+	{
+		struct MPHashTable* table = &mp_hashtable[s];
+		MP_LOCK(&table->lock);
+		mp_walk_shard(table, 0, SIZE_MAX, callback, data);
+		MP_UNLOCK(&table->lock);
 	}
-	mp_insert(new_block, file, line);
-	mp_total_alloc_size += size;
-	new_block->size = size;
-	mp_alloc_size += size;
-#ifdef MP_CHECK_OVERFLOW
-	memset(new_block->bytes + size, MP_BUFFER_PAD_VAL, MP_BUFFER_PAD_LEN);
-#endif
-	return new_block->bytes;
 }
 
-void mp_free_internal(void* ptr, const char* file, uint32_t line)
+size_t mp_walk_shard(struct MPHashTable* table, size_t first, size_t count,
+					 void (*callback)(struct MemBlock* block, void* data), void* data)
 {
-#ifndef MP_WARN_NULL
-	if (ptr == NULL)
+	size_t end = count > SIZE_MAX - first ? SIZE_MAX : first + count;
+#ifdef MP_SEPARATE_META
+	// Walk the records sequentially instead of through the index
+	size_t pos = 0;
+	for (struct MPSlab* slab = table->slabs; slab; slab = slab->next)
 	{
-		return;
+		for (size_t i = first > pos ? first - pos : 0; i < slab->used; i++)
+		{
+			if (pos + i == end)
+				return end;
+			if (slab->blocks[i].bytes)
+				callback(&slab->blocks[i], data);
+		}
+		pos += slab->used;
 	}
-#endif
-	struct MemBlock* block = mp_remove(ptr);
-	if (block == NULL)
+#else
+	for (size_t i = first; i < table->size + table->old_size; i++)
 	{
-		char msg[MP_MSG_LEN];
-		snprintf(msg, sizeof msg, "%s:%u Freeing invalid or already freed pointer with adress %p", file, line, ptr);
-		MP_MESSAGE(msg);
-		return;
+		if (i == end)
+			return end;
+		// Entries not yet migrated by a resize in progress follow the index
+		struct MPIndexEntry* entry = i < table->size ? &table->items[i] : &table->old_items[i - table->size];
+		if (entry->ptr && entry->ptr != MP_INDEX_TOMBSTONE)
+			callback(entry->block, data);
 	}
-	mp_alloc_count--;
-	mp_alloc_size -= block->size;
+#endif
+	return SIZE_MAX;
+}
 
-#ifdef MP_CHECK_OVERFLOW
-	// Check integrity of buffer padding to detect overflows/overruns
-	size_t i = 0;
-	char* p = block->bytes + block->size;
-	for (i = 0; i < MP_BUFFER_PAD_LEN; i++, p++)
+// Returns how far the slot at pos is from where its pointer hashes to
+static inline size_t mp_probe_distance(struct MPIndexEntry* items, size_t size, size_t pos)
+{
+	return (pos - mp_hash_ptr(items[pos].ptr)) & (size - 1);
+}
+
+// Inserts entry into items with robin hood probing
+// Does not check the load
+void mp_index_insert(struct MPIndexEntry* items, size_t size, struct MPIndexEntry entry)
+{
+	size_t mask = size - 1;
+	size_t pos = mp_hash_ptr(entry.ptr) & mask;
+	size_t dist = 0;
+	while (items[pos].ptr)
 	{
-		if (*p != MP_BUFFER_PAD_VAL)
+		// Take the slot from entries that are closer to their home slot
+		size_t slot_dist = mp_probe_distance(items, size, pos);
+		if (slot_dist < dist)
 		{
-			char msg[MP_MSG_LEN];
-			snprintf(msg, sizeof msg, "Buffer overflow after %zu bytes on pointer %p allocated at %s:%u", block->size,
-					 ptr, block->file, block->line);
-			MP_MESSAGE(msg);
-			break;
+			struct MPIndexEntry tmp = items[pos];
+			items[pos] = entry;
+			entry = tmp;
+			dist = slot_dist;
 		}
+		pos = (pos + 1) & mask;
+		dist++;
 	}
-#endif
-#ifdef MP_FILL_ON_FREE
-	memset(block->bytes, MP_BUFFER_PAD_VAL, block->size);
-#endif
-	free(block);
+	items[pos] = entry;
 }
 
-void mp_insert(struct MemBlock* block, const char* file, uint32_t line)
+void mp_insert(struct MPHashTable* table, struct MemBlock* block)
 {
-	block->next = NULL;
-	// Hash the pointer
-	if (mp_hashtable.size == 0)
+	if (table->size == 0)
 	{
-		mp_hashtable.size = 16;
-		mp_hashtable.items = calloc(mp_hashtable.size, sizeof(*mp_hashtable.items));
+		table->size = MP_INDEX_MIN_SIZE;
+		table->items = calloc(table->size, sizeof(*table->items));
 	}
-	if (mp_hashtable.count + 1 >= mp_hashtable.size * 0.7)
+	if (table->old_items)
 	{
-		mp_resize(1);
+		mp_migrate(table, MP_RESIZE_STEP);
 	}
+	if (table->count + 1 >= table->size * MP_INDEX_GROW_LOAD)
 	{
-		// Takes the hash of the bytes pointer of the block
-		size_t hash = mp_hash_ptr(block->bytes);
-		struct MemBlock* it = mp_hashtable.items[hash];
+		mp_resize(table, 1);
+	}
 
-		if (it == NULL)
-		{
-			mp_hashtable.items[hash] = block;
-			mp_hashtable.count++;
-		}
+	struct MPIndexEntry entry = {block->bytes, block};
+	mp_index_insert(table->items, table->size, entry);
+	table->count++;
+}
 
-		// Chain if hash collision
-		else
+static inline size_t mp_hash_location(const char* file, uint32_t line)
+{
+	return mp_hash_ptr((void*)((size_t)file * 31 + line));
+}
+
+void mp_add_location(struct MPAllocLocation* location)
+{
+	if (mp_locations.count + 1 >= mp_locations.size * 0.7)
+	{
+		// Rehash into a table of double size
+		size_t old_size = mp_locations.size;
+		struct MPAllocLocation** old_items = mp_locations.items;
+		mp_locations.size = old_size ? old_size * 2 : 64;
+		mp_locations.items = calloc(mp_locations.size, sizeof(*mp_locations.items));
+		for (size_t i = 0; i < old_size; i++)
 		{
-			while (it->next)
-			{
-				it = it->next;
-			}
-			it->next = block;
+			struct MPAllocLocation* it = old_items[i];
+			if (it == NULL)
+				continue;
+			size_t pos = mp_hash_location(it->file, it->line) & (mp_locations.size - 1);
+			while (mp_locations.items[pos])
+				pos = (pos + 1) & (mp_locations.size - 1);
+			mp_locations.items[pos] = it;
 		}
+		free(old_items);
 	}
-	// Items are being reinserted
-	if (file == NULL)
-	{
-		return;
-	}
-	// Location
-	if (mp_locations == NULL)
+
+	size_t mask = mp_locations.size - 1;
+	size_t pos = mp_hash_location(location->file, location->line) & mask;
+	while (mp_locations.items[pos])
+		pos = (pos + 1) & mask;
+	mp_locations.items[pos] = location;
+	mp_locations.count++;
+	location->id = ++mp_location_ids;
+#ifdef MP_GUARD_PAGES
+	MP_COUNTER_STORE(location->guard, mp_guard_site_match(location));
+#endif
+}
+
+void mp_register_location(struct MPAllocLocation* location)
+{
+	MP_LOCK(&mp_locations_lock);
+	// Another thread may have registered it while waiting for the lock
+	if (location->registered == 0)
 	{
-		mp_locations = malloc(sizeof(struct MPAllocLocation));
-		mp_locations->count = 0;
-		mp_locations->file = file;
-		mp_locations->line = line;
-		mp_locations->prev = NULL;
-		mp_locations->next = NULL;
-		block->count = mp_locations->count++;
-		return;
+		mp_add_location(location);
+		MP_COUNTER_ADD(location->registered, MP_LOCATION_STATIC);
 	}
-	struct MPAllocLocation* it = mp_locations;
-	while (it)
-	{
+	MP_UNLOCK(&mp_locations_lock);
+}
 
-		if (it->file == file && it->line == line)
+struct MPAllocLocation* mp_location_internal(const char* file, uint32_t line)
+{
+	MP_LOCK(&mp_locations_lock);
+	if (mp_locations.size)
+	{
+		size_t mask = mp_locations.size - 1;
+		size_t pos = mp_hash_location(file, line) & mask;
+		struct MPAllocLocation* it;
+		while ((it = mp_locations.items[pos]))
 		{
-			block->count = it->count++;
-
-			// Make sure it is always sorted by biggest on head
-			while (it->prev && it->prev->count < it->count)
+			if (it->file == file && it->line == line)
 			{
-				struct MPAllocLocation* prev = it->prev;
-				// Head is changing
-				if (prev->prev == NULL)
-				{
-					mp_locations->prev = it;
-					mp_locations->next = it->next;
-					if (it->next)
-						it->next->prev = mp_locations;
-					it->next = mp_locations;
-					mp_locations = it;
-					it->prev = NULL;
-					break;
-				}
-				prev->next = it->next;
-				it->prev = prev->prev;
-				prev->prev->next = it;
-				prev->prev = it;
-
-				it->next = prev;
+				MP_UNLOCK(&mp_locations_lock);
+				return it;
 			}
-			return;
-		}
-		// At end
-		if (it->next == NULL)
-		{
-			struct MPAllocLocation* new_location = malloc(sizeof(struct MPAllocLocation));
-			new_location->count = 0;
-			new_location->file = file;
-			new_location->line = line;
-			new_location->prev = it;
-			new_location->next = NULL;
-			it->next = new_location;
-			block->count = new_location->count++;
-
-			return;
+			pos = (pos + 1) & mask;
 		}
-		it = it->next;
 	}
+
+	struct MPAllocLocation* location = calloc(1, sizeof(struct MPAllocLocation));
+	location->file = file;
+	location->line = line;
+	location->registered = MP_LOCATION_DYNAMIC;
+	mp_add_location(location);
+	MP_UNLOCK(&mp_locations_lock);
+	return location;
 }
 
-void mp_resize(int direction)
+void mp_resize(struct MPHashTable* table, int direction)
 {
-	size_t old_size = mp_hashtable.size;
+	// Only one resize can be in progress
+	if (table->old_items)
+		mp_migrate(table, SIZE_MAX);
+
+	size_t new_size = table->size;
 	if (direction == 1)
-		mp_hashtable.size *= 2;
+		new_size *= 2;
 	else if (direction == -1)
-		mp_hashtable.size /= 2;
+		new_size /= 2;
 	else
 		return;
 
-	struct MemBlock** old_items = mp_hashtable.items;
-	mp_hashtable.items = calloc(mp_hashtable.size, sizeof(struct MemBlock*));
+	table->old_items = table->items;
+	table->old_size = table->size;
+	table->migrate_pos = 0;
+	table->items = calloc(new_size, sizeof(struct MPIndexEntry));
+	table->size = new_size;
+}
 
-	// Count will be reincreased when reinserting items
-	mp_hashtable.count = 0;
-	// Rehash and insert
-	for (size_t i = 0; i < old_size; i++)
+void mp_migrate(struct MPHashTable* table, size_t steps)
+{
+	while (steps-- && table->migrate_pos < table->old_size)
 	{
-		struct MemBlock* it = old_items[i];
-		// Save the next since it will be cleared in the iterator when inserting
-		struct MemBlock* next = NULL;
-		while (it)
-		{
-			next = it->next;
-			mp_insert(it, NULL, 0);
-			it = next;
-		}
+		struct MPIndexEntry* slot = &table->old_items[table->migrate_pos++];
+		if (slot->ptr == NULL || slot->ptr == MP_INDEX_TOMBSTONE)
+			continue;
+		mp_index_insert(table->items, table->size, *slot);
+		// Keep probe sequences through this slot intact
+		slot->ptr = MP_INDEX_TOMBSTONE;
+	}
+
+	if (table->migrate_pos == table->old_size)
+	{
+		free(table->old_items);
+		table->old_items = NULL;
+		table->old_size = 0;
+		table->migrate_pos = 0;
 	}
-	free(old_items);
 }
 
-struct MemBlock* mp_search(void* ptr)
+size_t mp_probe(struct MPIndexEntry* items, size_t size, void* ptr)
 {
-	size_t hash = mp_hash_ptr(ptr);
-	struct MemBlock* it = mp_hashtable.items[hash];
+	if (size == 0)
+		return SIZE_MAX;
+	size_t mask = size - 1;
+	size_t pos = mp_hash_ptr(ptr) & mask;
+	size_t dist = 0;
+	while (items[pos].ptr)
+	{
+		if (items[pos].ptr == ptr)
+			return pos;
+		// Would have been placed here if it existed
+		// Tombstones only occur in old tables and say nothing about placement
+		if (items[pos].ptr != MP_INDEX_TOMBSTONE && mp_probe_distance(items, size, pos) < dist)
+			return SIZE_MAX;
+		pos = (pos + 1) & mask;
+		dist++;
+	}
+	return SIZE_MAX;
+}
 
-	// Search chain for the correct pointer
-	while (it)
+struct MemBlock* mp_search(struct MPHashTable* table, void* ptr)
+{
+	size_t pos = mp_probe(table->items, table->size, ptr);
+	if (pos != SIZE_MAX)
+		return table->items[pos].block;
+	if (table->old_items)
 	{
-		if (it->bytes == ptr)
-		{
-			return it;
-		}
-		it = it->next;
+		pos = mp_probe(table->old_items, table->old_size, ptr);
+		if (pos != SIZE_MAX)
+			return table->old_items[pos].block;
 	}
 	return NULL;
 }
 
-struct MemBlock* mp_remove(void* ptr)
+struct MemBlock* mp_remove(struct MPHashTable* table, void* ptr)
 {
-	size_t hash = mp_hash_ptr(ptr);
-	struct MemBlock* it = mp_hashtable.items[hash];
-	struct MemBlock* prev = NULL;
-
-	// Search chain for the correct pointer
-	while (it)
+	struct MemBlock* block = NULL;
+	size_t pos = mp_probe(table->items, table->size, ptr);
+	if (pos != SIZE_MAX)
 	{
-		if (it->bytes == ptr)
-		{
-			// Bucket gets removed, no more left in chain
-			if (it->next == NULL)
-				mp_hashtable.count--;
-			if (prev) // Has a parent remove and reconnect chain
-			{
-				prev->next = it->next;
-			}
-			else // First one one chain, change head
-			{
-				mp_hashtable.items[hash] = it->next;
-			}
+		block = table->items[pos].block;
 
-			// Check for resize down
-			if (mp_hashtable.count - 1 <= mp_hashtable.size * 0.4)
-			{
-				mp_resize(-1);
-			}
-
-			return it;
+		// Shift following entries back until one is in its home slot
+		size_t mask = table->size - 1;
+		size_t next = (pos + 1) & mask;
+		while (table->items[next].ptr && mp_probe_distance(table->items, table->size, next) != 0)
+		{
+			table->items[pos] = table->items[next];
+			pos = next;
+			next = (next + 1) & mask;
 		}
-		prev = it;
-		it = it->next;
+		table->items[pos].ptr = NULL;
+		table->items[pos].block = NULL;
 	}
-	return NULL;
+	else if (table->old_items && (pos = mp_probe(table->old_items, table->old_size, ptr)) != SIZE_MAX)
+	{
+		block = table->old_items[pos].block;
+		table->old_items[pos].ptr = MP_INDEX_TOMBSTONE;
+	}
+	else
+	{
+		return NULL;
+	}
+	table->count--;
+
+	if (table->old_items)
+	{
+		mp_migrate(table, MP_RESIZE_STEP);
+	}
+	// Check for resize down
+	// Far enough below the grow load to not resize back and forth
+	else if (table->size > MP_INDEX_MIN_SIZE && table->count < table->size * MP_INDEX_SHRINK_LOAD)
+	{
+		mp_resize(table, -1);
+	}
+	return block;
 }
 #endif
 #endif
 
 #ifdef MP_REPLACE_STD
-#define malloc(size)	   mp_malloc_internal(size, __FILE__, __LINE__);
-#define calloc(num, size)  mp_calloc_internal(num, size, __FILE__, __LINE__);
-#define realloc(ptr, size) mp_realloc_internal(ptr, size, __FILE__, __LINE__);
-#define free(ptr)		   mp_free_internal(ptr, __FILE__, __LINE__);
+#define malloc(size)	   mp_malloc_internal(size, MP_LOCATION())
+#define calloc(num, size)  mp_calloc_internal(num, size, MP_LOCATION())
+#define realloc(ptr, size) mp_realloc_internal(ptr, size, MP_LOCATION())
+#define free(ptr)		   mp_free_internal(ptr, __FILE__, __LINE__)
+#define aligned_alloc(alignment, size)		 mp_aligned_alloc_internal(alignment, size, MP_LOCATION())
+#define posix_memalign(ptr, alignment, size) mp_posix_memalign_internal(ptr, alignment, size, MP_LOCATION())
 #endif
 
 #endif
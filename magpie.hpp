@@ -0,0 +1,195 @@
+// Routes the global operator new and delete of C++ through magpie
+// Include instead of magpie.h in C++ files, magpie itself is still built by a C file defining MP_IMPLEMENTATION
+// #define MP_NEW_IMPLEMENTATION in ONE C++ file before including the header to replace the global operators
+// -> Every form is replaced, plain, array, nothrow, sized and, with C++17, aligned
+// -> Types declared alignas(64) to keep hot data on cache lines of their own are allocated with mp_aligned_alloc
+// -> Sized delete hands the size to mp_free_sized, which reports a block freed with another size than it was allocated
+// Blocks allocated with plain new are reported at the operator in this file, or per call stack with MP_BACKTRACE
+// MP_NEW allocates like new but reports the block at the line using it
+// -> T* t = MP_NEW T(args); and delete t; as usual
+
+#ifndef MAGPIE_HPP
+#define MAGPIE_HPP
+
+#include "magpie.h"
+#include <cstdlib>
+#include <new>
+
+// Allocates size bytes for new, aligned to alignment if it is not 0
+// Calls the new handler until the allocation succeeds, then throws std::bad_alloc or returns NULL if nothrow is set
+static inline void* mp_new_internal(std::size_t size, std::size_t alignment, int nothrow,
+									struct MPAllocLocation* location)
+{
+	for (;;)
+	{
+		void* ptr = alignment ? mp_aligned_alloc_internal(alignment, size, location) : mp_malloc_internal(size, location);
+		if (ptr)
+			return ptr;
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr)
+		{
+			if (nothrow)
+				return nullptr;
+#if defined(__cpp_exceptions) || defined(__EXCEPTIONS)
+			throw std::bad_alloc();
+#else
+			std::abort();
+#endif
+		}
+		handler();
+	}
+}
+
+// Placement forms selected by MP_NEW
+inline void* operator new(std::size_t size, struct MPAllocLocation* location)
+{
+	return mp_new_internal(size, 0, 0, location);
+}
+
+inline void* operator new[](std::size_t size, struct MPAllocLocation* location)
+{
+	return mp_new_internal(size, 0, 0, location);
+}
+
+// Only called when a constructor throws
+inline void operator delete(void* ptr, struct MPAllocLocation* location) noexcept
+{
+	mp_free_internal(ptr, location->file, location->line);
+}
+
+inline void operator delete[](void* ptr, struct MPAllocLocation* location) noexcept
+{
+	mp_free_internal(ptr, location->file, location->line);
+}
+
+#ifdef __cpp_aligned_new
+inline void* operator new(std::size_t size, std::align_val_t alignment, struct MPAllocLocation* location)
+{
+	return mp_new_internal(size, static_cast<std::size_t>(alignment), 0, location);
+}
+
+inline void* operator new[](std::size_t size, std::align_val_t alignment, struct MPAllocLocation* location)
+{
+	return mp_new_internal(size, static_cast<std::size_t>(alignment), 0, location);
+}
+
+inline void operator delete(void* ptr, std::align_val_t, struct MPAllocLocation* location) noexcept
+{
+	mp_free_internal(ptr, location->file, location->line);
+}
+
+inline void operator delete[](void* ptr, std::align_val_t, struct MPAllocLocation* location) noexcept
+{
+	mp_free_internal(ptr, location->file, location->line);
+}
+#endif
+
+#define MP_NEW new (MP_LOCATION())
+
+#ifdef MP_NEW_IMPLEMENTATION
+// Replacement functions can not be inline, so they are defined once in the file defining MP_NEW_IMPLEMENTATION
+void* operator new(std::size_t size)
+{
+	return mp_new_internal(size, 0, 0, MP_LOCATION());
+}
+
+void* operator new[](std::size_t size)
+{
+	return mp_new_internal(size, 0, 0, MP_LOCATION());
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+	return mp_new_internal(size, 0, 1, MP_LOCATION());
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+	return mp_new_internal(size, 0, 1, MP_LOCATION());
+}
+
+void operator delete(void* ptr) noexcept
+{
+	mp_free_internal(ptr, __FILE__, __LINE__);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+	mp_free_internal(ptr, __FILE__, __LINE__);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+	mp_free_internal(ptr, __FILE__, __LINE__);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+	mp_free_internal(ptr, __FILE__, __LINE__);
+}
+
+// The size of an array includes the cookie the compiler stores in front of it, like the size given to new[]
+void operator delete(void* ptr, std::size_t size) noexcept
+{
+	mp_free_sized_internal(ptr, size, __FILE__, __LINE__);
+}
+
+void operator delete[](void* ptr, std::size_t size) noexcept
+{
+	mp_free_sized_internal(ptr, size, __FILE__, __LINE__);
+}
+
+#ifdef __cpp_aligned_new
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	return mp_new_internal(size, static_cast<std::size_t>(alignment), 0, MP_LOCATION());
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+	return mp_new_internal(size, static_cast<std::size_t>(alignment), 0, MP_LOCATION());
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return mp_new_internal(size, static_cast<std::size_t>(alignment), 1, MP_LOCATION());
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return mp_new_internal(size, static_cast<std::size_t>(alignment), 1, MP_LOCATION());
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+	mp_free_internal(ptr, __FILE__, __LINE__);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+	mp_free_internal(ptr, __FILE__, __LINE__);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	mp_free_internal(ptr, __FILE__, __LINE__);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	mp_free_internal(ptr, __FILE__, __LINE__);
+}
+
+void operator delete(void* ptr, std::size_t size, std::align_val_t) noexcept
+{
+	mp_free_sized_internal(ptr, size, __FILE__, __LINE__);
+}
+
+void operator delete[](void* ptr, std::size_t size, std::align_val_t) noexcept
+{
+	mp_free_sized_internal(ptr, size, __FILE__, __LINE__);
+}
+#endif
+#endif
+
+#endif
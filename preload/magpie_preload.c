@@ -0,0 +1,379 @@
+// Tracks every allocation of an existing program without recompiling it
+// Build as a shared library and load it in front of the C library
+// LD_PRELOAD=bin/libmagpie_preload.so ./program
+// Interposes malloc, calloc, realloc, reallocarray, free, malloc_usable_size and the aligned allocation functions
+// Blocks are reported per call stack, the program needs frame pointers for stacks deeper than its allocating function
+// Configured through the environment
+// MAGPIE_PROFILE=path writes a heap profile when the program exits
+// MAGPIE_PROFILE_FORMAT=pprof|live|total selects the format of the profile, pprof by default
+// MAGPIE_LEAKS=1 prints the stacks of the blocks still allocated when the program exits
+// MAGPIE_TRACE=path records every allocation of the program to a trace read by tools/mp_analyze and tools/mp_replay
+// MAGPIE_SHM=1 publishes live statistics to /magpie.<pid> for tools/mp_top, any other value is used as the name
+#define MP_IMPLEMENTATION
+#define MP_THREAD_SAFE
+#define MP_SEPARATE_META
+#define MP_BACKTRACE
+#define MP_TRACE
+#define MP_SHM
+#define MP_ALLOW_FOREIGN
+#define MP_MESSAGE(m) preload_message(m)
+void preload_message(const char* msg);
+// magpie allocates its own memory through the next allocator in the process, not through the interposed functions
+#define malloc				preload_next_malloc
+#define calloc				preload_next_calloc
+#define realloc				preload_next_realloc
+#define free				preload_next_free
+#define malloc_usable_size	preload_next_usable_size
+#define posix_memalign		preload_next_posix_memalign
+#include "magpie.h"
+#undef malloc
+#undef calloc
+#undef realloc
+#undef free
+#undef malloc_usable_size
+#undef posix_memalign
+#include <dlfcn.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define PRELOAD_EXPORT __attribute__((visibility("default")))
+
+// Bytes handed out before the next allocator is found, dlsym may allocate while it is being looked up
+#define PRELOAD_BOOTSTRAP_SIZE (64 * 1024)
+
+// The allocator of the C library, or of the next preloaded library
+struct PreloadAllocator
+{
+	void* (*malloc)(size_t);
+	void* (*calloc)(size_t, size_t);
+	void* (*realloc)(void*, size_t);
+	void (*free)(void*);
+	int (*posix_memalign)(void**, size_t, size_t);
+	size_t (*malloc_usable_size)(void*);
+};
+
+static struct PreloadAllocator next;
+// Set while the next allocator is being looked up
+static int preload_resolving = 0;
+
+// Set while a thread is inside magpie, allocations made by magpie itself or by the C library on its behalf go
+// straight to the next allocator
+// Initial exec so reading it never allocates
+static __thread __attribute__((tls_model("initial-exec"))) int preload_busy = 0;
+
+// Bump allocator used until the next allocator is found, its blocks are never released
+static _Alignas(max_align_t) char preload_bootstrap[PRELOAD_BOOTSTRAP_SIZE];
+static size_t preload_bootstrap_used = 0;
+
+void preload_message(const char* msg)
+{
+	// Unbuffered and without allocating
+	size_t len = strlen(msg);
+	while (len)
+	{
+		ssize_t written = write(STDERR_FILENO, msg, len);
+		if (written <= 0)
+			return;
+		msg += written;
+		len -= written;
+	}
+	(void)!write(STDERR_FILENO, "\n", 1);
+}
+
+// alignment is a power of two
+static void* preload_bootstrap_aligned(size_t alignment, size_t size)
+{
+	const size_t min_align = _Alignof(max_align_t);
+	if (alignment < min_align)
+		alignment = min_align;
+	// Store the size in front of the block for realloc, every reservation keeps the next one aligned to max_align_t
+	// and leaves room to align the block further
+	size_t len = sizeof(max_align_t) + alignment - min_align + (size + min_align - 1) / min_align * min_align;
+	if (len < size)
+		return NULL;
+	size_t offset = __atomic_fetch_add(&preload_bootstrap_used, len, __ATOMIC_RELAXED);
+	if (offset > PRELOAD_BOOTSTRAP_SIZE || len > PRELOAD_BOOTSTRAP_SIZE - offset)
+		return NULL;
+	uintptr_t start = (uintptr_t)(preload_bootstrap + offset + sizeof(max_align_t));
+	char* ptr = (char*)((start + alignment - 1) & ~(uintptr_t)(alignment - 1));
+	*(size_t*)(ptr - sizeof(max_align_t)) = size;
+	return ptr;
+}
+
+static void* preload_bootstrap_alloc(size_t size)
+{
+	return preload_bootstrap_aligned(_Alignof(max_align_t), size);
+}
+
+static inline int preload_is_bootstrap(void* ptr)
+{
+	return (char*)ptr >= preload_bootstrap && (char*)ptr < preload_bootstrap + PRELOAD_BOOTSTRAP_SIZE;
+}
+
+static void preload_resolve()
+{
+	preload_resolving = 1;
+	next.calloc = (void* (*)(size_t, size_t))dlsym(RTLD_NEXT, "calloc");
+	next.realloc = (void* (*)(void*, size_t))dlsym(RTLD_NEXT, "realloc");
+	next.free = (void (*)(void*))dlsym(RTLD_NEXT, "free");
+	next.posix_memalign = (int (*)(void**, size_t, size_t))dlsym(RTLD_NEXT, "posix_memalign");
+	next.malloc_usable_size = (size_t(*)(void*))dlsym(RTLD_NEXT, "malloc_usable_size");
+	// Looked up last, the others are ready once it is set
+	__atomic_store_n(&next.malloc, (void* (*)(size_t))dlsym(RTLD_NEXT, "malloc"), __ATOMIC_RELEASE);
+	preload_resolving = 0;
+	if (next.malloc == NULL || next.calloc == NULL || next.realloc == NULL || next.free == NULL)
+	{
+		preload_message("magpie preload failed to find the next malloc, calloc, realloc and free");
+		_exit(127);
+	}
+}
+
+// Returns nonzero once the next allocator can be used
+static inline int preload_ready()
+{
+	if (__atomic_load_n(&next.malloc, __ATOMIC_ACQUIRE))
+		return 1;
+	if (!preload_resolving)
+		preload_resolve();
+	return __atomic_load_n(&next.malloc, __ATOMIC_ACQUIRE) != NULL;
+}
+
+void* preload_next_malloc(size_t size)
+{
+	return next.malloc(size);
+}
+
+void* preload_next_calloc(size_t num, size_t size)
+{
+	return next.calloc(num, size);
+}
+
+void* preload_next_realloc(void* ptr, size_t size)
+{
+	return next.realloc(ptr, size);
+}
+
+void preload_next_free(void* ptr)
+{
+	next.free(ptr);
+}
+
+size_t preload_next_usable_size(void* ptr)
+{
+	return next.malloc_usable_size ? next.malloc_usable_size(ptr) : 0;
+}
+
+int preload_next_posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+	return next.posix_memalign ? next.posix_memalign(ptr, alignment, size) : ENOMEM;
+}
+
+PRELOAD_EXPORT void* malloc(size_t size)
+{
+	if (!preload_ready())
+		return preload_bootstrap_alloc(size);
+	if (preload_busy)
+		return next.malloc(size);
+	preload_busy = 1;
+	void* ptr = mp_malloc(size);
+	preload_busy = 0;
+	return ptr;
+}
+
+PRELOAD_EXPORT void* calloc(size_t num, size_t size)
+{
+	if (size && num > SIZE_MAX / size)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	// The bootstrap buffer starts out zeroed and is never reused
+	if (!preload_ready())
+		return preload_bootstrap_alloc(num * size);
+	if (preload_busy)
+		return next.calloc(num, size);
+	preload_busy = 1;
+	void* ptr = mp_calloc(num, size);
+	preload_busy = 0;
+	return ptr;
+}
+
+PRELOAD_EXPORT void* realloc(void* ptr, size_t size)
+{
+	if (preload_is_bootstrap(ptr))
+	{
+		// Moves the block out of the bootstrap buffer
+		size_t old_size = *(size_t*)((char*)ptr - sizeof(max_align_t));
+		void* new_ptr = malloc(size);
+		if (new_ptr)
+			memcpy(new_ptr, ptr, old_size < size ? old_size : size);
+		return new_ptr;
+	}
+	if (!preload_ready())
+		return preload_bootstrap_alloc(size);
+	if (preload_busy)
+		return next.realloc(ptr, size);
+	preload_busy = 1;
+	void* new_ptr = mp_realloc(ptr, size);
+	preload_busy = 0;
+	return new_ptr;
+}
+
+PRELOAD_EXPORT void* reallocarray(void* ptr, size_t num, size_t size)
+{
+	if (size && num > SIZE_MAX / size)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	return realloc(ptr, num * size);
+}
+
+PRELOAD_EXPORT void free(void* ptr)
+{
+	if (ptr == NULL || preload_is_bootstrap(ptr))
+		return;
+	if (preload_busy)
+	{
+		next.free(ptr);
+		return;
+	}
+	preload_busy = 1;
+	mp_free(ptr);
+	preload_busy = 0;
+}
+
+PRELOAD_EXPORT size_t malloc_usable_size(void* ptr)
+{
+	if (ptr == NULL)
+		return 0;
+	if (preload_is_bootstrap(ptr))
+		return *(size_t*)((char*)ptr - sizeof(max_align_t));
+	if (!preload_ready() || preload_busy)
+		return preload_next_usable_size(ptr);
+	// The requested size, writing past it would be reported as an overflow
+	preload_busy = 1;
+	struct MemBlock storage;
+	struct MemBlock* block = mp_find(ptr, &storage);
+	size_t size = block ? block->size : preload_next_usable_size(ptr);
+	preload_busy = 0;
+	return size;
+}
+
+// Aligned blocks are tracked like the others, and served from the bootstrap buffer until the next allocator is found
+PRELOAD_EXPORT int posix_memalign(void** ptr, size_t alignment, size_t size)
+{
+	if (alignment < sizeof(void*) || (alignment & (alignment - 1)))
+		return EINVAL;
+	if (!preload_ready())
+	{
+		void* bytes = preload_bootstrap_aligned(alignment, size);
+		if (bytes == NULL)
+			return ENOMEM;
+		*ptr = bytes;
+		return 0;
+	}
+	if (next.posix_memalign == NULL)
+		return ENOMEM;
+	if (preload_busy)
+		return next.posix_memalign(ptr, alignment, size);
+	preload_busy = 1;
+	int result = mp_posix_memalign(ptr, alignment, size);
+	preload_busy = 0;
+	return result;
+}
+
+PRELOAD_EXPORT void* aligned_alloc(size_t alignment, size_t size)
+{
+	if (alignment == 0 || (alignment & (alignment - 1)))
+	{
+		errno = EINVAL;
+		return NULL;
+	}
+	if (!preload_ready())
+		return preload_bootstrap_aligned(alignment, size);
+	if (next.posix_memalign == NULL)
+		return NULL;
+	if (preload_busy)
+		return mp_memalign(alignment < sizeof(void*) ? sizeof(void*) : alignment, size);
+	preload_busy = 1;
+	void* ptr = mp_aligned_alloc(alignment, size);
+	preload_busy = 0;
+	return ptr;
+}
+
+PRELOAD_EXPORT void* memalign(size_t alignment, size_t size)
+{
+	// Rounded up to a power of two like the C library does
+	size_t power = 1;
+	while (power < alignment)
+		power *= 2;
+	return aligned_alloc(power, size);
+}
+
+PRELOAD_EXPORT void* valloc(size_t size)
+{
+	return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+PRELOAD_EXPORT void* pvalloc(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return aligned_alloc(page, (size + page - 1) / page * page);
+}
+
+__attribute__((constructor)) static void preload_start()
+{
+	if (!preload_ready())
+		return;
+	const char* trace = getenv("MAGPIE_TRACE");
+	if (trace && *trace)
+	{
+		preload_busy = 1;
+		mp_trace_start(trace);
+		preload_busy = 0;
+	}
+	const char* shm = getenv("MAGPIE_SHM");
+	if (shm && *shm)
+	{
+		preload_busy = 1;
+		mp_shm_start(strcmp(shm, "1") == 0 ? NULL : shm);
+		preload_busy = 0;
+	}
+}
+
+__attribute__((destructor)) static void preload_stop()
+{
+	if (!preload_ready())
+		return;
+	// Reports allocate through the next allocator
+	preload_busy = 1;
+	char msg[MP_MSG_LEN];
+	mp_trace_stop();
+	mp_shm_stop();
+
+	const char* profile = getenv("MAGPIE_PROFILE");
+	if (profile && *profile)
+	{
+		const char* format = getenv("MAGPIE_PROFILE_FORMAT");
+		int profile_format = MP_PROFILE_PPROF;
+		if (format && strcmp(format, "live") == 0)
+			profile_format = MP_PROFILE_COLLAPSED_LIVE;
+		else if (format && strcmp(format, "total") == 0)
+			profile_format = MP_PROFILE_COLLAPSED_TOTAL;
+		mp_dump_heap_profile(profile, profile_format);
+	}
+
+	const char* leaks = getenv("MAGPIE_LEAKS");
+	if (leaks && strcmp(leaks, "1") == 0)
+		mp_print_stacks(1);
+
+	snprintf(msg, sizeof msg,
+			 "A total of %zu allocations of %zu bytes were made, %zu blocks of %zu bytes are still allocated at exit "
+			 "and at most %zu blocks of %zu bytes were allocated at once",
+			 mp_get_total_count(), mp_get_total_size(), mp_get_count(), mp_get_size(), mp_get_peak_count(),
+			 mp_get_peak_size());
+	MP_MESSAGE(msg);
+	// Blocks stay tracked, the program and other libraries may still free them after this
+	preload_busy = 0;
+}
@@ -1,4 +1,4 @@
-tests = { "tests/main.c", "tests/overflow.c" }
+tests = { "tests/main.c", "tests/overflow.c", "tests/threads.c", "tests/trace.c", "tests/backtrace.c", "tests/profile.c", "tests/snapshot.c", "tests/guard.c", "tests/quarantine.c", "tests/fill.c", "tests/aligned.c", "tests/realloc.c", "tests/scan.c", "tests/shm.c", "tests/cache.c", "tests/analyze.c" }
 
 function gen_tests()
 	for k, v in pairs(tests) do
@@ -14,6 +14,7 @@ function gen_tests()
 
 			includedirs "./"
 			files (v)
+			links { "pthread", "rt" }
 
 			filter "configurations:Debug"
 				defines { "DEBUG=1", "RELEASE=0" }
@@ -25,16 +26,189 @@ function gen_tests()
 				optimize "on"
 				symbols "off"
 
+			filter {}
+			-- Keeps the stacks of tests/backtrace.c walkable and named
+			buildoptions { "-Wall", "-fno-omit-frame-pointer" }
+			linkoptions "-rdynamic"
+	end
+
+	-- Checks magpie.hpp, magpie itself is built from a C file
+	print ("generating test", "new")
+	project "test_new"
+		kind "ConsoleApp"
+		language "C++"
+		cppdialect "C++17"
+		targetdir "bin"
+		debugdir "tests"
+
+		includedirs "./"
+		files { "tests/new.cpp", "tests/new_impl.c" }
+		links { "pthread" }
+
+		filter "configurations:Debug"
+			defines { "DEBUG=1", "RELEASE=0" }
+			optimize "off"
+			symbols "on"
+
+		filter "configurations:Release"
+			defines { "DEBUG=0", "RELEASE=1" }
+			optimize "on"
+			symbols "off"
+
+		filter {}
+		buildoptions "-Wall"
+end
+
+-- Benchmark builds and the defines selecting their configuration
+bench_configs = {
+	raw = { "BENCH_RAW" },
+	disable = { "MP_DISABLE" },
+	default = {},
+	threadsafe = { "MP_THREAD_SAFE" },
+	overflow = { "MP_CHECK_OVERFLOW" },
+	full = { "MP_CHECK_FULL" },
+	cache = { "MP_THREAD_CACHE" },
+	sample = { "MP_SAMPLE" },
+	backtrace = { "MP_BACKTRACE" },
+	quarantine = { "MP_QUARANTINE" },
+}
+
+function gen_bench()
+	for name, config_defines in pairs(bench_configs) do
+		print ("generating benchmark", name)
+		project ("bench_" .. name)
+			kind "ConsoleApp"
+			language "C"
+			targetdir "bin"
+
+			includedirs "./"
+			files "bench/bench.c"
+			defines { "BENCH_CONFIG=" .. name }
+			defines (config_defines)
+			links { "pthread" }
+
+			filter "configurations:Debug"
+				defines { "DEBUG=1", "RELEASE=0" }
+				optimize "off"
+				symbols "on"
+
+			filter "configurations:Release"
+				defines { "DEBUG=0", "RELEASE=1" }
+				optimize "on"
+				symbols "off"
+
+			filter {}
+			buildoptions "-Wall"
+	end
+
+	print ("generating benchmark", "verify")
+	project "bench_verify"
+		kind "ConsoleApp"
+		language "C"
+		targetdir "bin"
+
+		includedirs "./"
+		files "bench/verify.c"
+		links { "pthread" }
+
+		filter "configurations:Debug"
+			defines { "DEBUG=1", "RELEASE=0" }
+			optimize "off"
+			symbols "on"
+
+		filter "configurations:Release"
+			defines { "DEBUG=0", "RELEASE=1" }
+			optimize "on"
+			symbols "off"
+
+		filter {}
+		buildoptions "-Wall"
+end
+
+-- Standalone programs working with the output of magpie
+tools = { "tools/mp_analyze.c", "tools/mp_replay.c", "tools/mp_top.c" }
+
+function gen_tools()
+	for k, v in pairs(tools) do
+		b, e = v:find("/[a-z_]+");
+		name = v:sub(b + 1, e);
+		print ("generating tool", name)
+		project (name)
+			kind "ConsoleApp"
+			language "C"
+			targetdir "bin"
+
+			includedirs "./"
+			files (v)
+			links { "pthread", "dl", "rt" }
+
+			filter "configurations:Debug"
+				defines { "DEBUG=1", "RELEASE=0" }
+				optimize "off"
+				symbols "on"
+
+			filter "configurations:Release"
+				defines { "DEBUG=0", "RELEASE=1" }
+				optimize "on"
+				symbols "off"
+
+			filter {}
 			buildoptions "-Wall"
 	end
 end
 
+-- Shared library tracking an unmodified program through LD_PRELOAD
+function gen_preload()
+	print ("generating preload library")
+	project "magpie_preload"
+		kind "SharedLib"
+		language "C"
+		targetdir "bin"
+
+		includedirs "./"
+		files "preload/magpie_preload.c"
+		links { "pthread", "dl", "rt" }
+
+		filter "configurations:Debug"
+			defines { "DEBUG=1", "RELEASE=0" }
+			optimize "off"
+			symbols "on"
+
+		filter "configurations:Release"
+			defines { "DEBUG=0", "RELEASE=1" }
+			optimize "on"
+			symbols "off"
+
+		filter {}
+		pic "On"
+		-- Only the interposed functions are exported, thread locals must never allocate when first used
+		buildoptions { "-Wall", "-fvisibility=hidden", "-ftls-model=initial-exec", "-fno-omit-frame-pointer" }
+end
+
 newoption {
 	trigger = "test",
 	description = "Build the tests",
 }
 
+newoption {
+	trigger = "bench",
+	description = "Build the benchmarks",
+}
+
+newoption {
+	trigger = "tools",
+	description = "Build the tools",
+}
+
+newoption {
+	trigger = "preload",
+	description = "Build the preload library",
+}
+
 workspace "magpie"
 	configurations { "Release", "Debug" }
 
-if _OPTIONS["test"] then  gen_tests() end
\ No newline at end of file
+if _OPTIONS["test"] then  gen_tests() end
+if _OPTIONS["bench"] then gen_bench() end
+if _OPTIONS["tools"] then gen_tools() end
+if _OPTIONS["preload"] then gen_preload() end
\ No newline at end of file
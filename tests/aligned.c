@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <string.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#define MP_MESSAGE(m) on_message(m)
+void on_message(const char* msg);
+#include "magpie.h"
+#include <errno.h>
+
+size_t size_mismatches = 0;
+
+void on_message(const char* msg)
+{
+	if (strstr(msg, "bytes but it was allocated with"))
+		size_mismatches++;
+	puts(msg);
+}
+
+int main(int argc, char** argv)
+{
+	int failed = 0;
+
+	// Every alignment from the one of pointers to a page
+	char* blocks[16];
+	size_t count = 0;
+	for (size_t alignment = sizeof(void*); alignment <= 4096; alignment *= 2)
+	{
+		char* p = aligned_alloc(alignment, 100);
+		if (p == NULL || (uintptr_t)p % alignment != 0)
+		{
+			printf("Block %p is not aligned to %zu\n", p, alignment);
+			return 1;
+		}
+		memset(p, count, 100);
+		failed |= mp_validate(p) != MP_VALIDATE_OK;
+
+		// Overflows past aligned blocks are found like for any other block
+		p[100] = 0;
+		failed |= mp_validate(p) != MP_VALIDATE_OVERFLOW;
+		p[100] = MP_BUFFER_PAD_VAL;
+		blocks[count++] = p;
+	}
+	printf("Allocated %zu aligned blocks\n", count);
+
+	// Reallocated blocks keep their bytes and are freed like any other block
+	for (size_t i = 0; i < count; i++)
+	{
+		blocks[i] = realloc(blocks[i], 10000);
+		for (size_t j = 0; j < 100; j++)
+			failed |= blocks[i][j] != (char)i;
+		failed |= mp_validate(blocks[i]) != MP_VALIDATE_OK;
+		free(blocks[i]);
+	}
+
+	void* q = NULL;
+	void* invalid = NULL;
+	failed |= posix_memalign(&q, 64, 256) != 0 || (uintptr_t)q % 64 != 0;
+	failed |= posix_memalign(&invalid, 24, 16) != EINVAL;
+	failed |= posix_memalign(&invalid, 2, 16) != EINVAL;
+	failed |= aligned_alloc(3, 16) != NULL;
+	failed |= mp_get_count() != 1;
+
+	// Freeing with the right size is silent, the wrong size is reported
+	mp_free_sized(q, 256);
+	q = mp_aligned_alloc(64, 128);
+	mp_free_sized(q, 64);
+	printf("%zu size mismatches found\n", size_mismatches);
+	failed |= size_mismatches != 1;
+
+	return mp_terminate() != 0 || failed;
+}
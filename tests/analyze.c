@@ -0,0 +1,130 @@
+#include <stdio.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#define MP_TRACE
+#define MP_TRACE_LOSSLESS
+#include "magpie.h"
+#include <pthread.h>
+// The analyzer is checked through its functions, its main is not used
+#define main mp_analyze_main
+#include "tools/mp_analyze.c"
+#undef main
+
+#define HANDOFF_COUNT 20000
+#define REALLOC_COUNT 5
+
+// Blocks allocated and reallocated by the producer, freed by the consumer
+char* handoff[HANDOFF_COUNT];
+size_t handed = 0;
+
+void* producer(void* arg)
+{
+	for (size_t i = 0; i < HANDOFF_COUNT; i++)
+	{
+		char* block = malloc(16);
+		for (size_t j = 0; j < REALLOC_COUNT; j++)
+			block = realloc(block, 16 << (j + 1));
+		handoff[i] = block;
+		__atomic_store_n(&handed, i + 1, __ATOMIC_RELEASE);
+	}
+	return arg;
+}
+
+void* consumer(void* arg)
+{
+	for (size_t i = 0; i < HANDOFF_COUNT; i++)
+	{
+		while (__atomic_load_n(&handed, __ATOMIC_ACQUIRE) <= i)
+			sched_yield();
+		free(handoff[i]);
+	}
+	return arg;
+}
+
+// Sums the live bytes of the timeline, which end at 0 when every block ended
+int64_t timeline_bytes(struct Analysis* a)
+{
+	int64_t bytes = 0;
+	for (size_t i = 0; i < a->bucket_count; i++)
+		bytes += a->bytes_delta[i];
+	return bytes;
+}
+
+void analysis_init(struct Analysis* a, uint64_t start_time, uint64_t stop_time)
+{
+	*a = (struct Analysis){0};
+	a->bucket_count = 20;
+	a->bytes_delta = calloc(a->bucket_count, sizeof(*a->bytes_delta));
+	a->blocks_delta = calloc(a->bucket_count, sizeof(*a->blocks_delta));
+	a->start_time = start_time;
+	a->stop_time = stop_time;
+}
+
+void analysis_free(struct Analysis* a)
+{
+	free(a->sites);
+	free(a->live.items);
+	free(a->orphans.items);
+	free(a->bytes_delta);
+	free(a->blocks_delta);
+}
+
+int main(int argc, char** argv)
+{
+	int failed = 0;
+
+	// The chunk of the freeing thread is read before the chunk of the thread reallocating
+	struct MPTraceEvent freeing[] = {
+		{4, 0x2000, 0, 0, 1, 2, MP_TRACE_FREE, 0},
+		{5, 0x5000, 0, 0, 0, 2, MP_TRACE_FREE, 0},
+	};
+	struct MPTraceEvent reallocating[] = {
+		{1, 0x1000, 0, 16, 1, 1, MP_TRACE_MALLOC, 0},
+		{2, 0x2000, 0x1000, 32, 1, 1, MP_TRACE_REALLOC, 0},
+		// Allocated before the trace and reallocated in place
+		{3, 0x5000, 0x5000, 64, 0, 1, MP_TRACE_REALLOC, 0},
+	};
+	struct Analysis a;
+	analysis_init(&a, 1, 5);
+	chunk_process(&a, freeing, 2);
+	chunk_process(&a, reallocating, 3);
+	printf("Out of order: %zu live, %zu before the trace, %lld bytes\n", a.live.count, a.orphans.count,
+		   (long long)timeline_bytes(&a));
+	failed |= a.live.count != 0 || a.orphans.count != 1 || timeline_bytes(&a) != 0;
+	analysis_free(&a);
+
+	// A recorded trace where every block is reallocated on one thread and freed on another
+	const char* path = "analyze.mpt";
+	if (mp_trace_start(path) != 0)
+		return 1;
+	pthread_t threads[2];
+	pthread_create(&threads[0], NULL, producer, NULL);
+	pthread_create(&threads[1], NULL, consumer, NULL);
+	pthread_join(threads[0], NULL);
+	pthread_join(threads[1], NULL);
+	mp_trace_stop();
+
+	struct TraceReader reader;
+	if (trace_open(&reader, path) != 0)
+		return 1;
+	analysis_init(&a, reader.header.start_time, reader.header.stop_time);
+	// Read like mp_analyze does, the chunks of a drain are merged by time
+	struct ChunkRound round = {0};
+	struct MPTraceChunk chunk;
+	const struct MPTraceEvent* events;
+	while ((events = trace_next_chunk(&reader, &chunk)))
+		round_add(&a, &round, &chunk, events);
+	round_flush(&a, &round);
+	free(round.events);
+	free(round.sorted);
+	free(round.thread_round);
+	trace_close(&reader);
+	printf("Recorded: %zu events, %zu live, %zu before the trace, %lld bytes\n", a.event_count, a.live.count,
+		   a.orphans.count, (long long)timeline_bytes(&a));
+	failed |= a.event_count != HANDOFF_COUNT * (REALLOC_COUNT + 2) || a.live.count != 0 || a.orphans.count != 0 ||
+			  timeline_bytes(&a) != 0;
+	analysis_free(&a);
+	remove(path);
+
+	return failed || mp_terminate() != 0;
+}
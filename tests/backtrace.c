@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <string.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#define MP_BACKTRACE
+#define MP_MESSAGE(m) on_message(m)
+void on_message(const char* msg);
+#include "magpie.h"
+#include "a.h"
+
+// Number of leak reports, one per stack
+size_t leak_reports = 0;
+// Reports of the location in A with every allocation of both stacks
+size_t site_reports = 0;
+
+void on_message(const char* msg)
+{
+	if (strstr(msg, "have not been freed"))
+		leak_reports++;
+	if (strstr(msg, "made 21 allocations of 2100 bytes, 11 blocks of 1100 bytes are live with a peak of 1100 bytes"))
+		site_reports++;
+	puts(msg);
+}
+
+// Both leak through the same wrapper and location, but from different stacks
+__attribute__((noinline)) char* first()
+{
+	return A();
+}
+
+__attribute__((noinline)) char* second()
+{
+	return A();
+}
+
+int main(int argc, char** argv)
+{
+	for (size_t i = 0; i < 10; i++)
+	{
+		free(first());
+		first();
+	}
+	second();
+	// Prints the stacks and the location they share
+	mp_print_locations();
+	printf("%zu site reports\n", site_reports);
+
+	// The leaks of first and second are reported separately
+	size_t remaining = mp_terminate();
+	printf("%zu leaks in %zu reports\n", remaining, leak_reports);
+	return remaining != 11 || leak_reports != 2 || site_reports != 1;
+}
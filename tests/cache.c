@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <string.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#define MP_THREAD_CACHE
+#define MP_MESSAGE(m) on_message(m)
+void on_message(const char* msg);
+#include "magpie.h"
+#include <pthread.h>
+
+#define ROUNDS		 200
+#define FREER_COUNT	 2
+// Fewer than MP_THREAD_CACHE_LEN so the blocks are still pending when their thread exits
+#define BLOCKS		 32
+
+// Blocks allocated by a thread which exits right after
+char* handoff[ROUNDS][BLOCKS];
+int ready[ROUNDS];
+// Never allocated by magpie
+char foreign[FREER_COUNT];
+size_t invalid_frees = 0;
+
+void on_message(const char* msg)
+{
+	if (strstr(msg, "Freeing invalid or already freed pointer"))
+	{
+		__atomic_fetch_add(&invalid_frees, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	puts(msg);
+}
+
+void* allocate(void* arg)
+{
+	size_t round = (size_t)arg;
+	for (size_t i = 0; i < BLOCKS; i++)
+		handoff[round][i] = malloc(i + 1);
+	__atomic_store_n(&ready[round], 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+// Frees its share of the blocks of every exiting thread, and an untracked pointer for each of them
+// Both miss the hashtable and go through the caches of other threads while those threads exit
+void* release(void* arg)
+{
+	size_t index = (size_t)arg;
+	for (size_t round = 0; round < ROUNDS; round++)
+	{
+		while (!__atomic_load_n(&ready[round], __ATOMIC_ACQUIRE))
+			;
+		for (size_t i = index; i < BLOCKS; i += FREER_COUNT)
+		{
+			free(handoff[round][i]);
+			free(&foreign[index]);
+		}
+	}
+	return NULL;
+}
+
+int main(int argc, char** argv)
+{
+	pthread_t freers[FREER_COUNT];
+	for (size_t i = 0; i < FREER_COUNT; i++)
+		pthread_create(&freers[i], NULL, release, (void*)i);
+
+	pthread_t threads[ROUNDS];
+	for (size_t round = 0; round < ROUNDS; round++)
+		pthread_create(&threads[round], NULL, allocate, (void*)round);
+	for (size_t round = 0; round < ROUNDS; round++)
+		pthread_join(threads[round], NULL);
+	for (size_t i = 0; i < FREER_COUNT; i++)
+		pthread_join(freers[i], NULL);
+
+	printf("%zu untracked pointers reported, %zu blocks remain\n", invalid_frees, mp_get_count());
+	int failed = invalid_frees != ROUNDS * BLOCKS || mp_get_count() != 0;
+	return mp_terminate() != 0 || failed;
+}
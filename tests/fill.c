@@ -0,0 +1,61 @@
+#include <stdio.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#define MP_BUFFER_PAD_LEN 64
+#include "magpie.h"
+#include <string.h>
+
+// Every kernel finding the first byte which is not the fill value
+struct Kernel
+{
+	const char* name;
+	size_t (*find)(const char* p, size_t len);
+};
+
+int main(int argc, char** argv)
+{
+	struct Kernel kernels[4] = {{"byte", mp_find_unfilled_byte}, {"word", mp_find_unfilled_word}};
+	size_t kernel_count = 2;
+#ifdef MP_SIMD_X86
+	kernels[kernel_count++] = (struct Kernel){"sse2", mp_find_unfilled_sse2};
+	if (__builtin_cpu_supports("avx2"))
+		kernels[kernel_count++] = (struct Kernel){"avx2", mp_find_unfilled_avx2};
+#endif
+
+	// Check every length and position of a changed byte, at every alignment
+	char buf[400];
+	int failed = 0;
+	for (size_t k = 0; k < kernel_count; k++)
+	{
+		for (size_t start = 0; start < 8; start++)
+		{
+			for (size_t len = 0; len <= 300; len++)
+			{
+				memset(buf, MP_BUFFER_PAD_VAL, sizeof buf);
+				failed |= kernels[k].find(buf + start, len) != len;
+				for (size_t pos = 0; pos < len; pos++)
+				{
+					buf[start + pos] = 0;
+					size_t found = kernels[k].find(buf + start, len);
+					if (found != pos)
+					{
+						printf("%s found %zu instead of %zu in %zu bytes\n", kernels[k].name, found, pos, len);
+						failed = 1;
+					}
+					buf[start + pos] = MP_BUFFER_PAD_VAL;
+				}
+			}
+		}
+		printf("Checked kernel %s\n", kernels[k].name);
+	}
+
+	// An overflow anywhere in a long padding is found
+	char* p = malloc(100);
+	p[100 + 40] = 0;
+	failed |= mp_validate(p) != MP_VALIDATE_OVERFLOW;
+	p[100 + 40] = MP_BUFFER_PAD_VAL;
+	failed |= mp_validate(p) != MP_VALIDATE_OK;
+	free(p);
+
+	return mp_terminate() != 0 || failed;
+}
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#define MP_GUARD_PAGES
+#include "magpie.h"
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static size_t page;
+
+// Returns nonzero if the block of size bytes at p ends right before a page boundary, up to the slack for alignment
+int is_guarded(char* p, size_t size)
+{
+	return ((uintptr_t)(p + size + MP_GUARD_SLACK(size)) & (page - 1)) == 0;
+}
+
+// Writes one byte past a new block of size bytes in a child
+// Returns the signal which stopped the child, or 0 if it exited
+int overflow_signal(size_t size)
+{
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		volatile char* p = malloc(size);
+		p[size] = 'a';
+		_exit(0);
+	}
+	int status = 0;
+	waitpid(pid, &status, 0);
+	return WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+}
+
+static const uint32_t site_line = __LINE__ + 1;
+char* site_alloc() { return malloc(40); }
+char* other_alloc() { return malloc(40); }
+
+int main(int argc, char** argv)
+{
+	page = sysconf(_SC_PAGESIZE);
+	int failed = 0;
+
+	// Every block is guarded by default, so the first byte past the end of an aligned size faults
+	failed |= overflow_signal(16) != SIGSEGV;
+	// Other sizes are aligned like malloc, the bytes up to the guard page are padding checked on free
+	char* odd = malloc(13);
+	failed |= !is_guarded(odd, 13) || (uintptr_t)odd % _Alignof(max_align_t) != 0;
+	odd[13] = 'a';
+	failed |= mp_validate(odd) != MP_VALIDATE_OVERFLOW;
+	odd[13] = MP_BUFFER_PAD_VAL;
+	free(odd);
+	// Only blocks in the size range are guarded
+	mp_set_guard(100, 200, 1);
+	failed |= overflow_signal(16) != 0;
+	failed |= overflow_signal(144) != SIGSEGV;
+
+	// One in four allocations
+	mp_set_guard(0, SIZE_MAX, 4);
+	char* blocks[100];
+	size_t guarded = 0;
+	for (size_t i = 0; i < 100; i++)
+	{
+		blocks[i] = malloc(24);
+		guarded += is_guarded(blocks[i], 24);
+	}
+	for (size_t i = 0; i < 100; i++)
+		free(blocks[i]);
+	printf("%zu of 100 blocks guarded\n", guarded);
+	failed |= guarded != 25;
+
+	// Freed mappings are reused and cleared by calloc
+	mp_set_guard(0, SIZE_MAX, 1);
+	char* p = malloc(100);
+	memset(p, 'x', 100);
+	free(p);
+	char* q = calloc(10, 10);
+	failed |= q != p;
+	for (size_t i = 0; i < 100; i++)
+		failed |= q[i] != 0;
+	// Grows onto more pages and keeps the contents
+	strcpy(q, "guarded");
+	q = realloc(q, 3 * page);
+	failed |= !is_guarded(q, 3 * page) || strcmp(q, "guarded") != 0;
+	free(q);
+
+	// Only selected sites, also when they were registered before
+	char* other = other_alloc();
+	free(other);
+	failed |= mp_guard_site("guard.c", site_line) != 0;
+	char* a = site_alloc();
+	char* b = other_alloc();
+	failed |= !is_guarded(a, 40) || is_guarded(b, 40);
+	free(a);
+	free(b);
+
+	return mp_terminate() != 0 || failed;
+}
@@ -0,0 +1,78 @@
+#define MP_NEW_IMPLEMENTATION
+#include "magpie.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+size_t size_mismatches = 0;
+
+extern "C" void on_message(const char* msg)
+{
+	if (std::strstr(msg, "bytes but it was allocated with"))
+		size_mismatches++;
+	std::puts(msg);
+}
+
+// Kept on a cache line of its own
+struct alignas(64) Hot
+{
+	std::uint64_t counter;
+};
+
+struct Base
+{
+	virtual ~Base() = default;
+};
+
+struct Derived : Base
+{
+	char payload[200];
+};
+
+int main(int argc, char** argv)
+{
+	int failed = 0;
+	std::size_t count = mp_get_count();
+
+	int* i = new int(5);
+	failed |= mp_get_count() != count + 1;
+	failed |= mp_validate(i) != MP_VALIDATE_OK;
+	delete i;
+
+	Hot* hot = new Hot[8];
+	failed |= reinterpret_cast<std::uintptr_t>(hot) % 64 != 0;
+	failed |= mp_validate(hot) != MP_VALIDATE_OK;
+	delete[] hot;
+
+	// Deleting through the base hands the size of the derived object to sized delete
+	Base* base = new Derived;
+	delete base;
+
+	// Reported at this line
+	std::string* s = MP_NEW std::string(100, 'x');
+	failed |= mp_validate(s) != MP_VALIDATE_OK;
+	delete s;
+
+	Hot* hot_here = MP_NEW Hot;
+	failed |= reinterpret_cast<std::uintptr_t>(hot_here) % 64 != 0;
+	delete hot_here;
+
+	std::vector<int> v;
+	for (int n = 0; n < 1000; n++)
+		v.push_back(n);
+	v = std::vector<int>();
+
+	int* missing = new (std::nothrow) int[4];
+	failed |= missing == nullptr;
+	delete[] missing;
+
+	// A size other than the one allocated is reported
+	void* raw = ::operator new(32);
+	::operator delete(raw, 16);
+	std::printf("%zu size mismatches found\n", size_mismatches);
+	failed |= size_mismatches != 1;
+	failed |= mp_get_count() != count;
+	return failed;
+}
@@ -0,0 +1,8 @@
+// Builds magpie for tests/new.cpp, the implementation is C
+#define MP_IMPLEMENTATION
+#define MP_THREAD_SAFE
+#define MP_CHECK_OVERFLOW
+#define MP_FILL_ON_FREE
+#define MP_MESSAGE(m) on_message(m)
+void on_message(const char* msg);
+#include "magpie.h"
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <string.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#include "magpie.h"
+
+int main(int argc, char** argv)
+{
+	char* kept[10];
+	for (size_t i = 0; i < 10; i++)
+	{
+		free(malloc(64));
+		kept[i] = malloc(100);
+	}
+	kept[0] = realloc(kept[0], 200);
+
+	// The most live at once is after the realloc
+	printf("peak of %zu blocks and %zu bytes\n", mp_get_peak_count(), mp_get_peak_size());
+	int failed = mp_get_peak_count() != 10 || mp_get_peak_size() != 1100;
+
+	if (mp_dump_heap_profile("profile.heap", MP_PROFILE_PPROF) != 0 ||
+		mp_dump_heap_profile("profile.folded", MP_PROFILE_COLLAPSED_LIVE) != 0)
+		return 1;
+
+	// The header holds the live and total blocks and bytes
+	// Total bytes include the growth of the realloc, which stays counted at the location of the block
+	size_t live_count, live_size, total_count, total_size, rate;
+	FILE* file = fopen("profile.heap", "r");
+	if (file == NULL || fscanf(file, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu", &live_count, &live_size,
+							   &total_count, &total_size, &rate) != 5)
+		return 1;
+	fclose(file);
+	printf("live %zu blocks of %zu bytes, total %zu blocks of %zu bytes\n", live_count, live_size, total_count,
+		   total_size);
+	failed |= live_count != 10 || live_size != 1100 || total_count != 20 || total_size != 1740 || rate != 1;
+
+	// Only sites with live bytes are written, one line each
+	char line[256];
+	size_t lines = 0;
+	file = fopen("profile.folded", "r");
+	while (file && fgets(line, sizeof line, file))
+	{
+		printf("%s", line);
+		lines++;
+	}
+	if (file)
+		fclose(file);
+	failed |= lines != 1;
+	remove("profile.heap");
+	remove("profile.folded");
+
+	for (size_t i = 0; i < 10; i++)
+		free(kept[i]);
+	return mp_terminate() != 0 || failed;
+}
@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <string.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#define MP_QUARANTINE
+#define MP_QUARANTINE_LEN 64
+#define MP_QUARANTINE_BATCH 8
+#define MP_MESSAGE(m) on_message(m)
+void on_message(const char* msg);
+#include "magpie.h"
+
+size_t writes_after_free = 0;
+size_t double_frees = 0;
+
+void on_message(const char* msg)
+{
+	if (strstr(msg, "after being freed"))
+		writes_after_free++;
+	if (strstr(msg, "it was already freed at"))
+		double_frees++;
+	puts(msg);
+}
+
+// Keeps the writes through dangling pointers from being seen by the compiler
+char* volatile dangling;
+
+int main(int argc, char** argv)
+{
+	char* p = malloc(100);
+	free(p);
+	dangling = p;
+	dangling[70] = 'x';
+
+	// Pushes p out of the quarantine, where the write is found
+	for (size_t i = 0; i < 64; i++)
+		free(malloc(16));
+	printf("%zu writes after free found\n", writes_after_free);
+	int failed = writes_after_free != 1;
+
+	char* q = malloc(200);
+	free(q);
+	dangling = q;
+	free(dangling);
+	failed |= double_frees != 1;
+	// Still in the quarantine, found by mp_terminate
+	dangling[0] = 0;
+
+	failed |= mp_terminate() != 0;
+	failed |= writes_after_free != 2;
+	return failed;
+}
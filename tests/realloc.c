@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <string.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#define MP_THREAD_SAFE
+#include "magpie.h"
+#include <pthread.h>
+
+#define THREAD_COUNT 4
+#define GROWTHS		 1000
+
+// The location every block of a thread is allocated at
+struct MPAllocLocation sites[THREAD_COUNT];
+
+// Grows a block one byte at a time like a vector and checks it keeps its bytes
+void* grow(void* arg)
+{
+	struct MPAllocLocation* site = arg;
+	size_t failed = 0;
+	for (size_t round = 0; round < 10; round++)
+	{
+		char* p = mp_malloc_internal(1, site);
+		p[0] = 0;
+		for (size_t i = 1; i < GROWTHS; i++)
+		{
+			p = realloc(p, i + 1);
+			p[i] = (char)i;
+		}
+		for (size_t i = 0; i < GROWTHS; i++)
+			failed += p[i] != (char)i;
+		failed += mp_validate(p) != MP_VALIDATE_OK;
+		free(p);
+	}
+	return (void*)failed;
+}
+
+int main(int argc, char** argv)
+{
+	int failed = 0;
+	pthread_t threads[THREAD_COUNT];
+	for (size_t i = 0; i < THREAD_COUNT; i++)
+	{
+		sites[i] = (struct MPAllocLocation){__FILE__, __LINE__};
+		pthread_create(&threads[i], NULL, grow, &sites[i]);
+	}
+	for (size_t i = 0; i < THREAD_COUNT; i++)
+	{
+		void* thread_failed;
+		pthread_join(threads[i], &thread_failed);
+		failed |= thread_failed != NULL;
+	}
+
+	// Reallocs are counted at the location of the block, not as allocations of their own
+	for (size_t i = 0; i < THREAD_COUNT; i++)
+	{
+		struct MPAllocLocation* it = &sites[i];
+		printf("%zu reallocs, %zu moved copying %zu bytes\n", it->realloc_count, it->realloc_moved, it->realloc_copied);
+		failed |= it->count != 10 || it->realloc_count != 10 * (GROWTHS - 1) || it->realloc_moved > it->realloc_count;
+		failed |= it->live_size != 0 || it->peak_size != GROWTHS;
+	}
+
+	// A block shrunk in place is checked at its new size
+	char* p = malloc(1000);
+	size_t total = mp_get_total_size();
+	char* q = realloc(p, 100);
+	// Shrinking adds nothing to the bytes ever allocated and takes nothing from them
+	failed |= mp_get_total_size() != total;
+	failed |= mp_validate(q) != MP_VALIDATE_OK;
+	q[100] = 0;
+	failed |= mp_validate(q) != MP_VALIDATE_OVERFLOW;
+	q[100] = MP_BUFFER_PAD_VAL;
+	printf("Shrinking %s the block\n", p == q ? "kept" : "moved");
+
+	// A failed realloc keeps the block tracked with its bytes
+	q[0] = 42;
+	failed |= realloc(q, SIZE_MAX / 2) != NULL;
+	failed |= mp_validate(q) != MP_VALIDATE_OK || q[0] != 42;
+	free(q);
+
+	mp_print_locations();
+	return mp_terminate() != 0 || failed;
+}
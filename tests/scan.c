@@ -0,0 +1,49 @@
+#include <stdio.h>
+#include <string.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#define MP_SCAN
+#define MP_SCAN_PERIOD_MS 10
+#define MP_MESSAGE(m) on_message(m)
+void on_message(const char* msg);
+#include "magpie.h"
+#include <time.h>
+
+size_t found = 0;
+
+void on_message(const char* msg)
+{
+	if (strstr(msg, "found by the scanner"))
+		__atomic_fetch_add(&found, 1, __ATOMIC_RELAXED);
+	puts(msg);
+}
+
+int main(int argc, char** argv)
+{
+	int failed = 0;
+
+	// Enough long lived blocks to take several slices to walk
+	char* blocks[4096];
+	for (size_t i = 0; i < 4096; i++)
+		blocks[i] = malloc(i % 64 + 1);
+	failed |= mp_scan_start(50) != 0;
+
+	// An overflow long after allocating is found without freeing or validating the block
+	blocks[1000][1000 % 64 + 1] = 0;
+	blocks[3000][3000 % 64 + 1] = 0;
+	for (size_t i = 0; i < 500 && __atomic_load_n(&found, __ATOMIC_RELAXED) < 2; i++)
+	{
+		struct timespec ts = {0, 10000000};
+		nanosleep(&ts, NULL);
+	}
+
+	// The scanner restores the padding, each overflow is reported once
+	size_t scanned = mp_scan_stop();
+	printf("The scanner found %zu overflows\n", scanned);
+	failed |= scanned != 2 || found != 2;
+	failed |= mp_validate(blocks[1000]) != MP_VALIDATE_OK;
+
+	for (size_t i = 0; i < 4096; i++)
+		free(blocks[i]);
+	return mp_terminate() != 0 || failed;
+}
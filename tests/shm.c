@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <string.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#define MP_SHM
+#define MP_SHM_SITES	 4
+#define MP_SHM_PERIOD_MS 10
+#include "magpie.h"
+#include "tools/shm_reader.h"
+
+char* big(size_t size)
+{
+	return malloc(size);
+}
+
+char* small(size_t size)
+{
+	return malloc(size);
+}
+
+int main(int argc, char** argv)
+{
+	int failed = 0;
+	char name[64];
+	snprintf(name, sizeof name, "/magpie_test.%d", (int)getpid());
+	failed |= mp_shm_start(name) != 0;
+
+	struct ShmReader reader;
+	if (shm_attach(&reader, name) != 0)
+		return 1;
+	failed |= reader.site_capacity != 4;
+
+	char* blocks[100];
+	for (size_t i = 0; i < 100; i++)
+		blocks[i] = i % 10 ? small(16) : big(4096);
+
+	// Wait for an update made after the allocations
+	struct MPShmHeader header;
+	struct MPShmSite sites[4];
+	for (size_t i = 0; i < 500; i++)
+	{
+		failed |= shm_read(&reader, &header, sites) != 0;
+		if (header.count == 100)
+			break;
+		struct timespec ts = {0, 10000000};
+		nanosleep(&ts, NULL);
+	}
+	for (size_t i = 0; i < header.site_count; i++)
+		printf("%s:%u has %llu blocks of %llu bytes live\n", sites[i].file, sites[i].line,
+			   (unsigned long long)sites[i].live_count, (unsigned long long)sites[i].live_size);
+	failed |= header.count != 100 || header.size != 10 * 4096 + 90 * 16 || header.pid != (uint64_t)getpid();
+	// Sites are sorted by live bytes
+	failed |= header.site_count != 2 || sites[0].live_size != 10 * 4096 || sites[1].live_count != 90;
+
+	for (size_t i = 0; i < 100; i++)
+		free(blocks[i]);
+
+	// Attached readers see the last update once stopped, but the name is gone
+	mp_shm_stop();
+	failed |= shm_read(&reader, &header, sites) != 0;
+	failed |= !header.stopped || header.count != 0 || sites[0].live_size != 0;
+	failed |= shm_open(name, O_RDONLY, 0) >= 0;
+	shm_detach(&reader);
+
+	return mp_terminate() != 0 || failed;
+}
@@ -0,0 +1,43 @@
+#include <stdio.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#include "magpie.h"
+
+// Keeps a block of every request, like a cache that is never trimmed
+char* cache[100];
+size_t cache_len = 0;
+
+void handle_request(size_t i)
+{
+	char* buf = malloc(256);
+	free(buf);
+	if (i % 10 == 0)
+		cache[cache_len++] = malloc(32);
+}
+
+int main(int argc, char** argv)
+{
+	// Allocated before the first snapshot and never freed
+	char* config = malloc(1000);
+
+	uint32_t a = mp_snapshot();
+	for (size_t i = 0; i < 500; i++)
+		handle_request(i);
+	uint32_t b = mp_snapshot();
+	// Allocated after the second snapshot
+	for (size_t i = 0; i < 100; i++)
+		handle_request(i);
+
+	// Only the blocks kept between a and b are reported
+	size_t grown = mp_snapshot_diff(a, b);
+	printf("%zu blocks kept between snapshot %u and %u\n", grown, a, b);
+	int failed = grown != 50 || b != a + 1;
+
+	// Everything since a
+	failed |= mp_snapshot_diff(a, mp_snapshot()) != 60;
+
+	free(config);
+	for (size_t i = 0; i < cache_len; i++)
+		free(cache[i]);
+	return mp_terminate() != 0 || failed;
+}
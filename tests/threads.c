@@ -0,0 +1,84 @@
+#include <stdio.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#define MP_THREAD_SAFE
+#define MP_MESSAGE(m) on_message(m)
+void on_message(const char* msg);
+#include "magpie.h"
+#include <pthread.h>
+#include <string.h>
+
+#define THREAD_COUNT 8
+
+size_t alloc_count = 100000;
+// Blocks allocated by one thread and freed by the next
+char** handoff[THREAD_COUNT];
+// Set while printing locations, messages are then copied to the heap like a logger might
+int copy_messages = 0;
+
+void on_message(const char* msg)
+{
+	if (copy_messages)
+	{
+		// Allocates at a location which is first used while the locations are printed
+		char* line = malloc(strlen(msg) + 1);
+		strcpy(line, msg);
+		puts(line);
+		free(line);
+	}
+	else
+		puts(msg);
+}
+
+void* worker(void* arg)
+{
+	size_t index = (size_t)arg;
+	char** strings = malloc(alloc_count * sizeof(char*));
+	for (size_t i = 0; i < alloc_count; i++)
+	{
+		strings[i] = malloc(i % 256 + 1);
+		if (i % 2 == 0)
+		{
+			free(strings[i]);
+			strings[i] = NULL;
+		}
+	}
+	handoff[index] = strings;
+	return NULL;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1)
+	{
+		alloc_count = atoi(argv[1]);
+	}
+
+	pthread_t threads[THREAD_COUNT];
+	for (size_t i = 0; i < THREAD_COUNT; i++)
+	{
+		pthread_create(&threads[i], NULL, worker, (void*)i);
+	}
+	for (size_t i = 0; i < THREAD_COUNT; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	printf("Allocated %zu blocks on %d threads\n", mp_get_total_count(), THREAD_COUNT);
+
+	// Free the blocks of each thread on another thread to mix shards and threads
+	for (size_t i = 0; i < THREAD_COUNT; i++)
+	{
+		char** strings = handoff[i];
+		for (size_t j = 0; j < alloc_count; j++)
+		{
+			free(strings[j]);
+		}
+		free(strings);
+	}
+	printf("remaining count %zu\n", mp_get_count());
+	printf("size %zu\n", mp_get_size());
+	copy_messages = 1;
+	mp_print_locations();
+	copy_messages = 0;
+	return mp_terminate() != 0;
+}
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#define MP_IMPLEMENTATION
+#define MP_CHECK_FULL
+#define MP_TRACE
+#include "magpie.h"
+#include <pthread.h>
+#include <string.h>
+
+#define THREAD_COUNT 4
+
+size_t alloc_count = 1000;
+
+void* worker(void* arg)
+{
+	for (size_t i = 0; i < alloc_count; i++)
+	{
+		char* str = malloc(i % 64 + 1);
+		str = realloc(str, i % 128 + 1);
+		free(str);
+	}
+	return arg;
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1)
+	{
+		alloc_count = atoi(argv[1]);
+	}
+	const char* path = "trace.mpt";
+	if (mp_trace_start(path) != 0)
+		return 1;
+
+	pthread_t threads[THREAD_COUNT];
+	for (size_t i = 0; i < THREAD_COUNT; i++)
+	{
+		pthread_create(&threads[i], NULL, worker, NULL);
+	}
+	for (size_t i = 0; i < THREAD_COUNT; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	mp_trace_stop();
+
+	// Read the trace back and count the events
+	FILE* file = fopen(path, "rb");
+	struct MPTraceHeader header;
+	if (file == NULL || fread(&header, sizeof header, 1, file) != 1 || strcmp(header.magic, MP_TRACE_MAGIC) != 0)
+		return 1;
+	size_t counts[MP_TRACE_FREE + 1] = {0};
+	size_t dropped = 0;
+	struct MPTraceChunk chunk;
+	for (size_t i = 0; i < header.chunk_count && fread(&chunk, sizeof chunk, 1, file) == 1; i++)
+	{
+		struct MPTraceEvent event;
+		for (size_t j = 0; j < chunk.event_count && fread(&event, sizeof event, 1, file) == 1; j++)
+		{
+			if (event.op > MP_TRACE_FREE || event.thread != chunk.thread)
+				return 1;
+			counts[event.op]++;
+			dropped += event.flags & MP_TRACE_FLAG_DROPPED;
+		}
+	}
+
+	// The site table follows the chunks
+	struct MPTraceSiteTable table;
+	if (ftell(file) != (long)header.site_offset || fread(&table, sizeof table, 1, file) != 1)
+		return 1;
+	struct MPTraceSite sites[16];
+	if (table.count > 16 || fread(sites, sizeof *sites, table.count, file) != table.count)
+		return 1;
+	char names[1024] = {0};
+	fread(names, 1, table.names_size < sizeof names ? table.names_size : sizeof names - 1, file);
+	for (size_t i = 0; i < table.count; i++)
+	{
+		printf("Site %u at %.*s:%u\n", sites[i].id, (int)sites[i].name_len, names + sites[i].name_offset,
+			   sites[i].line);
+	}
+	fclose(file);
+	printf("%zu mallocs, %zu reallocs, %zu frees, dropped events before %zu events\n", counts[MP_TRACE_MALLOC],
+		   counts[MP_TRACE_REALLOC], counts[MP_TRACE_FREE], dropped);
+	remove(path);
+
+	// Nothing is lost unless a ring overflowed
+	int failed = counts[MP_TRACE_MALLOC] > THREAD_COUNT * alloc_count;
+	if (dropped == 0)
+		failed |= counts[MP_TRACE_MALLOC] != THREAD_COUNT * alloc_count ||
+				  counts[MP_TRACE_FREE] != counts[MP_TRACE_MALLOC];
+	return mp_terminate() != 0 || failed;
+}
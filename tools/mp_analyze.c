@@ -0,0 +1,437 @@
+// Offline analyzer for trace files written with MP_TRACE
+// Maps the trace in windows and makes a single pass over the events, so memory use depends on the number of live
+// blocks and the events of one drain of the rings, not on the size of the trace
+// Prints a peak usage timeline, the blocks still allocated when the trace stopped grouped by site, and a histogram of
+// block lifetimes per site
+// Usage: mp_analyze trace [-b timeline buckets] [-n sites to list]
+#include "magpie.h"
+#include "trace_reader.h"
+
+// Lifetimes are bucketed by powers of two nanoseconds
+#define ANALYZE_LIFETIME_BUCKETS 48
+
+struct SiteStats
+{
+	const char* file;
+	uint32_t name_len;
+	uint32_t line;
+	size_t allocs;
+	size_t frees;
+	size_t bytes;
+	size_t leaked_count;
+	size_t leaked_bytes;
+	size_t lifetimes[ANALYZE_LIFETIME_BUCKETS];
+};
+
+struct Analysis
+{
+	struct TraceBlockMap live;
+	// Frees and reallocs of blocks that have not been allocated in the trace yet
+	// Chunks of different threads are not ordered, so a free can be read before the allocation of its block
+	struct TraceBlockMap orphans;
+	// Indexed by site id
+	struct SiteStats* sites;
+	size_t site_count;
+	uint64_t start_time;
+	uint64_t stop_time;
+	// Change of live bytes and blocks in every bucket of the timeline
+	int64_t* bytes_delta;
+	int64_t* blocks_delta;
+	size_t bucket_count;
+	size_t event_count;
+	size_t chunk_count;
+	size_t dropped;
+	uint32_t threads;
+};
+
+// Returns the stats of a site id, growing the table if needed
+struct SiteStats* site_stats(struct Analysis* a, uint32_t site)
+{
+	if (site >= a->site_count)
+	{
+		size_t count = a->site_count ? a->site_count : 64;
+		while (count <= site)
+			count *= 2;
+		a->sites = realloc(a->sites, count * sizeof(*a->sites));
+		memset(a->sites + a->site_count, 0, (count - a->site_count) * sizeof(*a->sites));
+		a->site_count = count;
+	}
+	return &a->sites[site];
+}
+
+// Adds a change of live memory to the timeline
+void timeline_add(struct Analysis* a, uint64_t time, int64_t bytes, int64_t blocks)
+{
+	uint64_t span = a->stop_time - a->start_time + 1;
+	uint64_t t = time < a->start_time ? 0 : time - a->start_time;
+	size_t bucket = t >= span ? a->bucket_count - 1 : (size_t)((double)t / span * a->bucket_count);
+	a->bytes_delta[bucket] += bytes;
+	a->blocks_delta[bucket] += blocks;
+}
+
+// Records a block allocated at alloc_time which ended at end_time
+void block_ended(struct Analysis* a, struct TraceBlock* block, uint64_t end_time)
+{
+	struct SiteStats* stats = site_stats(a, block->site);
+	uint64_t lifetime = end_time > block->time ? end_time - block->time : 0;
+	size_t bucket = 0;
+	while (lifetime > 1 && bucket < ANALYZE_LIFETIME_BUCKETS - 1)
+	{
+		lifetime >>= 1;
+		bucket++;
+	}
+	stats->lifetimes[bucket]++;
+	stats->frees++;
+	timeline_add(a, end_time, -(int64_t)block->size, -1);
+}
+
+// Adds a block which got its pointer at time to the live blocks, or ends it if it was freed by an event read first
+// An earlier orphan is the free of a block allocated before the trace at the same address
+void block_started(struct Analysis* a, struct TraceBlock* block, uint64_t time)
+{
+	struct TraceBlock orphan;
+	if (trace_block_take(&a->orphans, block->ptr, &orphan) && orphan.time >= time)
+		block_ended(a, block, orphan.time);
+	else
+		trace_block_put(&a->live, *block);
+}
+
+void process_event(struct Analysis* a, const struct MPTraceEvent* e)
+{
+	struct TraceBlock block;
+	a->dropped += e->flags & MP_TRACE_FLAG_DROPPED;
+	if (e->thread > a->threads)
+		a->threads = e->thread;
+
+	switch (e->op)
+	{
+	case MP_TRACE_MALLOC:
+	case MP_TRACE_CALLOC:
+	{
+		struct SiteStats* stats = site_stats(a, e->site);
+		stats->allocs++;
+		stats->bytes += e->size;
+		block = (struct TraceBlock){e->ptr, e->time, e->size, e->site};
+		timeline_add(a, e->time, e->size, 1);
+		block_started(a, &block, e->time);
+		break;
+	}
+	case MP_TRACE_REALLOC:
+		if (trace_block_take(&a->live, e->old_ptr, &block))
+		{
+			site_stats(a, block.site)->bytes += e->size > block.size ? e->size - block.size : 0;
+			timeline_add(a, e->time, (int64_t)e->size - (int64_t)block.size, 0);
+			block.ptr = e->ptr;
+			block.size = e->size;
+			block_started(a, &block, e->time);
+		}
+		else
+		{
+			block = (struct TraceBlock){e->ptr, e->time, e->size, e->site};
+			site_stats(a, e->site)->bytes += e->size;
+			timeline_add(a, e->time, e->size, 1);
+			// Before the old block becomes an orphan, which has the same address if reallocated in place
+			block_started(a, &block, e->time);
+			// The old block ends once its allocation is read
+			trace_block_put(&a->orphans, (struct TraceBlock){e->old_ptr, e->time, 0, e->site});
+		}
+		break;
+	case MP_TRACE_FREE:
+		if (trace_block_take(&a->live, e->ptr, &block))
+			block_ended(a, &block, e->time);
+		else
+			trace_block_put(&a->orphans, (struct TraceBlock){e->ptr, e->time, e->size, e->site});
+		break;
+	}
+}
+
+// Extends the time span of the trace by the events of a chunk
+void chunk_span(struct Analysis* a, const struct MPTraceEvent* events, size_t count)
+{
+	if (count == 0)
+		return;
+	// Events of a chunk are in order
+	if (a->start_time == 0 || events[0].time < a->start_time)
+		a->start_time = events[0].time;
+	if (events[count - 1].time > a->stop_time)
+		a->stop_time = events[count - 1].time;
+}
+
+void chunk_process(struct Analysis* a, const struct MPTraceEvent* events, size_t count)
+{
+	for (size_t i = 0; i < count; i++)
+		process_event(a, &events[i]);
+	a->event_count += count;
+}
+
+// Events of the chunks written by one drain of the rings
+// The chunks of a drain overlap in time while drains follow each other, so merging the chunks of each drain orders
+// the events of the trace and a block is rarely freed by an event read before the ones reallocating it
+struct ChunkRound
+{
+	struct MPTraceEvent* events;
+	struct MPTraceEvent* sorted;
+	size_t count;
+	size_t cap;
+	// Number of the round each thread last had a chunk in plus one, a drain writes one chunk per thread
+	uint32_t* thread_round;
+	uint32_t number;
+};
+
+static const struct MPTraceEvent* sort_events;
+
+// Orders event indices by time, keeping the order of events of a thread with the same time
+int cmp_event_time(const void* a, const void* b)
+{
+	uint32_t ia = *(const uint32_t*)a;
+	uint32_t ib = *(const uint32_t*)b;
+	if (sort_events[ia].time != sort_events[ib].time)
+		return (sort_events[ia].time > sort_events[ib].time) - (sort_events[ia].time < sort_events[ib].time);
+	return (ia > ib) - (ia < ib);
+}
+
+// Processes the buffered events of the round by time and starts the next round
+void round_flush(struct Analysis* a, struct ChunkRound* round)
+{
+	uint32_t* order = malloc(round->count * sizeof(*order));
+	for (size_t i = 0; i < round->count; i++)
+		order[i] = i;
+	sort_events = round->events;
+	qsort(order, round->count, sizeof(*order), cmp_event_time);
+	for (size_t i = 0; i < round->count; i++)
+		round->sorted[i] = round->events[order[i]];
+	free(order);
+	chunk_process(a, round->sorted, round->count);
+	round->count = 0;
+	round->number++;
+}
+
+// Buffers the events of a chunk, processing the round before it first if the chunk starts a new one
+void round_add(struct Analysis* a, struct ChunkRound* round, const struct MPTraceChunk* chunk,
+			   const struct MPTraceEvent* events)
+{
+	if (round->thread_round == NULL)
+		round->thread_round = calloc(UINT16_MAX + 1, sizeof(*round->thread_round));
+	uint16_t thread = chunk->thread;
+	if (round->thread_round[thread] == round->number + 1)
+		round_flush(a, round);
+	round->thread_round[thread] = round->number + 1;
+	if (round->count + chunk->event_count > round->cap)
+	{
+		while (round->count + chunk->event_count > round->cap)
+			round->cap = round->cap ? round->cap * 2 : 4096;
+		round->events = realloc(round->events, round->cap * sizeof(*round->events));
+		round->sorted = realloc(round->sorted, round->cap * sizeof(*round->sorted));
+	}
+	memcpy(round->events + round->count, events, chunk->event_count * sizeof(*events));
+	round->count += chunk->event_count;
+}
+
+// Formats a duration in nanoseconds with a fitting unit
+const char* format_ns(char* buf, size_t len, double ns)
+{
+	if (ns < 1e3)
+		snprintf(buf, len, "%.0fns", ns);
+	else if (ns < 1e6)
+		snprintf(buf, len, "%.1fus", ns / 1e3);
+	else if (ns < 1e9)
+		snprintf(buf, len, "%.1fms", ns / 1e6);
+	else
+		snprintf(buf, len, "%.1fs", ns / 1e9);
+	return buf;
+}
+
+static struct Analysis* sort_analysis;
+
+// Orders site ids by leaked bytes, biggest first
+int cmp_leaked(const void* a, const void* b)
+{
+	const struct SiteStats* sa = &sort_analysis->sites[*(const uint32_t*)a];
+	const struct SiteStats* sb = &sort_analysis->sites[*(const uint32_t*)b];
+	return (sa->leaked_bytes < sb->leaked_bytes) - (sa->leaked_bytes > sb->leaked_bytes);
+}
+
+// Orders site ids by allocations, most first
+int cmp_allocs(const void* a, const void* b)
+{
+	const struct SiteStats* sa = &sort_analysis->sites[*(const uint32_t*)a];
+	const struct SiteStats* sb = &sort_analysis->sites[*(const uint32_t*)b];
+	return (sa->allocs < sb->allocs) - (sa->allocs > sb->allocs);
+}
+
+void print_site(struct SiteStats* stats, uint32_t id)
+{
+	if (stats->file)
+		printf("%.*s:%u", (int)stats->name_len, stats->file, stats->line);
+	else
+		printf("site %u", id);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s trace [-b timeline buckets] [-n sites to list]\n", argv[0]);
+		return 1;
+	}
+	size_t bucket_count = 20;
+	size_t site_limit = 10;
+	for (int i = 2; i + 1 < argc; i += 2)
+	{
+		if (strcmp(argv[i], "-b") == 0)
+			bucket_count = strtoull(argv[i + 1], NULL, 10);
+		else if (strcmp(argv[i], "-n") == 0)
+			site_limit = strtoull(argv[i + 1], NULL, 10);
+	}
+	if (bucket_count == 0)
+		bucket_count = 1;
+
+	struct TraceReader reader;
+	if (trace_open(&reader, argv[1]) != 0)
+		return 1;
+	struct MPTraceHeader header = reader.header;
+
+	struct Analysis a = {0};
+	a.bucket_count = bucket_count;
+	a.bytes_delta = calloc(bucket_count, sizeof(*a.bytes_delta));
+	a.blocks_delta = calloc(bucket_count, sizeof(*a.blocks_delta));
+	if (header.site_offset)
+	{
+		a.start_time = header.start_time;
+		a.stop_time = header.stop_time;
+	}
+	else
+	{
+		// The trace was not stopped, find its span from the chunks
+		struct MPTraceChunk chunk;
+		const struct MPTraceEvent* events;
+		while ((events = trace_next_chunk(&reader, &chunk)))
+			chunk_span(&a, events, chunk.event_count);
+		trace_rewind(&reader);
+	}
+
+	// Site names
+	char* names = NULL;
+	if (header.site_offset)
+	{
+		const struct MPTraceSiteTable* mapped_table =
+			trace_map(&reader, header.site_offset, sizeof(struct MPTraceSiteTable));
+		struct MPTraceSiteTable table = mapped_table ? *mapped_table : (struct MPTraceSiteTable){0};
+		size_t sites_len = table.count * sizeof(struct MPTraceSite);
+		const char* base = trace_map(&reader, header.site_offset + sizeof(table), sites_len + table.names_size);
+		names = malloc(table.names_size + 1);
+		if (base)
+			memcpy(names, base + sites_len, table.names_size);
+		for (size_t i = 0; base && i < table.count; i++)
+		{
+			const struct MPTraceSite* site = (const struct MPTraceSite*)base + i;
+			struct SiteStats* stats = site_stats(&a, site->id);
+			stats->file = names + site->name_offset;
+			stats->name_len = site->name_len;
+			stats->line = site->line;
+		}
+	}
+
+	struct ChunkRound round = {0};
+	struct MPTraceChunk chunk;
+	const struct MPTraceEvent* events;
+	while ((events = trace_next_chunk(&reader, &chunk)))
+	{
+		round_add(&a, &round, &chunk, events);
+		a.chunk_count++;
+	}
+	round_flush(&a, &round);
+	free(round.events);
+	free(round.sorted);
+	free(round.thread_round);
+
+	// Blocks never freed
+	size_t leaked_count = 0;
+	size_t leaked_bytes = 0;
+	for (size_t i = 0; i < a.live.size; i++)
+	{
+		struct TraceBlock* it = &a.live.items[i];
+		if (it->ptr == 0)
+			continue;
+		struct SiteStats* stats = site_stats(&a, it->site);
+		stats->leaked_count++;
+		stats->leaked_bytes += it->size;
+		leaked_count++;
+		leaked_bytes += it->size;
+	}
+
+	char buf[32];
+	printf("Trace of %zu events in %zu chunks from %u threads over %s\n", a.event_count, a.chunk_count, a.threads,
+		   format_ns(buf, sizeof buf, a.stop_time - a.start_time));
+	if (a.dropped)
+		printf("Events were dropped %zu times since buffers were full, results are incomplete\n", a.dropped);
+	if (a.orphans.count)
+		printf("%zu blocks allocated before the trace were freed or reallocated\n", a.orphans.count);
+
+	printf("\nLive memory at the end of each interval\n");
+	printf("%12s %14s %10s\n", "time", "bytes", "blocks");
+	int64_t bytes = 0;
+	int64_t blocks = 0;
+	int64_t peak = 0;
+	size_t peak_bucket = 0;
+	for (size_t i = 0; i < bucket_count; i++)
+	{
+		bytes += a.bytes_delta[i];
+		blocks += a.blocks_delta[i];
+		if (bytes > peak)
+		{
+			peak = bytes;
+			peak_bucket = i;
+		}
+		double end = (double)(a.stop_time - a.start_time) * (i + 1) / bucket_count;
+		printf("%12s %14lld %10lld\n", format_ns(buf, sizeof buf, end), (long long)bytes, (long long)blocks);
+	}
+	printf("Peak of %lld bytes in interval %zu\n", (long long)peak, peak_bucket + 1);
+
+	// Sites ordered for the reports
+	uint32_t* order = malloc(a.site_count * sizeof(*order));
+	size_t used = 0;
+	for (size_t i = 0; i < a.site_count; i++)
+	{
+		if (a.sites[i].allocs || a.sites[i].leaked_count)
+			order[used++] = i;
+	}
+	sort_analysis = &a;
+
+	printf("\n%zu blocks of %zu bytes were not freed\n", leaked_count, leaked_bytes);
+	qsort(order, used, sizeof(*order), cmp_leaked);
+	for (size_t i = 0; i < used && i < site_limit && a.sites[order[i]].leaked_count; i++)
+	{
+		struct SiteStats* stats = &a.sites[order[i]];
+		printf("%10zu blocks %14zu bytes at ", stats->leaked_count, stats->leaked_bytes);
+		print_site(stats, order[i]);
+		printf("\n");
+	}
+
+	printf("\nLifetimes of freed blocks\n");
+	qsort(order, used, sizeof(*order), cmp_allocs);
+	for (size_t i = 0; i < used && i < site_limit; i++)
+	{
+		struct SiteStats* stats = &a.sites[order[i]];
+		print_site(stats, order[i]);
+		printf(" made %zu allocations of %zu bytes, %zu freed\n", stats->allocs, stats->bytes, stats->frees);
+		for (size_t j = 0; j < ANALYZE_LIFETIME_BUCKETS; j++)
+		{
+			if (stats->lifetimes[j] == 0)
+				continue;
+			char upper[32];
+			printf("  %8s - %-8s %zu\n", format_ns(buf, sizeof buf, j ? (double)(1ull << j) : 0),
+				   format_ns(upper, sizeof upper, (double)(1ull << (j + 1))), stats->lifetimes[j]);
+		}
+	}
+
+	free(order);
+	free(names);
+	free(a.sites);
+	free(a.live.items);
+	free(a.orphans.items);
+	free(a.bytes_delta);
+	free(a.blocks_delta);
+	trace_close(&reader);
+	return 0;
+}
@@ -0,0 +1,365 @@
+// Replays the allocations of a trace written with MP_TRACE to compare allocators on real allocation patterns
+// Record with MP_TRACE_LOSSLESS so that no events are missing
+// Every recorded thread is replayed on its own thread, an operation on a block waits for the operations before it on
+// the same block, so the order between threads follows the timestamps of the trace
+// Prints the time of the replay and the peak RSS, measured in a child process so preparing the replay is not counted
+// Usage: mp_replay trace [-a raw|magpie|library.so] [-s]
+// -a selects the allocator, library.so is loaded with dlopen and its malloc, calloc, realloc and free are used
+// -s replays every thread on a single thread in the order of the timestamps
+#define MP_IMPLEMENTATION
+#define MP_THREAD_SAFE
+#include <stdio.h>
+#define MP_MESSAGE(m) fprintf(stderr, "%s\n", m)
+#include "magpie.h"
+#include "trace_reader.h"
+#include <pthread.h>
+#include <sched.h>
+#include <dlfcn.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// An operation on a block of the replay
+// Blocks are numbered in the order they are allocated, a realloc keeps the number of its block
+// seq counts the operations on the block before this one
+struct ReplayOp
+{
+	uint32_t block;
+	uint32_t op;
+	uint32_t seq;
+	uint64_t size;
+};
+
+struct ReplayThread
+{
+	struct ReplayOp* ops;
+	size_t count;
+	size_t cap;
+	uint16_t id;
+	pthread_t thread;
+};
+
+struct ReplayAllocator
+{
+	void* (*malloc)(size_t);
+	void* (*calloc)(size_t, size_t);
+	void* (*realloc)(void*, size_t);
+	void (*free)(void*);
+};
+
+// A recorded event and its position in the trace, to sort events by time without losing the order of a thread
+struct ReplayEvent
+{
+	uint64_t time;
+	uint64_t index;
+};
+
+static struct ReplayAllocator allocator;
+// The pointer of every block, NULL until allocated
+static void** blocks;
+// How many operations on every block are done
+static uint32_t* blocks_done;
+static size_t block_count;
+static pthread_barrier_t barrier;
+
+void* magpie_malloc(size_t size)
+{
+	return mp_malloc(size);
+}
+
+void* magpie_calloc(size_t num, size_t size)
+{
+	return mp_calloc(num, size);
+}
+
+void* magpie_realloc(void* ptr, size_t size)
+{
+	return mp_realloc(ptr, size);
+}
+
+void magpie_free(void* ptr)
+{
+	mp_free(ptr);
+}
+
+// Returns the pointer of the block of op, waiting until the operations before it on the block are done
+// A realloc keeps the number of its block, so a pointer being set does not mean the latest one is
+static inline void* replay_wait(struct ReplayOp* op)
+{
+	while (__atomic_load_n(&blocks_done[op->block], __ATOMIC_ACQUIRE) != op->seq)
+		sched_yield();
+	return __atomic_load_n(&blocks[op->block], __ATOMIC_RELAXED);
+}
+
+static inline void replay_op(struct ReplayOp* op)
+{
+	void* ptr = NULL;
+	// Allocations of 0 bytes may return NULL, which would look like a block not yet allocated
+	size_t size = op->size ? op->size : 1;
+	switch (op->op)
+	{
+	case MP_TRACE_MALLOC:
+		ptr = allocator.malloc(size);
+		break;
+	case MP_TRACE_CALLOC:
+		ptr = allocator.calloc(1, size);
+		break;
+	case MP_TRACE_REALLOC:
+		ptr = allocator.realloc(replay_wait(op), size);
+		break;
+	case MP_TRACE_FREE:
+		// A block is never used after its free, clearing it only marks it as released
+		allocator.free(replay_wait(op));
+		__atomic_store_n(&blocks[op->block], NULL, __ATOMIC_RELEASE);
+		__atomic_store_n(&blocks_done[op->block], op->seq + 1, __ATOMIC_RELEASE);
+		return;
+	}
+	if (ptr == NULL)
+	{
+		fprintf(stderr, "Failed to allocate %zu bytes\n", size);
+		exit(1);
+	}
+	// Touch the block like the program would
+	*(volatile char*)ptr = 0;
+	__atomic_store_n(&blocks[op->block], ptr, __ATOMIC_RELEASE);
+	__atomic_store_n(&blocks_done[op->block], op->seq + 1, __ATOMIC_RELEASE);
+}
+
+void* replay_thread(void* arg)
+{
+	struct ReplayThread* thread = arg;
+	pthread_barrier_wait(&barrier);
+	for (size_t i = 0; i < thread->count; i++)
+		replay_op(&thread->ops[i]);
+	return NULL;
+}
+
+// Number of operations pushed on every block so far and its capacity
+static uint32_t* block_seqs;
+static size_t block_seqs_cap;
+
+void replay_push(struct ReplayThread* thread, uint32_t block, uint32_t op, uint64_t size)
+{
+	if (thread->count == thread->cap)
+	{
+		thread->cap = thread->cap ? thread->cap * 2 : 1024;
+		thread->ops = realloc(thread->ops, thread->cap * sizeof(*thread->ops));
+	}
+	if (block >= block_seqs_cap)
+	{
+		size_t cap = block_seqs_cap ? block_seqs_cap * 2 : 1024;
+		block_seqs = realloc(block_seqs, cap * sizeof(*block_seqs));
+		memset(block_seqs + block_seqs_cap, 0, (cap - block_seqs_cap) * sizeof(*block_seqs));
+		block_seqs_cap = cap;
+	}
+	thread->ops[thread->count++] = (struct ReplayOp){block, op, block_seqs[block]++, size};
+}
+
+int event_cmp(const void* a, const void* b)
+{
+	const struct ReplayEvent* ea = a;
+	const struct ReplayEvent* eb = b;
+	if (ea->time != eb->time)
+		return (ea->time > eb->time) - (ea->time < eb->time);
+	return (ea->index > eb->index) - (ea->index < eb->index);
+}
+
+// Returns the resident set size of the process in KiB
+size_t current_rss()
+{
+	long pages = 0;
+	FILE* file = fopen("/proc/self/statm", "r");
+	if (file)
+	{
+		if (fscanf(file, "%*s %ld", &pages) != 1)
+			pages = 0;
+		fclose(file);
+	}
+	return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s trace [-a raw|magpie|library.so] [-s]\n", argv[0]);
+		return 1;
+	}
+	const char* allocator_name = "raw";
+	int single = 0;
+	for (int i = 2; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-a") == 0 && i + 1 < argc)
+			allocator_name = argv[++i];
+		else if (strcmp(argv[i], "-s") == 0)
+			single = 1;
+	}
+
+	if (strcmp(allocator_name, "raw") == 0)
+		allocator = (struct ReplayAllocator){malloc, calloc, realloc, free};
+	else if (strcmp(allocator_name, "magpie") == 0)
+		allocator = (struct ReplayAllocator){magpie_malloc, magpie_calloc, magpie_realloc, magpie_free};
+	else
+	{
+		void* lib = dlopen(allocator_name, RTLD_NOW | RTLD_LOCAL);
+		if (lib == NULL)
+		{
+			fprintf(stderr, "Failed to load %s: %s\n", allocator_name, dlerror());
+			return 1;
+		}
+		allocator.malloc = (void* (*)(size_t))dlsym(lib, "malloc");
+		allocator.calloc = (void* (*)(size_t, size_t))dlsym(lib, "calloc");
+		allocator.realloc = (void* (*)(void*, size_t))dlsym(lib, "realloc");
+		allocator.free = (void (*)(void*))dlsym(lib, "free");
+		if (!allocator.malloc || !allocator.calloc || !allocator.realloc || !allocator.free)
+		{
+			fprintf(stderr, "%s does not define malloc, calloc, realloc and free\n", allocator_name);
+			return 1;
+		}
+	}
+
+	struct TraceReader reader;
+	if (trace_open(&reader, argv[1]) != 0)
+		return 1;
+
+	// Copy the events to sort them by time
+	size_t event_count = 0;
+	size_t event_cap = 1024;
+	struct MPTraceEvent* events = malloc(event_cap * sizeof(*events));
+	struct MPTraceChunk chunk;
+	const struct MPTraceEvent* chunk_events;
+	size_t dropped = 0;
+	while ((chunk_events = trace_next_chunk(&reader, &chunk)))
+	{
+		while (event_count + chunk.event_count > event_cap)
+		{
+			event_cap *= 2;
+			events = realloc(events, event_cap * sizeof(*events));
+		}
+		memcpy(events + event_count, chunk_events, chunk.event_count * sizeof(*events));
+		event_count += chunk.event_count;
+	}
+	trace_close(&reader);
+
+	struct ReplayEvent* order = malloc(event_count * sizeof(*order));
+	for (size_t i = 0; i < event_count; i++)
+	{
+		order[i] = (struct ReplayEvent){events[i].time, i};
+		dropped += events[i].flags & MP_TRACE_FLAG_DROPPED;
+	}
+	qsort(order, event_count, sizeof(*order), event_cmp);
+	if (dropped)
+		fprintf(stderr, "Events were dropped %zu times while recording, record with MP_TRACE_LOSSLESS\n", dropped);
+
+	// Number the blocks and split the operations by thread
+	struct ReplayThread* threads = NULL;
+	size_t thread_count = 0;
+	// Index of the replay thread of every recorded thread
+	int32_t thread_index[UINT16_MAX + 1];
+	memset(thread_index, -1, sizeof thread_index);
+	struct TraceBlockMap live = {0};
+	size_t skipped = 0;
+	for (size_t i = 0; i < event_count; i++)
+	{
+		struct MPTraceEvent* e = &events[order[i].index];
+		uint16_t id = single ? 0 : e->thread;
+		if (thread_index[id] < 0)
+		{
+			threads = realloc(threads, (thread_count + 1) * sizeof(*threads));
+			threads[thread_count] = (struct ReplayThread){NULL, 0, 0, id};
+			thread_index[id] = thread_count++;
+		}
+		struct ReplayThread* thread = &threads[thread_index[id]];
+
+		struct TraceBlock block;
+		switch (e->op)
+		{
+		case MP_TRACE_MALLOC:
+		case MP_TRACE_CALLOC:
+			block = (struct TraceBlock){e->ptr, e->time, e->size, e->site, block_count++};
+			replay_push(thread, block.user, e->op, e->size);
+			trace_block_put(&live, block);
+			break;
+		case MP_TRACE_REALLOC:
+			if (trace_block_take(&live, e->old_ptr, &block))
+				replay_push(thread, block.user, e->op, e->size);
+			else
+			{
+				// Allocated before the trace started
+				block = (struct TraceBlock){e->ptr, e->time, e->size, e->site, block_count++};
+				replay_push(thread, block.user, MP_TRACE_MALLOC, e->size);
+			}
+			block.ptr = e->ptr;
+			trace_block_put(&live, block);
+			break;
+		case MP_TRACE_FREE:
+			if (trace_block_take(&live, e->ptr, &block))
+				replay_push(thread, block.user, e->op, 0);
+			else
+				skipped++;
+			break;
+		}
+		if (block_count > UINT32_MAX)
+		{
+			fprintf(stderr, "Trace has too many blocks to replay\n");
+			return 1;
+		}
+	}
+	free(order);
+	free(events);
+	free(live.items);
+	free(block_seqs);
+	if (skipped)
+		fprintf(stderr, "Skipped %zu frees of blocks allocated before the trace started\n", skipped);
+
+	// Replay in a child so its peak RSS does not include preparing the replay
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0)
+	{
+		blocks = calloc(block_count, sizeof(*blocks));
+		blocks_done = calloc(block_count, sizeof(*blocks_done));
+		size_t rss_before = current_rss();
+		pthread_barrier_init(&barrier, NULL, thread_count + 1);
+		for (size_t i = 0; i < thread_count; i++)
+			pthread_create(&threads[i].thread, NULL, replay_thread, &threads[i]);
+
+		struct timespec start, end;
+		pthread_barrier_wait(&barrier);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (size_t i = 0; i < thread_count; i++)
+			pthread_join(threads[i].thread, NULL);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		struct rusage usage;
+		getrusage(RUSAGE_SELF, &usage);
+		double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+		size_t op_count = 0;
+		for (size_t i = 0; i < thread_count; i++)
+			op_count += threads[i].count;
+
+		printf("allocator,threads,ops,blocks,seconds,ns_per_op,peak_rss_kib,replay_rss_kib\n");
+		printf("%s,%zu,%zu,%zu,%.6f,%.2f,%ld,%ld\n", allocator_name, thread_count, op_count, block_count, seconds,
+			   seconds * 1e9 / (op_count ? op_count : 1), usage.ru_maxrss, usage.ru_maxrss - (long)rss_before);
+		fflush(stdout);
+
+		// Release the blocks left allocated by the trace
+		for (size_t i = 0; i < block_count; i++)
+			allocator.free(blocks[i]);
+		if (strcmp(allocator_name, "magpie") == 0)
+			mp_terminate();
+		_exit(0);
+	}
+
+	int status = 1;
+	int waited = pid >= 0 && waitpid(pid, &status, 0) >= 0;
+	for (size_t i = 0; i < thread_count; i++)
+		free(threads[i].ops);
+	free(threads);
+	if (!waited)
+	{
+		fprintf(stderr, "Failed to run the replay\n");
+		return 1;
+	}
+	return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
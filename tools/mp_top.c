@@ -0,0 +1,106 @@
+// Live heap usage of a running program publishing statistics with MP_SHM
+// Attaches to the shared memory object and redraws the global counters and the sites with the most live bytes
+// Stops once the program stops publishing
+// Usage: mp_top pid|name [-i interval ms] [-n sites to list] [-1]
+// -1 prints a single update and exits
+#include "magpie.h"
+#include "shm_reader.h"
+#include <stdlib.h>
+#include <time.h>
+
+// Prints size with a binary unit
+static void print_bytes(char* buf, size_t len, uint64_t size)
+{
+	const char* units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+	double value = size;
+	size_t unit = 0;
+	while (value >= 1024 && unit < 4)
+	{
+		value /= 1024;
+		unit++;
+	}
+	if (unit == 0)
+		snprintf(buf, len, "%llu B", (unsigned long long)size);
+	else
+		snprintf(buf, len, "%.1f %s", value, units[unit]);
+}
+
+static void print_update(const struct MPShmHeader* header, const struct MPShmSite* sites, size_t site_limit)
+{
+	char size[32], peak[32], total[32];
+	print_bytes(size, sizeof size, header->size);
+	print_bytes(peak, sizeof peak, header->peak_size);
+	print_bytes(total, sizeof total, header->total_size);
+	printf("magpie pid %llu%s\n", (unsigned long long)header->pid, header->stopped ? " (stopped)" : "");
+	printf("Live %llu blocks, %s, peak %llu blocks, %s\n", (unsigned long long)header->count, size,
+		   (unsigned long long)header->peak_count, peak);
+	printf("Total %llu allocations, %s\n\n", (unsigned long long)header->total_count, total);
+	printf("%12s %12s %12s %12s  %s\n", "Live", "Blocks", "Peak", "Allocs", "Site");
+	for (size_t i = 0; i < header->site_count && i < site_limit; i++)
+	{
+		const struct MPShmSite* it = &sites[i];
+		print_bytes(size, sizeof size, it->live_size);
+		print_bytes(peak, sizeof peak, it->peak_size);
+		printf("%12s %12llu %12s %12llu  %s:%u\n", size, (unsigned long long)it->live_count, peak,
+			   (unsigned long long)it->total_count, it->file, it->line);
+	}
+	fflush(stdout);
+}
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s pid|name [-i interval ms] [-n sites to list] [-1]\n", argv[0]);
+		return 1;
+	}
+	uint64_t interval = 1000;
+	size_t site_limit = 20;
+	int once = 0;
+	for (int i = 2; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-1") == 0)
+			once = 1;
+		else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc)
+			interval = strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+			site_limit = strtoull(argv[++i], NULL, 10);
+	}
+
+	// A bare pid names the default object of that process
+	char name[256];
+	char* end;
+	unsigned long pid = strtoul(argv[1], &end, 10);
+	if (*argv[1] && *end == '\0')
+		snprintf(name, sizeof name, "/magpie.%lu", pid);
+	else
+		snprintf(name, sizeof name, "%s", argv[1]);
+
+	struct ShmReader reader;
+	if (shm_attach(&reader, name) != 0)
+		return 1;
+	struct MPShmSite* sites = calloc(reader.site_capacity + 1, sizeof(*sites));
+	struct MPShmHeader header;
+	// Only redraws in place on a terminal so the output can be logged
+	int clear = isatty(STDOUT_FILENO);
+	for (;;)
+	{
+		if (shm_read(&reader, &header, sites) != 0)
+		{
+			fprintf(stderr, "Failed to read a consistent update from %s\n", name);
+			break;
+		}
+		if (clear)
+			printf("\033[H\033[J");
+		print_update(&header, sites, site_limit);
+		if (once || header.stopped)
+			break;
+		struct timespec ts = {interval / 1000, (long)(interval % 1000) * 1000000};
+		nanosleep(&ts, NULL);
+		if (!clear)
+			printf("\n");
+	}
+	free(sites);
+	shm_detach(&reader);
+	return 0;
+}
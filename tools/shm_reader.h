@@ -0,0 +1,91 @@
+// Reads the live statistics published with MP_SHM from another process
+// Shared by the tools, include after magpie.h
+#ifndef SHM_READER_H
+#define SHM_READER_H
+#include <stdio.h>
+#include <string.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Copies attempted before giving up on a publisher that keeps writing
+#define SHM_READ_TRIES 1000
+
+struct ShmReader
+{
+	const struct MPShmHeader* shm;
+	size_t len;
+	uint32_t site_capacity;
+};
+
+// Maps the shared memory object name and checks its header
+// Returns 0 on success, otherwise prints why and returns -1
+static inline int shm_attach(struct ShmReader* reader, const char* name)
+{
+	memset(reader, 0, sizeof(*reader));
+	int fd = shm_open(name, O_RDONLY, 0);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "Failed to open shared memory object %s\n", name);
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+	reader->len = st.st_size;
+	const struct MPShmHeader* shm =
+		reader->len >= sizeof(struct MPShmHeader) ? mmap(NULL, reader->len, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (shm == MAP_FAILED)
+	{
+		fprintf(stderr, "Failed to map shared memory object %s\n", name);
+		return -1;
+	}
+	if (strcmp(shm->magic, MP_SHM_MAGIC) != 0 || shm->version != MP_SHM_VERSION ||
+		shm->site_size != sizeof(struct MPShmSite) ||
+		sizeof(struct MPShmHeader) + (size_t)shm->site_capacity * sizeof(struct MPShmSite) > reader->len)
+	{
+		fprintf(stderr, "%s is not published by this version of magpie\n", name);
+		munmap((void*)shm, reader->len);
+		return -1;
+	}
+	reader->shm = shm;
+	reader->site_capacity = shm->site_capacity;
+	return 0;
+}
+
+// Copies a consistent update to header and its sites to sites, which has room for site_capacity sites
+// Returns 0 on success, -1 if every copy raced with the publisher
+static inline int shm_read(struct ShmReader* reader, struct MPShmHeader* header, struct MPShmSite* sites)
+{
+	const struct MPShmSite* mapped = (const struct MPShmSite*)(reader->shm + 1);
+	for (size_t i = 0; i < SHM_READ_TRIES; i++)
+	{
+		uint64_t sequence = __atomic_load_n(&reader->shm->sequence, __ATOMIC_ACQUIRE);
+		if (sequence & 1)
+		{
+			sched_yield();
+			continue;
+		}
+		memcpy(header, reader->shm, sizeof(*header));
+		memcpy(sites, mapped, reader->site_capacity * sizeof(*sites));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&reader->shm->sequence, __ATOMIC_RELAXED) == sequence)
+		{
+			if (header->site_count > reader->site_capacity)
+				header->site_count = reader->site_capacity;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static inline void shm_detach(struct ShmReader* reader)
+{
+	munmap((void*)reader->shm, reader->len);
+	reader->shm = NULL;
+}
+
+#endif
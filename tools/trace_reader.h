@@ -0,0 +1,206 @@
+// Reads trace files written with MP_TRACE by mapping a window of the file at a time
+// Also holds a map of blocks by pointer for following blocks through a trace
+// Shared by the tools, include after magpie.h
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Bytes of the trace mapped at once
+#define TRACE_WINDOW ((size_t)64 << 20)
+
+struct TraceReader
+{
+	int fd;
+	uint64_t file_size;
+	char* window;
+	uint64_t window_offset;
+	size_t window_len;
+	struct MPTraceHeader header;
+	// Offset of the next chunk
+	uint64_t offset;
+};
+
+// Returns a pointer to len bytes at offset, or NULL if they are past the end of the file
+// The pointer is valid until the next call
+static inline const void* trace_map(struct TraceReader* reader, uint64_t offset, size_t len)
+{
+	if (offset + len > reader->file_size)
+		return NULL;
+	if (reader->window && offset >= reader->window_offset &&
+		offset + len <= reader->window_offset + reader->window_len)
+		return reader->window + (offset - reader->window_offset);
+
+	if (reader->window)
+		munmap(reader->window, reader->window_len);
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	uint64_t start = offset / page * page;
+	size_t window_len = offset + len - start > TRACE_WINDOW ? offset + len - start : TRACE_WINDOW;
+	if (start + window_len > reader->file_size)
+		window_len = reader->file_size - start;
+	reader->window = mmap(NULL, window_len, PROT_READ, MAP_PRIVATE, reader->fd, start);
+	if (reader->window == MAP_FAILED)
+	{
+		reader->window = NULL;
+		return NULL;
+	}
+	madvise(reader->window, window_len, MADV_SEQUENTIAL);
+	reader->window_offset = start;
+	reader->window_len = window_len;
+	return reader->window + (offset - start);
+}
+
+// Opens the trace at path and checks its header
+// Returns 0 on success, otherwise prints why and returns -1
+static inline int trace_open(struct TraceReader* reader, const char* path)
+{
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = open(path, O_RDONLY);
+	struct stat st;
+	if (reader->fd < 0 || fstat(reader->fd, &st) != 0)
+	{
+		fprintf(stderr, "Failed to open %s\n", path);
+		return -1;
+	}
+	reader->file_size = st.st_size;
+	const struct MPTraceHeader* header = trace_map(reader, 0, sizeof(struct MPTraceHeader));
+	if (header == NULL || strcmp(header->magic, MP_TRACE_MAGIC) != 0 || header->version != MP_TRACE_VERSION ||
+		header->event_size != sizeof(struct MPTraceEvent))
+	{
+		fprintf(stderr, "%s is not a trace of this version of magpie\n", path);
+		close(reader->fd);
+		return -1;
+	}
+	reader->header = *header;
+	reader->offset = sizeof(struct MPTraceHeader);
+	if (reader->header.site_offset == 0)
+		fprintf(stderr, "Trace was not stopped, reading until the last complete chunk\n");
+	return 0;
+}
+
+// Returns the events of the next chunk and stores its header in chunk
+// Returns NULL after the last complete chunk
+// The events are valid until the next call
+static inline const struct MPTraceEvent* trace_next_chunk(struct TraceReader* reader, struct MPTraceChunk* chunk)
+{
+	uint64_t end = reader->header.site_offset ? reader->header.site_offset : reader->file_size;
+	if (reader->offset + sizeof(*chunk) > end)
+		return NULL;
+	const struct MPTraceChunk* mapped = trace_map(reader, reader->offset, sizeof(*chunk));
+	if (mapped == NULL)
+		return NULL;
+	*chunk = *mapped;
+	size_t len = chunk->event_count * sizeof(struct MPTraceEvent);
+	if (reader->offset + sizeof(*chunk) + len > end)
+		return NULL;
+	const struct MPTraceEvent* events = trace_map(reader, reader->offset + sizeof(*chunk), len);
+	if (events)
+		reader->offset += sizeof(*chunk) + len;
+	return events;
+}
+
+// Starts reading from the first chunk again
+static inline void trace_rewind(struct TraceReader* reader)
+{
+	reader->offset = sizeof(struct MPTraceHeader);
+}
+
+static inline void trace_close(struct TraceReader* reader)
+{
+	if (reader->window)
+		munmap(reader->window, reader->window_len);
+	close(reader->fd);
+}
+
+// A block seen in a trace
+struct TraceBlock
+{
+	// 0 if the slot is empty
+	uint64_t ptr;
+	uint64_t time;
+	uint64_t size;
+	uint32_t site;
+	// Free for the tool to use
+	uint32_t user;
+};
+
+// Open addressing map of blocks keyed by pointer
+// Linear probing with backward shift deletion
+struct TraceBlockMap
+{
+	size_t size;
+	size_t count;
+	struct TraceBlock* items;
+};
+
+static inline size_t trace_block_hash(uint64_t ptr, size_t size)
+{
+	return (ptr * 0x9e3779b97f4a7c15ull >> 20) & (size - 1);
+}
+
+static inline void trace_block_put(struct TraceBlockMap* map, struct TraceBlock block);
+
+static inline void trace_block_grow(struct TraceBlockMap* map)
+{
+	struct TraceBlockMap old = *map;
+	map->size = old.size ? old.size * 2 : 1024;
+	map->count = 0;
+	map->items = calloc(map->size, sizeof(*map->items));
+	for (size_t i = 0; i < old.size; i++)
+	{
+		if (old.items[i].ptr)
+			trace_block_put(map, old.items[i]);
+	}
+	free(old.items);
+}
+
+// Inserts block, replacing a block with the same pointer
+static inline void trace_block_put(struct TraceBlockMap* map, struct TraceBlock block)
+{
+	if (map->count + 1 >= map->size * 0.7)
+		trace_block_grow(map);
+	size_t mask = map->size - 1;
+	size_t pos = trace_block_hash(block.ptr, map->size);
+	while (map->items[pos].ptr && map->items[pos].ptr != block.ptr)
+		pos = (pos + 1) & mask;
+	if (map->items[pos].ptr == 0)
+		map->count++;
+	map->items[pos] = block;
+}
+
+// Removes the block of ptr and stores it in block
+// Returns 0 if ptr is not in the map
+static inline int trace_block_take(struct TraceBlockMap* map, uint64_t ptr, struct TraceBlock* block)
+{
+	if (map->size == 0)
+		return 0;
+	size_t mask = map->size - 1;
+	size_t pos = trace_block_hash(ptr, map->size);
+	while (map->items[pos].ptr != ptr)
+	{
+		if (map->items[pos].ptr == 0)
+			return 0;
+		pos = (pos + 1) & mask;
+	}
+	*block = map->items[pos];
+	map->count--;
+
+	// Move back blocks which would be unreachable through the hole
+	size_t hole = pos;
+	for (size_t i = (pos + 1) & mask; map->items[i].ptr; i = (i + 1) & mask)
+	{
+		size_t home = trace_block_hash(map->items[i].ptr, map->size);
+		if (((i - home) & mask) >= ((i - hole) & mask))
+		{
+			map->items[hole] = map->items[i];
+			hole = i;
+		}
+	}
+	map->items[hole].ptr = 0;
+	return 1;
+}
+#endif